@@ -6,22 +6,88 @@
 
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <pthread.h>
+#include <regex.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#if defined(__GNUC__) && defined(__x86_64__)
+#define CAX_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+// make microbench: every allocation the editor asks for is counted
+#ifdef CAX_MICROBENCH
+uint64_t bench_allocs;
+
+void *benchMalloc(size_t n) {
+  bench_allocs++;
+  return malloc(n);
+}
+
+void *benchCalloc(size_t n, size_t size) {
+  bench_allocs++;
+  return calloc(n, size);
+}
+
+void *benchRealloc(void *p, size_t n) {
+  bench_allocs++;
+  return realloc(p, n);
+}
+
+char *benchStrdup(const char *s) {
+  bench_allocs++;
+  return strdup(s);
+}
+
+char *benchStrndup(const char *s, size_t n) {
+  bench_allocs++;
+  return strndup(s, n);
+}
+
+#define malloc(n) benchMalloc(n)
+#define calloc(n, size) benchCalloc(n, size)
+#define realloc(p, n) benchRealloc(p, n)
+#define strdup(s) benchStrdup(s)
+#define strndup(s, n) benchStrndup(s, n)
+#endif
+
 /*** Define ***/
 
 #define CAX_VERSION "0.01"
 #define CAX_TAB_STOP 8
 #define CAX_QUIT_TIMES 3
+#define CAX_HOT_BUDGET (256u << 20)
+#define CAX_COLD_BLOCK_ROWS 64
+#define CAX_COLD_BLOCK_BYTES 65536
+#define CAX_INDEX_CHUNK 256
+#define CAX_BRACKET_LOW (INT32_MIN / 2)
+#define CAX_UNDO_LEVELS 1000
+#define CAX_JOURNAL_SYNC_MS 1000
+#define CAX_DIFF_MAX_EDITS 1024
+#define CAX_DIFF_MAX_COST (1u << 24)
+#define FNV1A_INIT 1469598103934665603ull
 #define CTRL_KEY(k) ((k) & 0x1f)
 
 enum editorKey{
@@ -34,7 +100,12 @@ enum editorKey{
   HOME_KEY,
   END_KEY,
   PAGE_UP,
-  PAGE_DOWN
+  PAGE_DOWN,
+  ALT_ARROW_UP,
+  ALT_ARROW_DOWN,
+  SHIFT_TAB,
+  ALT_ARROW_LEFT,
+  ALT_ARROW_RIGHT
 };
 
 
@@ -49,48 +120,217 @@ enum editorHighlight {
   HL_MATCH
 };
 
-#define HL_HIGHLIGHT_NUMBERS (1<<0)
-#define HL_HIGHLIGHT_STRINGS (1<<1)
-
 
 /*** Data***/
 
+/* What a lexer token does once the automaton has matched it */
+enum lexAction {
+  LEX_TOKEN,                  // colour the token with hl
+  LEX_COMMENT,                // the rest of the row is a comment
+  LEX_MLCOMMENT,              // a comment runs up to multiline_comment_end
+  LEX_STRING                  // a string runs up to the same quote
+};
+
+struct lexRule {
+  int action;
+  int hl;
+  int word;                   // must be followed by a separator
+  int anywhere;               // may start in the middle of a word
+  int literal;                // text is matched as is, not as a regex
+  char *text;
+};
+
+/* Deterministic automaton for all the rules of a syntax; state 0 is dead */
+struct lexDfa {
+  uint32_t nstates;
+  uint16_t start_word;        // at the start of a word: every rule
+  uint16_t start_mid;         // inside a word: only "anywhere" rules
+  uint16_t (*next)[256];
+  int16_t *accept;            // best rule ending here, or -1
+  int16_t *accept_free;       // best rule ending here that is not a word
+};
+
 struct editorSyntax {
   char *filetype;
   char **filematch;
-  char **keywords;
   char *singleline_comment_start;
   char *multiline_comment_start;
   char *multiline_comment_end;
-  int flags;
+  unsigned char sep[256];     // separator characters
+  struct lexRule *rules;      // in priority order
+  int nrules;
+  uint64_t hash;              // of the definition, names the compiled cache
+  struct lexDfa *dfa;         // compiled on first use
 };
 
 
+/* An earlier version of the open file that a save renamed a new one
+ * over, kept open for the blocks that are still read back from it */
+struct pagerFile {
+  int fd;
+  struct stat st;             // fd when it was read, to notice changes
+  int refs;
+};
+
+/* A run of cold rows whose chars are stored back to back, LZ compressed */
+struct coldBlock {
+  int refs;
+  size_t ulen;
+  size_t clen;
+  char *data;                 // NULL while the block is paged out
+  off_t foff;                 // payload is this range of the file, or -1
+  struct pagerFile *file;     // the file foff is in, NULL for E.srcfd
+  off_t swapoff;              // copy of data in the swap file, or -1
+  struct coldBlock *prev, *next;
+};
+
 // It stores a row of text
 typedef struct erow{
-  int idx;
-  int size;
-  int rsize;
+  size_t idx;
+  size_t size;
+  size_t rsize;
   char *chars;
   char *render;
   unsigned char *hl;
   int hl_open_comment;
+  size_t mem;                 // bytes of chars/render/hl counted as hot
+  struct coldBlock *cold;     // set while chars live only in a cold block
+  size_t coff;                // offset of chars inside the cold block
+  off_t foff;                 // where the unmodified line starts on disk
+  uint32_t wrapgen;           // layout generation wraplines belongs to
+  uint32_t wraplines;         // visual lines when soft wrapped
+  int indexed;                // its words are counted in the word index
+  int32_t bnet;               // brackets opened minus brackets closed
+  int32_t bmin;               // lowest depth reached relative to the start,
+                              // or 1 while the row has not been highlighted
+  int hidden;                 // folded away behind the row above it
 }erow;
 
+/* Bracket depth of a range of rows: what it adds up to, and the lowest
+ * point it reaches relative to where it starts */
+struct bracketNode {
+  int32_t net;
+  int32_t min;
+};
+
+/* Totals over a run of consecutive rows */
+struct rowSpan {
+  size_t rows;
+  size_t lines;               // visual lines under soft wrap
+  size_t shown;               // rows not folded away
+  struct bracketNode brackets; // of the highlighted rows; min may be low
+};
+
+/* The rows in chunks of about CAX_INDEX_CHUNK, each with its totals, and a
+ * segment tree adding the chunks up */
+struct rowIndex {
+  int built;                  // 0 until first needed after a bulk change
+  struct rowSpan *chunk;
+  size_t nchunks;
+  size_t cap;
+  struct rowSpan *tree;       // leaf size + c is chunk c
+  size_t size;                // leaves, a power of two
+};
+
+/* One row level change, recorded so that it can be reverted */
+enum undoType {
+  UNDO_CHANGE,                // row at had contents chars
+  UNDO_INSERT,                // row at was inserted
+  UNDO_DELETE,                // row at with contents chars was deleted
+  UNDO_INSERT_RANGE,          // count rows were inserted at at
+  UNDO_DELETE_RANGE,          // count rows, chars joined by '\n', deleted
+  UNDO_ROTATE                 // count rows at at were rotated by shift
+};
+
+/* Row level changes, as the recovery journal records them and the diff
+ * gutter follows them */
+enum rowChange {
+  ROW_SET = 1,                // row at now holds the text
+  ROW_INSERT,                 // count rows, the text joined by '\n', at at
+  ROW_DELETE,                 // count rows at at were deleted
+  ROW_ROTATE                  // count rows at at were rotated left by shift
+};
+
+/* How a row compares with the file on disk */
+enum diffMark {
+  DIFF_SAME,                  // equal to file line line
+  DIFF_ADDED,                 // not in the file
+  DIFF_CHANGED                // stands in for file line line, but differs
+};
+
+/* What the diff gutter knows about a row, kept beside E.row only while
+ * the diff is built */
+struct diffRow {
+  uint64_t hash;              // of the row's chars, or 0 if stale
+  size_t line;                // file line the row matches or stands in for
+  uint32_t del;               // file lines deleted just above the row
+  int mark;                   // DIFF_SAME, DIFF_ADDED or DIFF_CHANGED
+};
+
+struct undoRecord {
+  int type;
+  size_t at;
+  char *chars;
+  size_t size;
+  size_t count, shift;        // range records only
+};
+
+/* The changes made by one command, undone together */
+struct undoGroup {
+  struct undoRecord *recs;
+  size_t nrecs;
+  size_t cap;
+  size_t cx, cy;
+};
+
+/* An extra cursor; the primary one is E.cx, E.cy */
+struct editorCursor {
+  size_t cx, cy;
+};
+
 /* Here we are configuring the terminal window */
 struct editorConfig
 {
   // We will keep track of mouse cursor using x and y coordinates
-  int cx, cy;
-  int rx;
-  int rowoff;
-  int coloff;
+  size_t cx, cy;
+  size_t rx;
+  size_t rowoff;
+  size_t coloff;
+  size_t wrapoff;             // first visual line of rowoff on screen
+  int wrap;                   // soft wrap long rows instead of scrolling
+  uint32_t wrap_gen;          // bumped when every layout goes stale
+  struct rowIndex rows;       // visual lines, shown rows and brackets
+  size_t hidden;              // rows hidden in folds
+  struct editorCursor *cursors; // extra cursors, by row and then column
+  size_t ncursors;
+  size_t mark;                // other end of the marked lines, or -1
+  int gutter;                 // columns left of the text, for diff marks
   int screenRows;
   int screenCols;
-  int numrows;
+  size_t numrows;
   erow *row;
   int dirty;
   char * filename;
+  size_t hot_bytes;
+  size_t hot_budget;
+  size_t cold_bytes;
+  size_t cold_hand;
+  size_t max_resident;
+  size_t paged_bytes;
+  struct coldBlock *lru_head, *lru_tail;
+  int srcfd;
+  struct stat srcst;          // srcfd when it was read, to notice changes
+  size_t lost_blocks;         // dropped blocks that could not be read back
+  int swapfd;
+  off_t swap_end;
+  struct undoGroup *undo;
+  size_t nundo;
+  int undo_break;
+  int undo_suspended;
+  int grep_results;
+  int headless;               // batch mode: rows are neither drawn nor rendered
+  int shared;                 // other sessions share the file, which may
+                              // change under us; cold rows never point at it
   char statusmsg[80];
   time_t statusmsg_time;
   struct editorSyntax *syntax;
@@ -99,32 +339,123 @@ struct editorConfig
 
 struct editorConfig E;
 
+// set by the SIGWINCH handler, picked up between keys
+volatile sig_atomic_t winch;
+// in a daemon session, the socket its client forwards SIGWINCH over
+int winch_sock = -1;
+// set in a daemon's holder process, which has no terminal of its own
+int daemon_holder;
+
 /*** filetypes ***/
-char *C_HL_extensions[] = { ".c", ".h", ".cpp", NULL };
 
-char *C_HL_keywords[] = {
-  "switch", "if", "while", "for", "break", "continue", "return", "else",
-  "struct", "union", "typedef", "static", "enum", "class", "case",
-  "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
-  "void|", NULL
+// Built in, and used unless a syntax directory defines "c" as well
+char *C_HL_definition =
+  "filetype c\n"
+  "match .c .h .cpp\n"
+  "keywords1 switch if while for break continue return else struct union\n"
+  "keywords1 typedef static enum class case\n"
+  "keywords2 int long double float char unsigned signed void\n"
+  "comment //\n"
+  "multiline /* */\n"
+  "strings \"'\n"
+  "numbers\n";
+
+// Definitions in the order they are tried, loaded on first use
+struct editorSyntax *HLDB;
+size_t HLDB_ENTRIES;
+
+
+/* Session trace state: recording to or replaying from a --trace file */
+struct editorTrace {
+  FILE *fp;
+  int replaying;
+  int rows, cols;
+  char *filename;
+  uint64_t start_ns;
+  uint64_t last_ns;
+  int pending;
+  int pending_key;
+  uint64_t pending_ns;
 };
 
-struct editorSyntax HLDB[] = {
-  {
-    "c",
-    C_HL_extensions,
-    C_HL_keywords,
-    "//", "/*", "*/",
-    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
-  },
+struct editorTrace T;
+
+/* Lines produced by background threads, waiting to be appended as rows */
+struct rowFeed {
+  pthread_mutex_t lock;
+  char *buf;
+  size_t len;
+  size_t cap;
+  int producers;
+  int active;
+  int notify[2];
+  char *name;
+  int cancellable;
+  int cancelled;
+  void (*done)(void);
 };
-#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
+struct rowFeed F = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0, 0,
+                     { -1, -1 }, NULL, 0, 0, NULL };
 
 /*** prototypes ***/
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+char *editorPromptEx(char *prompt, void (*callback)(char *, int),
+                     int allow_empty);
+void editorOpen(char *filename);
+void editorInsertRow(size_t at, char *s, size_t len);
+erow *editorRow(size_t at);
+void editorColdMaybeSweep();
+void editorRenderRow(erow *row);
+int editorHighlightRow(erow *row);
+void editorFeedWait();
+void editorDelRow(size_t at);
+void editorUndoChange(size_t at);
+void editorUndoInsert(size_t at);
+void editorUndoDelete(size_t at);
+void editorUndoInsertRange(size_t at, size_t count);
+void editorUndoDeleteRange(size_t at, size_t count);
+void editorUndoRotate(size_t at, size_t count, size_t shift);
+void editorDelRows(size_t at, size_t n);
+void editorInsertRows(size_t at, char **lines, size_t *lens, size_t n);
+void editorRotateRows(size_t at, size_t n, size_t k);
+void editorUndoReset();
+void editorInitWindow();
+void editorInitBuffer();
+void editorWrapRelayout(erow *row);
+void editorWrapInvalidate();
+void editorHandleResize();
+void editorMoveCursor(int key);
+void editorCursorsClear();
+void editorRun();
+void editorFreeRow(erow *row);
+int openCacheLoad();
+void openCacheSave();
+void editorUpdateRows(size_t at, size_t n);
+size_t wrapCount(erow *row);
+void rowIndexReset();
+void rowIndexInsert(size_t at, size_t n);
+void rowIndexDelete(size_t at, size_t n);
+void rowIndexAdjust(size_t at, size_t n);
+void journalPut(int op, size_t at, size_t count, size_t shift, size_t nrows);
+void journalDiscard();
+void journalArm();
+void journalRecover();
+uint64_t fnv1a(uint64_t h, const void *data, size_t len);
+void bracketRowUpdate(erow *row);
+void daemonPollWinch();
+void handleSigWinch(int sig);
+struct bracketNode bracketCombine(struct bracketNode a, struct bracketNode b);
+void diffRowsChanged(int op, size_t at, size_t count, size_t shift);
+void foldRowsChanged(int op, size_t at, size_t count);
+size_t foldVisibleBefore(size_t at);
+size_t foldNth(size_t v);
+size_t foldNext(size_t at);
+size_t foldPrev(size_t at);
+void diffRebase();
+const char *editorRowPeek(erow *row);
 
 /*** Terminal ***/
 
@@ -132,11 +463,13 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int));
 void die(const char *s)
 {
 
-  // clears the screens before exit
-  write(STDOUT_FILENO, "\x1b[2J", 4);
+  if (!E.headless) {
+    // clears the screens before exit
+    write(STDOUT_FILENO, "\x1b[2J", 4);
 
-  // repositons the cursor before exit
-  write(STDOUT_FILENO, "\x1b[H", 3);
+    // repositons the cursor before exit
+    write(STDOUT_FILENO, "\x1b[H", 3);
+  }
 
   perror(s);
   exit(1);
@@ -183,16 +516,22 @@ void enableRawMode()
     die("tcsetattr");
 }
 
-// This functions reads the key input
-int editorReadKey()
+// This functions reads and decodes one key from the terminal
+int editorReadTtyKey()
 {
   int nread;
   char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1)
+  while (1)
   {
+    // rows streamed in while we wait for a key are drawn right away
+    if (F.active) editorFeedWait();
+    if (winch_sock != -1) daemonPollWinch();
+    if (winch) editorHandleResize();
+    if ((nread = read(STDIN_FILENO, &c, 1)) == 1)
+      break;
 
     // if no input then die
-    if (nread == -1 && errno != EAGAIN)
+    if (nread == -1 && errno != EAGAIN && errno != EINTR)
       die("read");
   }
 
@@ -209,6 +548,22 @@ int editorReadKey()
       if(seq[1] >= '0' && seq[1] <= '9'){
         if(read(STDIN_FILENO, &seq[2] , 1) != 1)
           return '\x1b';
+        if(seq[1] == '1' && seq[2] == ';'){
+          // ESC [ 1 ; 3 A is Alt-Up
+          char mod[2];
+          if(read(STDIN_FILENO, &mod[0], 1) != 1 ||
+             read(STDIN_FILENO, &mod[1], 1) != 1)
+            return '\x1b';
+          if(mod[0] == '3' && mod[1] == 'A')
+            return ALT_ARROW_UP;
+          if(mod[0] == '3' && mod[1] == 'B')
+            return ALT_ARROW_DOWN;
+          if(mod[0] == '3' && mod[1] == 'C')
+            return ALT_ARROW_RIGHT;
+          if(mod[0] == '3' && mod[1] == 'D')
+            return ALT_ARROW_LEFT;
+          return '\x1b';
+        }
         if(seq[2] == '~'){
           switch (seq[1]) {
             case '1':
@@ -242,6 +597,8 @@ int editorReadKey()
             return HOME_KEY;
           case 'F':
             return END_KEY;
+          case 'Z':
+            return SHIFT_TAB;
         }
       }
     } else if(seq[0] == 'O'){
@@ -256,7 +613,8 @@ int editorReadKey()
     return '\x1b';
   }
   else{
-    return c;
+    // bytes of UTF-8 sequences come through as 128..255
+    return (unsigned char)c;
   }
 }
 
@@ -309,471 +667,6640 @@ int getWindowSize(int *rows, int *cols)
   }
 }
 
+/*** Trace ***/
+
+/*
+ * A trace file starts with a small header (magic, version, window size and
+ * the name of the file that was open) followed by one record per decoded
+ * key. Every record is four LEB128 varints: nanoseconds since the previous
+ * key, the key code, the time spent processing it and the time spent
+ * rendering the frame that followed.
+ */
+#define CAX_TRACE_MAGIC "CAXTRACE"
+#define CAX_TRACE_VERSION 1
+#define CAX_TRACE_BUCKETS 24
+
+struct latencyHist {
+  uint64_t *samples;
+  size_t count;
+  size_t cap;
+  uint64_t total;
+  uint64_t bucket[CAX_TRACE_BUCKETS];
+};
 
-/*** syntax highlighting ***/
+struct latencyHist rec_proc, rec_render, play_proc, play_render;
 
-int is_separator(int c) {
-  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+void traceFlushPending(uint64_t proc_ns, uint64_t render_ns);
+
+uint64_t traceNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
 }
 
-void editorUpdateSyntax(erow *row) {
-  row->hl = realloc(row->hl, row->rsize);
-  memset(row->hl, HL_NORMAL, row->rsize);
+// Output goes nowhere while replaying, so the report stays readable
+void editorWrite(const void *buf, size_t len) {
+  if (T.replaying) return;
+  write(STDOUT_FILENO, buf, len);
+}
 
-  if (E.syntax == NULL) return;
+void traceWriteVarint(uint64_t v) {
+  unsigned char b[10];
+  int n = 0;
+  do {
+    b[n] = v & 0x7f;
+    v >>= 7;
+    if (v) b[n] |= 0x80;
+    n++;
+  } while (v);
+  fwrite(b, 1, n, T.fp);
+}
 
-  char **keywords = E.syntax->keywords;
+int traceReadVarint(uint64_t *v) {
+  int shift = 0;
+  int c;
+  *v = 0;
+  while ((c = fgetc(T.fp)) != EOF) {
+    *v |= (uint64_t)(c & 0x7f) << shift;
+    if (!(c & 0x80)) return 0;
+    shift += 7;
+    if (shift > 63) return -1;
+  }
+  return -1;
+}
 
-  char *scs = E.syntax->singleline_comment_start;
-  char *mcs = E.syntax->multiline_comment_start;
-  char *mce = E.syntax->multiline_comment_end;
+void histAdd(struct latencyHist *h, uint64_t ns) {
+  if (h->count == h->cap) {
+    h->cap = h->cap ? h->cap * 2 : 1024;
+    h->samples = realloc(h->samples, h->cap * sizeof(uint64_t));
+  }
+  h->samples[h->count++] = ns;
+  h->total += ns;
+
+  // bucket 0 is below 1us, bucket b covers [2^(b-1), 2^b) microseconds
+  uint64_t us = ns / 1000;
+  int b = 0;
+  while (us && b < CAX_TRACE_BUCKETS - 1) {
+    us >>= 1;
+    b++;
+  }
+  h->bucket[b]++;
+}
 
-  int scs_len = scs ? strlen(scs) : 0;
-  int mcs_len = mcs ? strlen(mcs) : 0;
-  int mce_len = mce ? strlen(mce) : 0;
+int cmpU64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
 
-  int prev_sep = 1;
-  int in_string = 0;
-  int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+uint64_t histPercentile(struct latencyHist *h, int pct) {
+  if (h->count == 0) return 0;
+  size_t i = (h->count - 1) * pct / 100;
+  return h->samples[i];
+}
 
-  int i = 0;
-  while (i < row->rsize) {
-    char c = row->render[i];
-    unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+void histPrintSummary(const char *name, struct latencyHist *h) {
+  qsort(h->samples, h->count, sizeof(uint64_t), cmpU64);
+  printf("  %-16s mean %9.1fus  p50 %9.1fus  p90 %9.1fus  p99 %9.1fus  max %9.1fus\n",
+         name, h->count ? h->total / 1000.0 / h->count : 0.0,
+         histPercentile(h, 50) / 1000.0, histPercentile(h, 90) / 1000.0,
+         histPercentile(h, 99) / 1000.0, histPercentile(h, 100) / 1000.0);
+}
 
-    if (scs_len && !in_string && !in_comment) {
-      if (!strncmp(&row->render[i], scs, scs_len)) {
-        memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-        break;
-      }
+void histPrintTable(const char *title, struct latencyHist *rec,
+                    struct latencyHist *play) {
+  int first = CAX_TRACE_BUCKETS, last = 0;
+  for (int b = 0; b < CAX_TRACE_BUCKETS; b++) {
+    if (rec->bucket[b] || play->bucket[b]) {
+      if (b < first) first = b;
+      last = b;
     }
+  }
+  printf("\n%s latency\n", title);
+  printf("  %-18s %10s %10s\n", "bucket", "recorded", "replayed");
+  for (int b = first; b <= last; b++) {
+    char label[48];
+    if (b == 0)
+      snprintf(label, sizeof(label), "< 1us");
+    else
+      snprintf(label, sizeof(label), "%llu-%lluus",
+               1ull << (b - 1), 1ull << b);
+    printf("  %-18s %10llu %10llu\n", label,
+           (unsigned long long)rec->bucket[b],
+           (unsigned long long)play->bucket[b]);
+  }
+  histPrintSummary("recorded", rec);
+  histPrintSummary("replayed", play);
+}
 
-    if (mcs_len && mce_len && !in_string) {
-      if (in_comment) {
-        row->hl[i] = HL_MLCOMMENT;
-        if (!strncmp(&row->render[i], mce, mce_len)) {
-          memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-          i += mce_len;
-          in_comment = 0;
-          prev_sep = 1;
-          continue;
-        } else {
-          i++;
-          continue;
-        }
-      } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-        memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-        i += mcs_len;
-        in_comment = 1;
-        continue;
-      }
-    }
+void traceReport() {
+  traceFlushPending(traceNow() - T.pending_ns, 0);
+  printf("Replayed %zu key events from %s\n", play_proc.count,
+         T.filename ? T.filename : "[No Name]");
+  histPrintTable("Processing", &rec_proc, &play_proc);
+  histPrintTable("Render", &rec_render, &play_render);
+  if (rec_proc.total + rec_render.total)
+    printf("\nreplay/recorded total time: %.2fx\n",
+           (double)(play_proc.total + play_render.total) /
+           (rec_proc.total + rec_render.total));
+}
 
-    if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-      if (in_string) {
-        row->hl[i] = HL_STRING;
+void traceClose() {
+  if (!T.fp) return;
+  traceFlushPending(traceNow() - T.pending_ns, 0);
+  fclose(T.fp);
+  T.fp = NULL;
+}
 
-        if (c == '\\' && i + 1 < row->rsize) {
-          row->hl[i + 1] = HL_STRING;
-          i += 2;
-          continue;
-        }
+// Opens FILE for recording. The header captures what is needed to rebuild
+// the session: the window size and the file that was opened.
+void traceStart(const char *path, int rows, int cols, const char *filename) {
+  T.fp = fopen(path, "wb");
+  if (!T.fp) die("trace");
+  uint32_t namelen = filename ? strlen(filename) : 0;
+  fwrite(CAX_TRACE_MAGIC, 1, 8, T.fp);
+  traceWriteVarint(CAX_TRACE_VERSION);
+  traceWriteVarint(rows);
+  traceWriteVarint(cols);
+  traceWriteVarint(namelen);
+  if (namelen) fwrite(filename, 1, namelen, T.fp);
+  T.start_ns = T.last_ns = traceNow();
+  atexit(traceClose);
+}
 
-        if (c == in_string) in_string = 0;
-        i++;
-        prev_sep = 1;
-        continue;
-        } 
-        else {
-          if (c == '"' || c == '\'') {
-            in_string = c;
-            row->hl[i] = HL_STRING;
-            i++;
-            continue;
-          }
-         }
-        }
+void traceReplayStart(const char *path) {
+  char magic[8];
+  uint64_t version, rows, cols, namelen;
+  T.fp = fopen(path, "rb");
+  if (!T.fp) die("replay");
+  if (fread(magic, 1, 8, T.fp) != 8 || memcmp(magic, CAX_TRACE_MAGIC, 8) ||
+      traceReadVarint(&version) || version != CAX_TRACE_VERSION ||
+      traceReadVarint(&rows) || traceReadVarint(&cols) ||
+      traceReadVarint(&namelen)) {
+    fprintf(stderr, "%s: not a cax trace file\n", path);
+    exit(1);
+  }
+  T.replaying = 1;
+  T.rows = rows;
+  T.cols = cols;
+  if (namelen) {
+    T.filename = malloc(namelen + 1);
+    if (fread(T.filename, 1, namelen, T.fp) != namelen) die("replay");
+    T.filename[namelen] = '\0';
+  }
+  atexit(traceReport);
+}
 
-    if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-      if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
-            (c == '.' && prev_hl == HL_NUMBER)) {
-        row->hl[i] = HL_NUMBER;
-        i++;
-        prev_sep = 0;
-        continue;
-      }
-    }
+// Flushes the key waiting for its frame, if the frame never came
+void traceFlushPending(uint64_t proc_ns, uint64_t render_ns) {
+  if (!T.pending) return;
+  T.pending = 0;
+  if (T.replaying) {
+    histAdd(&play_proc, proc_ns);
+    histAdd(&play_render, render_ns);
+    return;
+  }
+  traceWriteVarint(T.pending_ns - T.last_ns);
+  traceWriteVarint(T.pending_key);
+  traceWriteVarint(proc_ns);
+  traceWriteVarint(render_ns);
+  T.last_ns = T.pending_ns;
+}
 
-    if (prev_sep) {
-      int j;
-      for (j = 0; keywords[j]; j++) {
-        int klen = strlen(keywords[j]);
-        int kw2 = keywords[j][klen - 1] == '|';
-        if (kw2) klen--;
-        if (!strncmp(&row->render[i], keywords[j], klen) &&
-            is_separator(row->render[i + klen])) {
-          memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-          i += klen;
-          break;
-        }
-      }
-      if (keywords[j] != NULL) {
-        prev_sep = 0;
-        continue;
-      }
-    }
+void traceKey(int key) {
+  uint64_t now = traceNow();
+  traceFlushPending(now - T.pending_ns, 0);
+  T.pending = 1;
+  T.pending_key = key;
+  T.pending_ns = now;
+}
 
-    prev_sep = is_separator(c);
-    i++;
+void traceFrameDone(uint64_t frame_start) {
+  if (!T.pending) return;
+  traceFlushPending(frame_start - T.pending_ns, traceNow() - frame_start);
+}
+
+// Returns the next recorded key, or ends the replay when the trace runs out
+int traceReplayKey() {
+  uint64_t delta, key, proc, render;
+  if (traceReadVarint(&delta) || traceReadVarint(&key) ||
+      traceReadVarint(&proc) || traceReadVarint(&render)) {
+    traceFlushPending(traceNow() - T.pending_ns, 0);
+    exit(0);
   }
-  
-  int changed = (row->hl_open_comment != in_comment);
-  row->hl_open_comment = in_comment;
-  if (changed && row->idx + 1 < E.numrows)
-    editorUpdateSyntax(&E.row[row->idx + 1]);
+  histAdd(&rec_proc, proc);
+  histAdd(&rec_render, render);
+  traceKey(key);
+  return key;
+}
 
+int editorReadKey() {
+  if (T.replaying) return traceReplayKey();
+  int c = editorReadTtyKey();
+  if (T.fp) traceKey(c);
+  return c;
 }
 
-int editorSyntaxToColor(int hl) {
-  switch (hl) {
-    case HL_COMMENT:
-    case HL_MLCOMMENT: return 36;
-    case HL_KEYWORD1: return 33;
-    case HL_KEYWORD2: return 32;
-    case HL_STRING: return 35;
-    case HL_NUMBER: return 31;
-    case HL_MATCH: return 34;
-      
-    default: return 37;
+/*** Row feed ***/
+
+/*
+ * Producer threads hand complete '\n' terminated lines to the main thread
+ * through F.buf and poke F.notify; the main thread appends them as rows
+ * between keys, so neither side ever waits on the other for long.
+ */
+void feedStart(const char *name, int cancellable, void (*done)(void)) {
+  if (F.notify[0] == -1) {
+    if (pipe(F.notify) == -1) die("pipe");
+    fcntl(F.notify[0], F_SETFL, O_NONBLOCK);
+    fcntl(F.notify[1], F_SETFL, O_NONBLOCK);
   }
+  // producers of a cancelled feed notice quickly and go away
+  pthread_mutex_lock(&F.lock);
+  while (F.producers > 0) {
+    pthread_mutex_unlock(&F.lock);
+    usleep(1000);
+    pthread_mutex_lock(&F.lock);
+  }
+  F.cancelled = 0;
+  pthread_mutex_unlock(&F.lock);
+  free(F.name);
+  F.name = name ? strdup(name) : NULL;
+  F.cancellable = cancellable;
+  F.done = done;
+  F.active = 1;
 }
 
+// Drops whatever is queued and everything pushed from now on
+void feedCancel() {
+  pthread_mutex_lock(&F.lock);
+  F.cancelled = 1;
+  free(F.buf);
+  F.buf = NULL;
+  F.len = F.cap = 0;
+  pthread_mutex_unlock(&F.lock);
+  F.active = 0;
+}
 
+int feedCancelled() {
+  pthread_mutex_lock(&F.lock);
+  int cancelled = F.cancelled;
+  pthread_mutex_unlock(&F.lock);
+  return cancelled;
+}
 
-void editorSelectSyntaxHighlight() {
-  E.syntax = NULL;
-  if (E.filename == NULL) return;
-  char *ext = strrchr(E.filename, '.');
-  for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-    struct editorSyntax *s = &HLDB[j];
-    unsigned int i = 0;
-    while (s->filematch[i]) {
-      int is_ext = (s->filematch[i][0] == '.');
-      if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-          (!is_ext && strstr(E.filename, s->filematch[i]))) {
-        E.syntax = s;
-  
-        int filerow;
-        for (filerow = 0; filerow < E.numrows; filerow++) {
-          editorUpdateSyntax(&E.row[filerow]);
-        }
+void feedAddProducer() {
+  pthread_mutex_lock(&F.lock);
+  F.producers++;
+  pthread_mutex_unlock(&F.lock);
+}
 
-        return;
-      }
-      i++;
-    }
+void feedPush(const char *s, size_t len) {
+  pthread_mutex_lock(&F.lock);
+  if (F.cancelled) {
+    pthread_mutex_unlock(&F.lock);
+    return;
   }
+  int was_empty = (F.len == 0);
+  if (F.len + len > F.cap) {
+    while (F.len + len > F.cap) F.cap = F.cap ? F.cap * 2 : 65536;
+    F.buf = realloc(F.buf, F.cap);
+  }
+  memcpy(&F.buf[F.len], s, len);
+  F.len += len;
+  pthread_mutex_unlock(&F.lock);
+  if (was_empty) write(F.notify[1], "", 1);
 }
 
-/*** Row operations ***/
+void feedProducerDone() {
+  pthread_mutex_lock(&F.lock);
+  F.producers--;
+  pthread_mutex_unlock(&F.lock);
+  write(F.notify[1], "", 1);
+}
 
-int editorRowCxToRx(erow *row, int cx) {
-  int rx = 0;
-  int j;
-  for (j = 0; j < cx; j++) {
-    if (row->chars[j] == '\t')
-      rx += (CAX_TAB_STOP - 1) - (rx % CAX_TAB_STOP);
-    rx++;
+// Appends everything queued so far. Returns the number of rows added.
+int editorFeedDrain() {
+  char junk[64];
+  while (read(F.notify[0], junk, sizeof(junk)) > 0);
+
+  pthread_mutex_lock(&F.lock);
+  char *buf = F.buf;
+  size_t len = F.len;
+  F.buf = NULL;
+  F.len = F.cap = 0;
+  int finished = F.active && F.producers == 0 && !F.cancelled;
+  if (F.producers == 0) F.active = 0;
+  pthread_mutex_unlock(&F.lock);
+
+  int dirty = E.dirty;
+  int added = 0;
+  size_t start = 0;
+  E.undo_suspended++;
+  while (start < len) {
+    char *nl = memchr(&buf[start], '\n', len - start);
+    size_t linelen = (nl ? (size_t)(nl - buf) : len) - start;
+    size_t next = start + linelen + 1;
+    while (linelen > 0 && buf[start + linelen - 1] == '\r') linelen--;
+    editorInsertRow(E.numrows, &buf[start], linelen);
+    editorColdMaybeSweep();
+    added++;
+    start = next;
   }
-  return rx;
+  E.undo_suspended--;
+  E.dirty = dirty;
+  free(buf);
+  if (finished && F.done) F.done();
+  return added;
 }
 
-int editorRowRxToCx(erow *row, int rx) {
-  int cur_rx = 0;
-  int cx;
-  for (cx = 0; cx < row->size; cx++) {
-    if (row->chars[cx] == '\t')
-      cur_rx += (CAX_TAB_STOP - 1) - (cur_rx % CAX_TAB_STOP);
-    cur_rx++;
-    if (cur_rx > rx) return cx;
+// Blocks until a key is ready on the terminal, drawing streamed rows meanwhile
+void editorFeedWait() {
+  struct pollfd pfd[2] = {
+    { STDIN_FILENO, POLLIN, 0 },
+    { F.notify[0], POLLIN, 0 },
+  };
+  while (F.active) {
+    if (poll(pfd, 2, -1) == -1) {
+      if (errno == EINTR) {
+        if (winch) editorHandleResize();
+        continue;
+      }
+      die("poll");
+    }
+    if (pfd[1].revents) {
+      editorFeedDrain();
+      editorRefreshScreen();
+    }
+    if (pfd[0].revents) return;
   }
-  return cx;
 }
 
+// Reads the source fd in large chunks and queues complete lines
+void *feedReaderThread(void *arg) {
+  int fd = *(int *)arg;
+  free(arg);
+  size_t cap = 65536, len = 0;
+  char *chunk = malloc(cap);
+  ssize_t n;
+  while ((n = read(fd, &chunk[len], cap - len)) != 0) {
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    len += n;
+    char *last = NULL;
+    for (char *p = &chunk[len]; p > chunk; p--) {
+      if (p[-1] == '\n') {
+        last = p;
+        break;
+      }
+    }
+    if (last) {
+      feedPush(chunk, last - chunk);
+      len -= last - chunk;
+      memmove(chunk, last, len);
+    } else if (len == cap) {
+      cap *= 2;
+      chunk = realloc(chunk, cap);
+    }
+  }
+  // the last line may not end with a newline
+  if (len) {
+    chunk[len++] = '\n';
+    feedPush(chunk, len);
+  }
+  free(chunk);
+  close(fd);
+  feedProducerDone();
+  return NULL;
+}
+
+// Streams fd into the buffer from a background thread
+void editorStreamFd(int fd, const char *name) {
+  pthread_t tid;
+  int *arg = malloc(sizeof(int));
+  *arg = fd;
+  feedStart(name, 0, NULL);
+  feedAddProducer();
+  if (pthread_create(&tid, NULL, feedReaderThread, arg) != 0)
+    die("pthread_create");
+  pthread_detach(tid);
+}
 
-void editorUpdateRow(erow *row) {
-  int tabs = 0;
-  int j;
-  for (j = 0; j < row->size; j++)
-    if (row->chars[j] == '\t') tabs++;
-  free(row->render);
-  row->render = malloc(row->size + tabs*(CAX_TAB_STOP - 1) + 1);
-  int idx = 0;
-  for (j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t') {
-      row->render[idx++] = ' ';
-      while (idx % CAX_TAB_STOP != 0) row->render[idx++] = ' ';
-    } else {
-      row->render[idx++] = row->chars[j];
+/*** Lexer ***/
+
+// Syntax definitions are small text files, one directive per line:
+//
+//   filetype go
+//   match .go                    extensions, or substrings of the name
+//   keywords1 if else for ...    whole words, as many lines as needed
+//   keywords2 int string ...
+//   comment //
+//   multiline /* */
+//   strings "'`
+//   numbers
+//   separators ,.()+-/*=~%<>[];  (this is the default)
+//   pattern number 0x[0-9a-fA-F]+
+//
+// A pattern takes a class (comment, keyword1, keyword2, string, number)
+// and a regex with . [] [^] * + ? | () and \d \w \s. All the rules of a
+// definition are compiled into one DFA, so highlighting costs a table
+// lookup per character whatever the number of keywords. Definitions are
+// read from $CAX_SYNTAX_DIR, ~/.config/cax/syntax and the syntax directory
+// next to the cax binary, in that order, and only compiled once a file
+// needs them. Compiled automata are cached next to the open-state cache.
+
+#define LEX_MAX_STATES 65535
+#define LEX_CACHE_MAGIC "CAXLX01"
+
+struct lexCacheHeader {
+  char magic[8];
+  uint64_t hash;
+  uint32_t nstates;
+  uint16_t start_word;
+  uint16_t start_mid;
+};
+
+int cacheFilePath(const char *name, char *buf, size_t bufsize, int create);
+int writeAll(int fd, const char *buf, size_t len);
+
+char *syntaxNextWord(char **p) {
+  char *s = *p;
+  while (*s == ' ' || *s == '\t') s++;
+  if (!*s) return NULL;
+  char *w = s;
+  while (*s && *s != ' ' && *s != '\t') s++;
+  if (*s) *s++ = '\0';
+  *p = s;
+  return w;
+}
+
+void syntaxAddRule(struct editorSyntax *s, int action, int hl, int word,
+                   int anywhere, int literal, const char *text) {
+  s->rules = realloc(s->rules, sizeof(struct lexRule) * (s->nrules + 1));
+  struct lexRule *r = &s->rules[s->nrules++];
+  r->action = action;
+  r->hl = hl;
+  r->word = word;
+  r->anywhere = anywhere;
+  r->literal = literal;
+  r->text = strdup(text);
+}
+
+int syntaxClass(const char *name) {
+  if (!strcmp(name, "comment")) return HL_COMMENT;
+  if (!strcmp(name, "keyword1")) return HL_KEYWORD1;
+  if (!strcmp(name, "keyword2")) return HL_KEYWORD2;
+  if (!strcmp(name, "string")) return HL_STRING;
+  if (!strcmp(name, "number")) return HL_NUMBER;
+  return -1;
+}
+
+// Parses one definition. Returns 0, or -1 if it has no filetype.
+int syntaxParse(const char *text, struct editorSyntax *s) {
+  memset(s, 0, sizeof(*s));
+  char *seps = strdup(",.()+-/*=~%<>[];");
+  char *strings = NULL;
+  int numbers = 0;
+  int nmatch = 0;
+  // keywords and patterns come after the delimiters, which win ties
+  struct editorSyntax tokens;
+  memset(&tokens, 0, sizeof(tokens));
+  char *copy = strdup(text);
+
+  s->hash = 1469598103934665603ull;
+  for (const char *p = LEX_CACHE_MAGIC; *p; p++)
+    s->hash = (s->hash ^ (unsigned char)*p) * 1099511628211ull;
+  for (const char *p = text; *p; p++)
+    s->hash = (s->hash ^ (unsigned char)*p) * 1099511628211ull;
+
+  for (char *line = strtok(copy, "\n"); line; line = strtok(NULL, "\n")) {
+    size_t len = strlen(line);
+    while (len > 0 && isspace((unsigned char)line[len - 1])) line[--len] = '\0';
+    char *p = line;
+    char *dir = syntaxNextWord(&p);
+    char *w;
+    if (!dir || dir[0] == '#') continue;
+    if (!strcmp(dir, "filetype") && (w = syntaxNextWord(&p))) {
+      free(s->filetype);
+      s->filetype = strdup(w);
+    } else if (!strcmp(dir, "match")) {
+      while ((w = syntaxNextWord(&p))) {
+        s->filematch = realloc(s->filematch, sizeof(char *) * (nmatch + 2));
+        s->filematch[nmatch++] = strdup(w);
+        s->filematch[nmatch] = NULL;
+      }
+    } else if (!strcmp(dir, "keywords1") || !strcmp(dir, "keywords2")) {
+      int hl = dir[8] == '1' ? HL_KEYWORD1 : HL_KEYWORD2;
+      while ((w = syntaxNextWord(&p)))
+        syntaxAddRule(&tokens, LEX_TOKEN, hl, 1, 0, 1, w);
+    } else if (!strcmp(dir, "comment") && (w = syntaxNextWord(&p))) {
+      free(s->singleline_comment_start);
+      s->singleline_comment_start = strdup(w);
+    } else if (!strcmp(dir, "multiline") && (w = syntaxNextWord(&p))) {
+      char *end = syntaxNextWord(&p);
+      if (!end) continue;
+      free(s->multiline_comment_start);
+      free(s->multiline_comment_end);
+      s->multiline_comment_start = strdup(w);
+      s->multiline_comment_end = strdup(end);
+    } else if (!strcmp(dir, "strings") && (w = syntaxNextWord(&p))) {
+      free(strings);
+      strings = strdup(w);
+    } else if (!strcmp(dir, "numbers")) {
+      numbers = 1;
+    } else if (!strcmp(dir, "separators")) {
+      while (*p == ' ' || *p == '\t') p++;
+      free(seps);
+      seps = strdup(p);
+    } else if (!strcmp(dir, "pattern") && (w = syntaxNextWord(&p))) {
+      int hl = syntaxClass(w);
+      while (*p == ' ' || *p == '\t') p++;
+      if (hl != -1 && *p) syntaxAddRule(&tokens, LEX_TOKEN, hl, 0, 0, 0, p);
     }
   }
-  row->render[idx] = '\0';
-  row->rsize = idx;
-  editorUpdateSyntax(row);
 
+  if (s->singleline_comment_start)
+    syntaxAddRule(s, LEX_COMMENT, HL_COMMENT, 0, 1, 1,
+                  s->singleline_comment_start);
+  if (s->multiline_comment_start)
+    syntaxAddRule(s, LEX_MLCOMMENT, HL_MLCOMMENT, 0, 1, 1,
+                  s->multiline_comment_start);
+  for (char *q = strings; q && *q; q++) {
+    char quote[2] = { *q, '\0' };
+    syntaxAddRule(s, LEX_STRING, HL_STRING, 0, 1, 1, quote);
+  }
+  for (int i = 0; i < tokens.nrules; i++) {
+    struct lexRule *r = &tokens.rules[i];
+    syntaxAddRule(s, r->action, r->hl, r->word, r->anywhere, r->literal,
+                  r->text);
+    free(r->text);
+  }
+  free(tokens.rules);
+  if (numbers) syntaxAddRule(s, LEX_TOKEN, HL_NUMBER, 0, 0, 0, "[0-9][0-9.]*");
+
+  s->sep[0] = 1;
+  for (int c = 1; c < 256; c++) s->sep[c] = isspace(c) != 0;
+  for (const char *q = seps; *q; q++) s->sep[(unsigned char)*q] = 1;
+  free(seps);
+  free(strings);
+  free(copy);
+  if (!s->filetype) return -1;
+  if (!s->filematch) s->filematch = calloc(1, sizeof(char *));
+  return 0;
+}
+
+void syntaxLoadDir(const char *dir) {
+  DIR *d = opendir(dir);
+  if (!d) return;
+  struct dirent *de;
+  while ((de = readdir(d))) {
+    size_t len = strlen(de->d_name);
+    if (len < 8 || strcmp(de->d_name + len - 7, ".syntax")) continue;
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+    FILE *fp = fopen(path, "r");
+    if (!fp) continue;
+    char *text = NULL;
+    size_t cap = 0;
+    ssize_t n = getdelim(&text, &cap, '\0', fp);
+    fclose(fp);
+    struct editorSyntax s;
+    if (n > 0 && syntaxParse(text, &s) == 0) {
+      // the first definition of a filetype wins
+      size_t j;
+      for (j = 0; j < HLDB_ENTRIES; j++)
+        if (!strcmp(HLDB[j].filetype, s.filetype)) break;
+      if (j == HLDB_ENTRIES) {
+        HLDB = realloc(HLDB, sizeof(struct editorSyntax) * (HLDB_ENTRIES + 1));
+        HLDB[HLDB_ENTRIES++] = s;
+      }
+    }
+    free(text);
+  }
+  closedir(d);
 }
 
+void syntaxLoadAll() {
+  static int loaded;
+  if (loaded) return;
+  loaded = 1;
+  char path[4096];
+  const char *env = getenv("CAX_SYNTAX_DIR");
+  if (env && *env) syntaxLoadDir(env);
+  const char *xdg = getenv("XDG_CONFIG_HOME");
+  const char *home = getenv("HOME");
+  if (xdg && *xdg) {
+    snprintf(path, sizeof(path), "%s/cax/syntax", xdg);
+    syntaxLoadDir(path);
+  } else if (home && *home) {
+    snprintf(path, sizeof(path), "%s/.config/cax/syntax", home);
+    syntaxLoadDir(path);
+  }
+  ssize_t n = readlink("/proc/self/exe", path, sizeof(path) - 8);
+  if (n > 0) {
+    path[n] = '\0';
+    char *slash = strrchr(path, '/');
+    if (slash) {
+      strcpy(slash + 1, "syntax");
+      syntaxLoadDir(path);
+    }
+  }
+  struct editorSyntax c;
+  size_t j;
+  syntaxParse(C_HL_definition, &c);
+  for (j = 0; j < HLDB_ENTRIES; j++)
+    if (!strcmp(HLDB[j].filetype, c.filetype)) break;
+  if (j == HLDB_ENTRIES) {
+    HLDB = realloc(HLDB, sizeof(struct editorSyntax) * (HLDB_ENTRIES + 1));
+    HLDB[HLDB_ENTRIES++] = c;
+  }
+}
 
+/*
+ * Rules become a Thompson NFA, which subset construction turns into the
+ * DFA. NFA_EPS and NFA_SPLIT states only exist until then.
+ */
 
-void editorInsertRow(int at, char *s, size_t len) {
-  if (at < 0 || at > E.numrows) 
-    return;
-  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-  memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-  for (int j = at + 1; j <= E.numrows; j++) E.row[j].idx++;
+enum nfaType { NFA_CHAR, NFA_EPS, NFA_SPLIT, NFA_MATCH };
 
-  E.row[at].idx = at;
+struct nfaState {
+  int type;
+  int out, out1;
+  int rule;
+  unsigned char set[32];
+};
 
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
-  memcpy(E.row[at].chars, s, len);
-  E.row[at].chars[len] = '\0';
+struct nfa {
+  struct nfaState *s;
+  int n, cap;
+  const char *re;             // regex being parsed
+  int bad;
+};
 
+struct nfaFrag {
+  int start, end;             // end is an NFA_EPS state left dangling
+};
 
-  E.row[at].rsize = 0;
-  E.row[at].render = NULL;
-  E.row[at].hl = NULL;
-  E.row[at].hl_open_comment = 0;
-  editorUpdateRow(&E.row[at]);
+int nfaNew(struct nfa *a, int type) {
+  if (a->n == a->cap) {
+    a->cap = a->cap ? a->cap * 2 : 256;
+    a->s = realloc(a->s, sizeof(struct nfaState) * a->cap);
+  }
+  struct nfaState *s = &a->s[a->n];
+  memset(s, 0, sizeof(*s));
+  s->type = type;
+  s->out = s->out1 = -1;
+  return a->n++;
+}
 
-  E.numrows++;
-  E.dirty++;
+void nfaSetAdd(unsigned char *set, int c) {
+  set[c >> 3] |= 1 << (c & 7);
 }
 
-void editorFreeRow(erow *row) {
-  free(row->render);
-  free(row->chars);
-  free(row->hl);
+int nfaSetHas(const unsigned char *set, int c) {
+  return set[c >> 3] & (1 << (c & 7));
 }
 
-void editorDelRow(int at) {
-  if (at < 0 || at >= E.numrows) return;
-  editorFreeRow(&E.row[at]);
-  memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-  for (int j = at; j < E.numrows - 1; j++) E.row[j].idx--;
-  E.numrows--;
-  E.dirty++;
+struct nfaFrag nfaChars(struct nfa *a, const unsigned char *set) {
+  struct nfaFrag f;
+  f.start = nfaNew(a, NFA_CHAR);
+  f.end = nfaNew(a, NFA_EPS);
+  memcpy(a->s[f.start].set, set, 32);
+  a->s[f.start].out = f.end;
+  return f;
 }
 
-void editorRowInsertChar(erow *row, int at, int c) {
-  if (at < 0 || at > row->size) at = row->size;
-  row->chars = realloc(row->chars, row->size + 2);
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-  row->size++;
-  row->chars[at] = c;
-  editorUpdateRow(row);
-  E.dirty++;
+// Adds the class for \d, \w or \s to set; returns 0 for any other escape
+int nfaEscapeClass(unsigned char *set, int c) {
+  if (c != 'd' && c != 'w' && c != 's') return 0;
+  for (int i = 1; i < 256; i++)
+    if ((c == 'd' && isdigit(i)) || (c == 'w' && (isalnum(i) || i == '_')) ||
+        (c == 's' && isspace(i)))
+      nfaSetAdd(set, i);
+  return 1;
 }
 
-void editorInsertNewline() {
-  if (E.cx == 0) {
-    editorInsertRow(E.cy, "", 0);
+struct nfaFrag nfaAlt(struct nfa *a);
+
+struct nfaFrag nfaAtom(struct nfa *a) {
+  unsigned char set[32];
+  memset(set, 0, sizeof(set));
+  int c = (unsigned char)*a->re++;
+  if (c == '(') {
+    struct nfaFrag f = nfaAlt(a);
+    if (*a->re == ')') a->re++;
+    else a->bad = 1;
+    return f;
+  }
+  if (c == '.') {
+    for (int i = 1; i < 256; i++) nfaSetAdd(set, i);
+  } else if (c == '[') {
+    int negate = (*a->re == '^');
+    if (negate) a->re++;
+    int first = 1;
+    while (*a->re && (*a->re != ']' || first)) {
+      int lo = (unsigned char)*a->re++;
+      first = 0;
+      if (lo == '\\' && *a->re) {
+        lo = (unsigned char)*a->re++;
+        if (nfaEscapeClass(set, lo)) continue;
+      }
+      int hi = lo;
+      if (a->re[0] == '-' && a->re[1] && a->re[1] != ']') {
+        hi = (unsigned char)a->re[1];
+        a->re += 2;
+      }
+      for (int i = lo; i <= hi; i++) nfaSetAdd(set, i);
+    }
+    if (*a->re == ']') a->re++;
+    else a->bad = 1;
+    if (negate)
+      for (int i = 0; i < 32; i++) set[i] = ~set[i];
+    set[0] &= ~1;
+  } else if (c == '\\' && *a->re) {
+    c = (unsigned char)*a->re++;
+    if (!nfaEscapeClass(set, c)) nfaSetAdd(set, c);
   } else {
-    erow *row = &E.row[E.cy];
-    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-    row = &E.row[E.cy];
-    row->size = E.cx;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+    nfaSetAdd(set, c);
   }
-  E.cy++;
-  E.cx = 0;
+  return nfaChars(a, set);
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
-  row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(&row->chars[row->size], s, len);
-  row->size += len;
-  row->chars[row->size] = '\0';
-  editorUpdateRow(row);
-  E.dirty++;
+struct nfaFrag nfaRepeat(struct nfa *a) {
+  struct nfaFrag f = nfaAtom(a);
+  while (*a->re == '*' || *a->re == '+' || *a->re == '?') {
+    char op = *a->re++;
+    int split = nfaNew(a, NFA_SPLIT);
+    int end = nfaNew(a, NFA_EPS);
+    a->s[split].out = f.start;
+    a->s[split].out1 = end;
+    a->s[f.end].out = op == '?' ? end : split;
+    f.start = op == '+' ? f.start : split;
+    f.end = end;
+  }
+  return f;
 }
 
-void editorRowDelChar(erow *row, int at) {
-  if (at < 0 || at >= row->size) return;
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  row->size--;
-  editorUpdateRow(row);
-  E.dirty++;
+struct nfaFrag nfaConcat(struct nfa *a) {
+  struct nfaFrag f;
+  f.start = f.end = nfaNew(a, NFA_EPS);
+  while (*a->re && *a->re != '|' && *a->re != ')') {
+    struct nfaFrag g = nfaRepeat(a);
+    a->s[f.end].out = g.start;
+    f.end = g.end;
+  }
+  return f;
 }
 
-
+struct nfaFrag nfaAlt(struct nfa *a) {
+  struct nfaFrag f = nfaConcat(a);
+  while (*a->re == '|') {
+    a->re++;
+    struct nfaFrag g = nfaConcat(a);
+    int split = nfaNew(a, NFA_SPLIT);
+    int end = nfaNew(a, NFA_EPS);
+    a->s[split].out = f.start;
+    a->s[split].out1 = g.start;
+    a->s[f.end].out = end;
+    a->s[g.end].out = end;
+    f.start = split;
+    f.end = end;
+  }
+  return f;
+}
+
+// Returns the start state of rule r, which ends in an NFA_MATCH state
+int nfaRule(struct nfa *a, struct lexRule *r, int index) {
+  struct nfaFrag f;
+  if (r->literal) {
+    f.start = f.end = nfaNew(a, NFA_EPS);
+    for (const char *p = r->text; *p; p++) {
+      unsigned char set[32];
+      memset(set, 0, sizeof(set));
+      nfaSetAdd(set, (unsigned char)*p);
+      struct nfaFrag g = nfaChars(a, set);
+      a->s[f.end].out = g.start;
+      f.end = g.end;
+    }
+  } else {
+    a->re = r->text;
+    f = nfaAlt(a);
+    if (*a->re) a->bad = 1;
+  }
+  int m = nfaNew(a, NFA_MATCH);
+  a->s[m].rule = index;
+  a->s[f.end].out = m;
+  return f.start;
+}
+
+/* Subset construction state: every DFA state is a sorted set of NFA states */
+struct dfaBuild {
+  int **sets;
+  int *sizes;
+  int n;
+  int *table;                 // open addressing hash of sets -> state
+  int tablecap;
+  int *mark;
+  int gen;
+};
+
+uint64_t dfaSetHash(const int *set, int n) {
+  uint64_t h = 1469598103934665603ull;
+  for (int i = 0; i < n; i++) h = (h ^ (uint32_t)set[i]) * 1099511628211ull;
+  return h;
+}
+
+int cmpInt(const void *a, const void *b) {
+  int x = *(const int *)a, y = *(const int *)b;
+  return (x > y) - (x < y);
+}
+
+// Appends the NFA_CHAR and NFA_MATCH states reachable from s to out
+void dfaClosure(struct nfa *a, struct dfaBuild *b, int s, int *out, int *n) {
+  while (s != -1 && b->mark[s] != b->gen) {
+    b->mark[s] = b->gen;
+    struct nfaState *st = &a->s[s];
+    if (st->type == NFA_CHAR || st->type == NFA_MATCH) {
+      out[(*n)++] = s;
+      return;
+    }
+    if (st->type == NFA_SPLIT) dfaClosure(a, b, st->out1, out, n);
+    s = st->out;
+  }
+}
+
+// Returns the DFA state for the set, adding it if it is new
+int dfaIntern(struct dfaBuild *b, int *set, int n) {
+  qsort(set, n, sizeof(int), cmpInt);
+  if (b->n * 2 >= b->tablecap) {
+    int cap = b->tablecap ? b->tablecap * 2 : 1024;
+    int *table = malloc(sizeof(int) * cap);
+    for (int i = 0; i < cap; i++) table[i] = -1;
+    for (int d = 1; d < b->n; d++) {
+      size_t h = dfaSetHash(b->sets[d], b->sizes[d]) & (cap - 1);
+      while (table[h] != -1) h = (h + 1) & (cap - 1);
+      table[h] = d;
+    }
+    free(b->table);
+    b->table = table;
+    b->tablecap = cap;
+  }
+  size_t h = dfaSetHash(set, n) & (b->tablecap - 1);
+  while (b->table[h] != -1) {
+    int d = b->table[h];
+    if (b->sizes[d] == n && !memcmp(b->sets[d], set, sizeof(int) * n))
+      return d;
+    h = (h + 1) & (b->tablecap - 1);
+  }
+  b->table[h] = b->n;
+  b->sets = realloc(b->sets, sizeof(int *) * (b->n + 1));
+  b->sizes = realloc(b->sizes, sizeof(int) * (b->n + 1));
+  b->sets[b->n] = malloc(sizeof(int) * (n ? n : 1));
+  memcpy(b->sets[b->n], set, sizeof(int) * n);
+  b->sizes[b->n] = n;
+  return b->n++;
+}
+
+struct lexDfa *lexCompile(struct editorSyntax *syn) {
+  struct nfa a;
+  memset(&a, 0, sizeof(a));
+  int *starts = malloc(sizeof(int) * (syn->nrules ? syn->nrules : 1));
+  for (int i = 0; i < syn->nrules; i++) starts[i] = nfaRule(&a, &syn->rules[i], i);
+
+  struct dfaBuild b;
+  memset(&b, 0, sizeof(b));
+  b.mark = calloc(a.n, sizeof(int));
+  int *set = malloc(sizeof(int) * (a.n + 1));
+  int n;
+  b.n = 1;                    // state 0 is the dead state
+  b.sets = calloc(1, sizeof(int *));
+  b.sizes = calloc(1, sizeof(int));
+
+  struct lexDfa *d = calloc(1, sizeof(struct lexDfa));
+  for (int pass = 0; pass < 2; pass++) {
+    n = 0;
+    b.gen++;
+    for (int i = 0; i < syn->nrules; i++)
+      if (pass == 0 || syn->rules[i].anywhere)
+        dfaClosure(&a, &b, starts[i], set, &n);
+    int s = dfaIntern(&b, set, n);
+    if (pass == 0) d->start_word = s;
+    else d->start_mid = s;
+  }
+
+  size_t cap = 0;
+  for (int cur = 1; cur < b.n && !a.bad; cur++) {
+    if ((size_t)b.n > cap) {
+      cap = b.n * 2;
+      d->next = realloc(d->next, sizeof(*d->next) * cap);
+    }
+    for (int c = 0; c < 256; c++) {
+      n = 0;
+      b.gen++;
+      for (int k = 0; k < b.sizes[cur]; k++) {
+        struct nfaState *st = &a.s[b.sets[cur][k]];
+        if (st->type == NFA_CHAR && nfaSetHas(st->set, c))
+          dfaClosure(&a, &b, st->out, set, &n);
+      }
+      d->next[cur][c] = n ? dfaIntern(&b, set, n) : 0;
+      if (b.n > LEX_MAX_STATES) {
+        a.bad = 1;
+        break;
+      }
+      if ((size_t)b.n > cap) {
+        cap = b.n * 2;
+        d->next = realloc(d->next, sizeof(*d->next) * cap);
+      }
+    }
+  }
+
+  d->nstates = b.n;
+  d->next = realloc(d->next, sizeof(*d->next) * b.n);
+  memset(d->next[0], 0, sizeof(d->next[0]));
+  d->accept = malloc(sizeof(int16_t) * b.n);
+  d->accept_free = malloc(sizeof(int16_t) * b.n);
+  for (int s = 0; s < b.n; s++) {
+    d->accept[s] = d->accept_free[s] = -1;
+    for (int k = 0; k < b.sizes[s]; k++) {
+      struct nfaState *st = &a.s[b.sets[s][k]];
+      if (st->type != NFA_MATCH) continue;
+      if (d->accept[s] == -1 || st->rule < d->accept[s])
+        d->accept[s] = st->rule;
+      if (!syn->rules[st->rule].word &&
+          (d->accept_free[s] == -1 || st->rule < d->accept_free[s]))
+        d->accept_free[s] = st->rule;
+    }
+    free(b.sets[s]);
+  }
+  free(b.sets);
+  free(b.sizes);
+  free(b.table);
+  free(b.mark);
+  free(set);
+  free(starts);
+  free(a.s);
+  if (a.bad) {
+    free(d->next);
+    free(d->accept);
+    free(d->accept_free);
+    free(d);
+    return NULL;
+  }
+  return d;
+}
+
+// Maps a cached automaton for syn, if there is one
+struct lexDfa *lexCacheLoad(struct editorSyntax *syn) {
+  char name[64], path[4096];
+  snprintf(name, sizeof(name), "syntax-%016llx", (unsigned long long)syn->hash);
+  if (cacheFilePath(name, path, sizeof(path), 0) == -1) return NULL;
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) return NULL;
+  struct stat st;
+  struct lexCacheHeader h;
+  if (fstat(fd, &st) == -1 || read(fd, &h, sizeof(h)) != sizeof(h) ||
+      memcmp(h.magic, LEX_CACHE_MAGIC, sizeof(h.magic)) || h.hash != syn->hash ||
+      (size_t)st.st_size != sizeof(h) + (size_t)h.nstates * (512 + 4)) {
+    close(fd);
+    return NULL;
+  }
+  char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return NULL;
+  // a corrupted table would index past the map in editorHighlightRow
+  uint16_t (*next)[256] = (uint16_t (*)[256])(map + sizeof(h));
+  int16_t *accept = (int16_t *)(map + sizeof(h) + (size_t)h.nstates * 512);
+  int ok = h.nstates > 0 && h.start_word < h.nstates &&
+           h.start_mid < h.nstates;
+  for (size_t s = 0; ok && s < h.nstates; s++)
+    for (int c = 0; c < 256; c++)
+      if (next[s][c] >= h.nstates) ok = 0;
+  for (size_t s = 0; ok && s < (size_t)h.nstates * 2; s++)
+    if (accept[s] < -1 || accept[s] >= syn->nrules) ok = 0;
+  if (!ok) {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+  struct lexDfa *d = malloc(sizeof(struct lexDfa));
+  d->nstates = h.nstates;
+  d->start_word = h.start_word;
+  d->start_mid = h.start_mid;
+  d->next = next;
+  d->accept = accept;
+  d->accept_free = accept + h.nstates;
+  return d;
+}
+
+void lexCacheSave(struct editorSyntax *syn, struct lexDfa *d) {
+  char name[64], path[4096], tmp[4200];
+  snprintf(name, sizeof(name), "syntax-%016llx", (unsigned long long)syn->hash);
+  if (cacheFilePath(name, path, sizeof(path), 1) == -1) return;
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd == -1) return;
+  struct lexCacheHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, LEX_CACHE_MAGIC, sizeof(h.magic));
+  h.hash = syn->hash;
+  h.nstates = d->nstates;
+  h.start_word = d->start_word;
+  h.start_mid = d->start_mid;
+  int ok = writeAll(fd, (char *)&h, sizeof(h)) == 0 &&
+           writeAll(fd, (char *)d->next, (size_t)d->nstates * 512) == 0 &&
+           writeAll(fd, (char *)d->accept, d->nstates * 2) == 0 &&
+           writeAll(fd, (char *)d->accept_free, d->nstates * 2) == 0;
+  close(fd);
+  if (!ok || rename(tmp, path) == -1) unlink(tmp);
+}
+
+// Makes sure syn has its automaton. Returns -1 if it does not compile.
+int lexPrepare(struct editorSyntax *syn) {
+  if (syn->dfa) return 0;
+  syn->dfa = lexCacheLoad(syn);
+  if (syn->dfa) return 0;
+  syn->dfa = lexCompile(syn);
+  if (!syn->dfa) return -1;
+  lexCacheSave(syn, syn->dfa);
+  return 0;
+}
+
+/*** syntax highlighting ***/
+
+// Highlights a single row. Returns 1 when the row's open comment state
+// changed, meaning the row after it has to be highlighted again.
+int editorHighlightRow(erow *row) {
+  if (E.headless) return 0;
+  row->hl = realloc(row->hl, row->rsize);
+  memset(row->hl, HL_NORMAL, row->rsize);
+
+  if (E.syntax == NULL) {
+    bracketRowUpdate(row);
+    return 0;
+  }
+
+  struct editorSyntax *syn = E.syntax;
+  struct lexDfa *d = syn->dfa;
+  const unsigned char *r = (const unsigned char *)row->render;
+  const char *mce = syn->multiline_comment_end;
+  size_t mce_len = mce ? strlen(mce) : 0;
+  size_t n = row->rsize;
+  int prev_sep = 1;
+  int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+
+  size_t i = 0;
+  while (i < n) {
+    if (in_comment) {
+      const unsigned char *end = memmem(&r[i], n - i, mce, mce_len);
+      size_t stop = end ? (size_t)(end - r) + mce_len : n;
+      memset(&row->hl[i], HL_MLCOMMENT, stop - i);
+      i = stop;
+      if (end) {
+        in_comment = 0;
+        prev_sep = 1;
+      }
+      continue;
+    }
+
+    // longest token starting here; render is NUL terminated, and NUL is a
+    // separator, so r[j] is fine at the end of the row
+    uint16_t state = prev_sep ? d->start_word : d->start_mid;
+    size_t j = i, end = i;
+    int rule = -1;
+    while (j < n && (state = d->next[state][r[j]])) {
+      j++;
+      int a = d->accept[state];
+      if (a >= 0 && syn->rules[a].word && !syn->sep[r[j]])
+        a = d->accept_free[state];
+      if (a >= 0) {
+        rule = a;
+        end = j;
+      }
+    }
+    if (rule < 0) {
+      prev_sep = syn->sep[r[i]];
+      i++;
+      continue;
+    }
+
+    struct lexRule *lr = &syn->rules[rule];
+    switch (lr->action) {
+      case LEX_COMMENT:
+        memset(&row->hl[i], HL_COMMENT, n - i);
+        end = n;
+        break;
+      case LEX_MLCOMMENT:
+        memset(&row->hl[i], HL_MLCOMMENT, end - i);
+        in_comment = mce_len > 0;
+        break;
+      case LEX_STRING:
+        while (end < n && r[end] != r[i]) end += (r[end] == '\\' && end + 1 < n) ? 2 : 1;
+        if (end < n) end++;
+        memset(&row->hl[i], HL_STRING, end - i);
+        prev_sep = 1;
+        break;
+      default:
+        memset(&row->hl[i], lr->hl, end - i);
+        prev_sep = syn->sep[r[end - 1]];
+        break;
+    }
+    i = end;
+  }
+
+  int changed = (row->hl_open_comment != in_comment);
+  row->hl_open_comment = in_comment;
+  bracketRowUpdate(row);
+  return changed;
+}
+
+// Highlights row and carries a changed comment state down the rows below
+void editorUpdateSyntax(erow *row) {
+  while (editorHighlightRow(row) && row->idx + 1 < E.numrows)
+    row = editorRow(row->idx + 1);
+}
+
+int editorSyntaxToColor(int hl) {
+  switch (hl) {
+    case HL_COMMENT:
+    case HL_MLCOMMENT: return 36;
+    case HL_KEYWORD1: return 33;
+    case HL_KEYWORD2: return 32;
+    case HL_STRING: return 35;
+    case HL_NUMBER: return 31;
+    case HL_MATCH: return 34;
+      
+    default: return 37;
+  }
+}
+
+
+
+void editorSelectSyntaxHighlight() {
+  E.syntax = NULL;
+  if (E.filename == NULL) return;
+  syntaxLoadAll();
+  char *ext = strrchr(E.filename, '.');
+  for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
+    struct editorSyntax *s = &HLDB[j];
+    unsigned int i = 0;
+    while (s->filematch[i]) {
+      int is_ext = (s->filematch[i][0] == '.');
+      if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+          (!is_ext && strstr(E.filename, s->filematch[i]))) {
+        if (lexPrepare(s) == -1) {
+          editorSetStatusMessage("Syntax %s does not compile", s->filetype);
+          return;
+        }
+        E.syntax = s;
+  
+        size_t filerow;
+        for (filerow = 0; filerow < E.numrows; filerow++) {
+          editorHighlightRow(editorRow(filerow));
+          if ((filerow & 1023) == 0) editorColdMaybeSweep();
+        }
+
+        return;
+      }
+      i++;
+    }
+  }
+}
+
+/*** Compression ***/
+
+/*
+ * A small LZ77 codec in the spirit of LZ4: each sequence is a token byte
+ * (literal length in the high nibble, match length - 4 in the low nibble,
+ * 15 meaning "more length bytes follow"), the literals, and a 16-bit
+ * little endian match offset. The stream ends with a literal-only sequence.
+ */
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+
+uint32_t lzRead32(const unsigned char *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+size_t lzCompressBound(size_t n) {
+  return n + n / 255 + 16;
+}
+
+unsigned char *lzPutLength(unsigned char *op, size_t len) {
+  while (len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = len;
+  return op;
+}
+
+unsigned char *lzPutSequence(unsigned char *op, const unsigned char *lit,
+                             size_t litlen, size_t off, size_t mlen) {
+  unsigned char *token = op++;
+  *token = (litlen >= 15 ? 15 : litlen) << 4;
+  if (litlen >= 15) op = lzPutLength(op, litlen - 15);
+  memcpy(op, lit, litlen);
+  op += litlen;
+  if (mlen) {
+    *op++ = off & 0xff;
+    *op++ = off >> 8;
+    mlen -= LZ_MIN_MATCH;
+    *token |= mlen >= 15 ? 15 : mlen;
+    if (mlen >= 15) op = lzPutLength(op, mlen - 15);
+  }
+  return op;
+}
+
+// Compresses n bytes of src into dst, which must hold lzCompressBound(n)
+size_t lzCompress(const char *src, size_t n, char *dst) {
+  static uint32_t table[1 << LZ_HASH_BITS];
+  const unsigned char *base = (const unsigned char *)src;
+  const unsigned char *ip = base, *anchor = base, *end = base + n;
+  unsigned char *op = (unsigned char *)dst;
+
+  memset(table, 0, sizeof(table));
+  if (n > 12) {
+    const unsigned char *limit = end - 12;
+    while (ip < limit) {
+      uint32_t seq = lzRead32(ip);
+      uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+      const unsigned char *ref = base + table[h];
+      table[h] = ip - base;
+      if (ref >= ip || ip - ref > 65535 || lzRead32(ref) != seq) {
+        ip++;
+        continue;
+      }
+      size_t mlen = LZ_MIN_MATCH;
+      while (ip + mlen < end - 5 && ref[mlen] == ip[mlen]) mlen++;
+      op = lzPutSequence(op, anchor, ip - anchor, ip - ref, mlen);
+      ip += mlen;
+      anchor = ip;
+    }
+  }
+  op = lzPutSequence(op, anchor, end - anchor, 0, 0);
+  return op - (unsigned char *)dst;
+}
+
+size_t lzDecompress(const char *src, size_t clen, char *dst) {
+  const unsigned char *ip = (const unsigned char *)src, *iend = ip + clen;
+  unsigned char *op = (unsigned char *)dst;
+  while (ip < iend) {
+    unsigned token = *ip++;
+    size_t len = token >> 4;
+    if (len == 15) {
+      unsigned b;
+      do len += (b = *ip++); while (b == 255);
+    }
+    memcpy(op, ip, len);
+    op += len;
+    ip += len;
+    if (ip >= iend) break;
+
+    size_t off = ip[0] | (ip[1] << 8);
+    ip += 2;
+    len = token & 15;
+    if (len == 15) {
+      unsigned b;
+      do len += (b = *ip++); while (b == 255);
+    }
+    len += LZ_MIN_MATCH;
+    const unsigned char *ref = op - off;
+    if (off >= len) {
+      memcpy(op, ref, len);
+      op += len;
+    } else {
+      while (len--) *op++ = *ref++;
+    }
+  }
+  return op - (unsigned char *)dst;
+}
+
+/*** Paging ***/
+
+/*
+ * With --max-resident set, compressed cold blocks are paged out, least
+ * recently used first, whenever the resident size goes over the ceiling.
+ * Blocks laid out like the file are simply dropped and re-read from
+ * E.srcfd, or, once a save has renamed a new file over it, from the old
+ * file, which stays open until no block needs it. Everything else is
+ * appended to a private, already unlinked, swap file. Blocks never change
+ * once written, so a block that was paged in and out again keeps its swap
+ * copy. A file changed or cut short since it was read is never trusted
+ * again: blocks still in memory go to the swap file instead, and one that
+ * was already dropped comes back as '?' with an error in the status bar.
+ * A save that runs into one fails rather than write it out.
+ */
+
+// Unties b from the file it was laid out like
+void pagerUnfile(struct coldBlock *b) {
+  if (b->file && --b->file->refs == 0) {
+    close(b->file->fd);
+    free(b->file);
+  }
+  b->file = NULL;
+  b->foff = -1;
+}
+
+// Single entry cache of the last decompressed block, for sequential thaws
+struct coldBlock *cold_cache_block;
+char *cold_cache;
+size_t cold_cache_cap;
+
+void pagerLink(struct coldBlock *b) {
+  b->next = NULL;
+  b->prev = E.lru_tail;
+  if (E.lru_tail) E.lru_tail->next = b;
+  else E.lru_head = b;
+  E.lru_tail = b;
+}
+
+void pagerUnlink(struct coldBlock *b) {
+  if (b->prev) b->prev->next = b->next;
+  else E.lru_head = b->next;
+  if (b->next) b->next->prev = b->prev;
+  else E.lru_tail = b->prev;
+}
+
+void pagerTouch(struct coldBlock *b) {
+  if (E.lru_tail == b) return;
+  pagerUnlink(b);
+  pagerLink(b);
+}
+
+void pagerRead(int fd, char *buf, size_t len, off_t off) {
+  while (len) {
+    ssize_t n = pread(fd, buf, len, off);
+    if (n <= 0) {
+      if (n == -1 && errno == EINTR) continue;
+      die("pread");
+    }
+    buf += n;
+    len -= n;
+    off += n;
+  }
+}
+
+// Whether the file b was laid out like still holds what was read from it
+int pagerFileIntact(struct coldBlock *b) {
+  int fd = b->file ? b->file->fd : E.srcfd;
+  struct stat *was = b->file ? &b->file->st : &E.srcst, st;
+  return fd != -1 && fstat(fd, &st) == 0 && st.st_size == was->st_size &&
+         st.st_mtim.tv_sec == was->st_mtim.tv_sec &&
+         st.st_mtim.tv_nsec == was->st_mtim.tv_nsec;
+}
+
+// Reads dropped block b back from the file into buf. Returns -1, with buf
+// filled with '?', if the file has changed under us.
+int pagerReadFile(struct coldBlock *b, char *buf) {
+  int fd = b->file ? b->file->fd : E.srcfd;
+  size_t got = 0, len = b->ulen;
+  if (pagerFileIntact(b)) {
+    while (got < len) {
+      ssize_t n = pread(fd, buf + got, len - got, b->foff + got);
+      if (n == -1 && errno == EINTR) continue;
+      if (n <= 0) break;
+      got += n;
+    }
+  }
+  if (got == len) return 0;
+  memset(buf, '?', len);
+  E.lost_blocks++;
+  editorSetStatusMessage("%s changed on disk: lines that could not be read "
+                         "back show as '?'", E.filename);
+  return -1;
+}
+
+void pagerWrite(int fd, const char *buf, size_t len, off_t off) {
+  while (len) {
+    ssize_t n = pwrite(fd, buf, len, off);
+    if (n <= 0) {
+      if (n == -1 && errno == EINTR) continue;
+      die("pwrite");
+    }
+    buf += n;
+    len -= n;
+    off += n;
+  }
+}
+
+size_t editorResidentBytes() {
+  return E.hot_bytes + E.cold_bytes + (size_t)E.numrows * sizeof(erow);
+}
+
+void pagerPageIn(struct coldBlock *b) {
+  b->data = malloc(b->clen ? b->clen : 1);
+  pagerRead(E.swapfd, b->data, b->clen, b->swapoff);
+  E.paged_bytes -= b->clen;
+  E.cold_bytes += b->clen;
+}
+
+void pagerOpenSwap() {
+  const char *dir = getenv("TMPDIR");
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/cax-swap-XXXXXX", dir ? dir : "/tmp");
+  E.swapfd = mkstemp(path);
+  if (E.swapfd == -1) die("swap file");
+  unlink(path);
+}
+
+void pagerPageOut(struct coldBlock *b) {
+  // only dropped while the file can still give it back
+  if (b->foff >= 0 && !pagerFileIntact(b)) pagerUnfile(b);
+  if (b->foff < 0 && b->swapoff < 0) {
+    if (E.swapfd == -1) pagerOpenSwap();
+    b->swapoff = E.swap_end;
+    pagerWrite(E.swapfd, b->data, b->clen, b->swapoff);
+    E.swap_end += b->clen;
+  }
+  if (cold_cache_block == b) cold_cache_block = NULL;
+  free(b->data);
+  b->data = NULL;
+  E.cold_bytes -= b->clen;
+  E.paged_bytes += b->swapoff >= 0 ? b->clen : b->ulen;
+}
+
+// Pages out the oldest blocks until resident memory is back under 3/4 of
+// the ceiling, or nothing is left to page out
+void pagerSpill() {
+  size_t target = E.max_resident / 4 * 3;
+  struct coldBlock *b = E.lru_head;
+  while (b && editorResidentBytes() > target) {
+    if (b->data) pagerPageOut(b);
+    b = b->next;
+  }
+}
+
+// A forked session must not append to the swap file it shares with its
+// parent, so it carries on with a private copy
+void pagerPrivateSwap() {
+  if (E.swapfd == -1) return;
+  int shared = E.swapfd;
+  pagerOpenSwap();
+  char *buf = malloc(1 << 20);
+  for (off_t off = 0; off < E.swap_end; off += 1 << 20) {
+    size_t len = E.swap_end - off < (1 << 20) ? E.swap_end - off : (1 << 20);
+    pagerRead(shared, buf, len, off);
+    pagerWrite(E.swapfd, buf, len, off);
+  }
+  free(buf);
+  close(shared);
+}
+
+// Makes a dropped block resident again from its payload, no longer tied
+// to the file
+void pagerKeep(struct coldBlock *b, const char *payload) {
+  b->data = malloc(lzCompressBound(b->ulen));
+  b->clen = lzCompress(payload, b->ulen, b->data);
+  E.paged_bytes -= b->ulen;
+  E.cold_bytes += b->clen;
+  pagerUnfile(b);
+}
+
+// Called before the file is overwritten in place: blocks that relied on
+// the old contents of the file are moved to the swap file. Returns -1,
+// leaving them be, if some can no longer be read back.
+int pagerDetachFile() {
+  for (struct coldBlock *b = E.lru_head; b; b = b->next)
+    if (b->foff >= 0 && !b->file && !b->data && b->swapoff < 0 &&
+        !pagerFileIntact(b))
+      return -1;
+  for (struct coldBlock *b = E.lru_head; b; b = b->next) {
+    if (b->foff < 0 || b->file) continue;
+    if (!b->data && b->swapoff < 0) {
+      char *payload = malloc(b->ulen ? b->ulen : 1);
+      int lost = pagerReadFile(b, payload);
+      pagerKeep(b, payload);
+      free(payload);
+      pagerPageOut(b);
+      if (lost == -1) return -1;
+    }
+    b->foff = -1;
+  }
+  return 0;
+}
+
+// Called once a save renamed a new file over the old one, which E.srcfd
+// still holds: blocks laid out like it go on being read back from it
+void pagerRetireFile() {
+  if (E.srcfd == -1) return;
+  struct pagerFile *f = malloc(sizeof(*f));
+  f->fd = E.srcfd;
+  f->st = E.srcst;
+  f->refs = 0;
+  for (struct coldBlock *b = E.lru_head; b; b = b->next) {
+    if (b->foff < 0 || b->file) continue;
+    b->file = f;
+    f->refs++;
+  }
+  if (f->refs == 0) {
+    close(f->fd);
+    free(f);
+  }
+  E.srcfd = -1;
+}
+
+/*** Cold rows ***/
+
+/*
+ * Rows away from the part of the file being looked at are "cooled" once the
+ * hot rows use more than E.hot_budget bytes: the chars of up to
+ * CAX_COLD_BLOCK_ROWS neighbouring rows are packed into one compressed
+ * block, and render/hl are dropped. editorRow() thaws a row again the
+ * moment it is drawn, searched or edited. Cold rows keep idx, size and
+ * hl_open_comment, which is all cursor motion and highlighting of the
+ * following rows need.
+ */
+
+size_t editorRowCost(erow *row) {
+  if (row->cold) return 0;
+  return row->size + 1 + 2 * (size_t)row->rsize + 1;
+}
+
+void editorRowAccount(erow *row) {
+  size_t mem = editorRowCost(row);
+  E.hot_bytes += mem - row->mem;
+  row->mem = mem;
+}
+
+void coldBlockRelease(struct coldBlock *b) {
+  if (--b->refs > 0) return;
+  if (cold_cache_block == b) cold_cache_block = NULL;
+  pagerUnlink(b);
+  pagerUnfile(b);
+  if (b->data) E.cold_bytes -= b->clen;
+  else E.paged_bytes -= b->swapoff >= 0 ? b->clen : b->ulen;
+  free(b->data);
+  free(b);
+}
+
+const char *coldBlockPayload(struct coldBlock *b) {
+  if (cold_cache_block == b) return cold_cache;
+  if (b->ulen > cold_cache_cap) {
+    cold_cache_cap = b->ulen;
+    cold_cache = realloc(cold_cache, cold_cache_cap);
+  }
+  pagerTouch(b);
+  if (!b->data && b->swapoff < 0) {
+    // unmodified rows come straight back from the file they were read from
+    if (pagerReadFile(b, cold_cache) == -1)
+      pagerKeep(b, cold_cache);
+  } else {
+    if (!b->data) pagerPageIn(b);
+    lzDecompress(b->data, b->clen, cold_cache);
+  }
+  cold_cache_block = b;
+  return cold_cache;
+}
+
+// Returns a row's chars without thawing it. For a cold row the pointer is
+// only good until the next block is decompressed.
+const char *editorRowPeek(erow *row) {
+  if (row->cold) return coldBlockPayload(row->cold) + row->coff;
+  return row->chars;
+}
+
+void editorRowCopyChars(erow *row, char *dst) {
+  memcpy(dst, editorRowPeek(row), row->size);
+}
+
+void editorRowThaw(erow *row) {
+  struct coldBlock *b = row->cold;
+  row->chars = malloc(row->size + 1);
+  memcpy(row->chars, coldBlockPayload(b) + row->coff, row->size);
+  row->chars[row->size] = '\0';
+  row->cold = NULL;
+  coldBlockRelease(b);
+
+  // the comment state coming from above has not changed while the row was
+  // cold, so highlighting this row alone is enough
+  editorRenderRow(row);
+  editorHighlightRow(row);
+  editorRowAccount(row);
+}
+
+// Returns row at, thawing it first if it is cold
+erow *editorRow(size_t at) {
+  erow *row = &E.row[at];
+  if (row->cold) editorRowThaw(row);
+  return row;
+}
+
+// Rows that are unmodified and back to back on disk are laid out exactly
+// like the file, line endings included, so the block can later be dropped
+// and read back from the file instead of going to the swap file
+int editorRowsMatchFile(size_t at, size_t n) {
+  if (E.srcfd == -1 || E.shared) return 0;
+  for (size_t j = at; j < at + n; j++) {
+    off_t gap;
+    if (E.row[j].foff < 0) return 0;
+    if (j + 1 == at + n) break;
+    gap = E.row[j + 1].foff - E.row[j].foff - (off_t)E.row[j].size;
+    if (gap < 1 || gap > 16) return 0;
+  }
+  return 1;
+}
+
+// Packs rows [at, at + n) into a single cold block
+void editorCoolRows(size_t at, size_t n) {
+  static char *payload, *packed;
+  static size_t payload_cap, packed_cap;
+  int file_layout = editorRowsMatchFile(at, n);
+  size_t ulen = 0;
+  size_t j;
+
+  for (j = at; j < at + n; j++) ulen += E.row[j].size;
+  if (file_layout)
+    ulen = E.row[at + n - 1].foff - E.row[at].foff + E.row[at + n - 1].size;
+  if (ulen > payload_cap) {
+    payload_cap = ulen;
+    payload = realloc(payload, payload_cap);
+  }
+  if (lzCompressBound(ulen) > packed_cap) {
+    packed_cap = lzCompressBound(ulen);
+    packed = realloc(packed, packed_cap);
+  }
+
+  struct coldBlock *b = malloc(sizeof(struct coldBlock));
+  size_t off = 0;
+  for (j = at; j < at + n; j++) {
+    erow *row = &E.row[j];
+    if (file_layout && off < (size_t)(row->foff - E.row[at].foff)) {
+      // recreate the line ending: any number of '\r' and a '\n'
+      size_t end = row->foff - E.row[at].foff;
+      memset(&payload[off], '\r', end - off - 1);
+      payload[end - 1] = '\n';
+      off = end;
+    }
+    memcpy(&payload[off], row->chars, row->size);
+    E.hot_bytes -= row->mem;
+    free(row->chars);
+    free(row->render);
+    free(row->hl);
+    row->chars = row->render = NULL;
+    row->hl = NULL;
+    row->mem = 0;
+    row->cold = b;
+    row->coff = off;
+    off += row->size;
+  }
+  b->refs = n;
+  b->ulen = ulen;
+  b->clen = lzCompress(payload, ulen, packed);
+  b->data = malloc(b->clen ? b->clen : 1);
+  memcpy(b->data, packed, b->clen);
+  b->foff = file_layout ? E.row[at].foff : -1;
+  b->file = NULL;
+  b->swapoff = -1;
+  E.cold_bytes += b->clen;
+  pagerLink(b);
+}
+
+// Cools rows outside the visible window or folded away, clock style,
+// until the hot rows are back under three quarters of the budget
+void editorColdSweep() {
+  size_t margin = (size_t)E.screenRows * 2;
+  size_t top = E.rowoff < E.cy ? E.rowoff : E.cy;
+  size_t bottom = foldNth(foldVisibleBefore(E.rowoff) + E.screenRows);
+  if (bottom < E.cy) bottom = E.cy;
+  size_t lo = top > margin ? top - margin : 0;
+  size_t hi = bottom + margin;
+  size_t target = E.hot_budget / 4 * 3;
+  size_t scanned = 0;
+
+  if (E.cold_hand >= E.numrows) E.cold_hand = 0;
+  while (E.hot_bytes > target && scanned < E.numrows) {
+    size_t at = E.cold_hand;
+    size_t n = 0;
+    size_t bytes = 0;
+    while (at + n < E.numrows && n < CAX_COLD_BLOCK_ROWS &&
+           bytes < CAX_COLD_BLOCK_BYTES) {
+      erow *row = &E.row[at + n];
+      if (row->cold || (at + n >= lo && at + n <= hi && !row->hidden)) break;
+      bytes += row->size;
+      n++;
+    }
+    if (n) editorCoolRows(at, n);
+    else n = 1;
+    scanned += n;
+    E.cold_hand += n;
+    if (E.cold_hand >= E.numrows) E.cold_hand = 0;
+  }
+}
+
+void editorColdMaybeSweep() {
+  if (E.hot_bytes > E.hot_budget) editorColdSweep();
+  if (E.max_resident && editorResidentBytes() > E.max_resident)
+    pagerSpill();
+}
+
+/*** Byte kernels ***/
+
+/*
+ * The loops that look at every byte of a row: counting and finding tabs,
+ * the length of a run of one highlight class, the end of the ASCII prefix
+ * and the next byte that is not printable ASCII. Each has a scalar version
+ * that tests eight bytes at a time, and on x86-64 SSE2 and AVX2 versions;
+ * kernelsInit() picks the widest the CPU runs, unless CAX_KERNELS names
+ * one. cax --bench-kernels times them against plain byte loops.
+ */
+struct byteKernels {
+  const char *name;
+  size_t (*count)(const char *s, size_t len, char c);  // bytes equal to c
+  size_t (*find)(const char *s, size_t len, char c);   // first c, or len
+  size_t (*span)(const char *s, size_t len, char c);   // first byte not c
+  size_t (*ascii)(const char *s, size_t len);          // first byte >= 0x80
+  size_t (*plain)(const char *s, size_t len);          // first byte that is
+                                                       // not 0x20..0x7e
+};
+
+#define KERNEL_ONES 0x0101010101010101ull
+#define KERNEL_HIGHS 0x8080808080808080ull
+
+// High bit set in each byte of w that is zero
+uint64_t kernelZeros(uint64_t w) {
+  return ~(((w & ~KERNEL_HIGHS) + ~KERNEL_HIGHS) | w) & KERNEL_HIGHS;
+}
+
+int kernelPlain(unsigned char b) {
+  return b >= 0x20 && b < 0x7f;
+}
+
+size_t byteCount(const char *s, size_t len, char c) {
+  size_t n = 0;
+  for (size_t i = 0; i < len; i++) n += s[i] == c;
+  return n;
+}
+
+size_t byteFind(const char *s, size_t len, char c) {
+  size_t i = 0;
+  while (i < len && s[i] != c) i++;
+  return i;
+}
+
+size_t byteSpan(const char *s, size_t len, char c) {
+  size_t i = 0;
+  while (i < len && s[i] == c) i++;
+  return i;
+}
+
+size_t byteAscii(const char *s, size_t len) {
+  size_t i = 0;
+  while (i < len && !(s[i] & 0x80)) i++;
+  return i;
+}
+
+size_t bytePlain(const char *s, size_t len) {
+  size_t i = 0;
+  while (i < len && kernelPlain(s[i])) i++;
+  return i;
+}
+
+size_t scalarCount(const char *s, size_t len, char c) {
+  uint64_t pat = KERNEL_ONES * (unsigned char)c, w;
+  size_t n = 0, i = 0;
+  for (; i + 8 <= len; i += 8) {
+    memcpy(&w, s + i, 8);
+    // add up the flag bits of the eight bytes in the top one
+    n += ((kernelZeros(w ^ pat) >> 7) * KERNEL_ONES) >> 56;
+  }
+  return n + byteCount(s + i, len - i, c);
+}
+
+size_t scalarFind(const char *s, size_t len, char c) {
+  uint64_t pat = KERNEL_ONES * (unsigned char)c, w;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    memcpy(&w, s + i, 8);
+    if (kernelZeros(w ^ pat)) break;
+  }
+  return i + byteFind(s + i, len - i, c);
+}
+
+size_t scalarSpan(const char *s, size_t len, char c) {
+  uint64_t pat = KERNEL_ONES * (unsigned char)c, w;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    memcpy(&w, s + i, 8);
+    if (w != pat) break;
+  }
+  return i + byteSpan(s + i, len - i, c);
+}
+
+size_t scalarAscii(const char *s, size_t len) {
+  uint64_t w;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    memcpy(&w, s + i, 8);
+    if (w & KERNEL_HIGHS) break;
+  }
+  return i + byteAscii(s + i, len - i);
+}
+
+size_t scalarPlain(const char *s, size_t len) {
+  uint64_t w;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    memcpy(&w, s + i, 8);
+    // below 0x20, DEL, or not ASCII at all
+    uint64_t low = (w - KERNEL_ONES * 0x20) & ~w & KERNEL_HIGHS;
+    if (low | kernelZeros(w ^ (KERNEL_ONES * 0x7f)) | (w & KERNEL_HIGHS))
+      break;
+  }
+  return i + bytePlain(s + i, len - i);
+}
+
+#ifdef CAX_X86_KERNELS
+
+// Matches are counted in byte lanes, which are added up before any of
+// them can reach 256
+size_t sse2Count(const char *s, size_t len, char c) {
+  __m128i pat = _mm_set1_epi8(c), zero = _mm_setzero_si128();
+  size_t n = 0, i = 0;
+  while (i + 16 <= len) {
+    __m128i acc = zero;
+    for (int k = 0; k < 255 && i + 16 <= len; k++, i += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+      acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(v, pat));
+    }
+    __m128i sums = _mm_sad_epu8(acc, zero);
+    n += _mm_cvtsi128_si32(sums) + _mm_extract_epi16(sums, 4);
+  }
+  return n + scalarCount(s + i, len - i, c);
+}
+
+size_t sse2Find(const char *s, size_t len, char c) {
+  __m128i pat = _mm_set1_epi8(c);
+  for (size_t i = 0; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    int m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, pat));
+    if (m) return i + __builtin_ctz(m);
+  }
+  size_t i = len & ~(size_t)15;
+  return i + scalarFind(s + i, len - i, c);
+}
+
+size_t sse2Span(const char *s, size_t len, char c) {
+  __m128i pat = _mm_set1_epi8(c);
+  for (size_t i = 0; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    int m = ~_mm_movemask_epi8(_mm_cmpeq_epi8(v, pat)) & 0xffff;
+    if (m) return i + __builtin_ctz(m);
+  }
+  size_t i = len & ~(size_t)15;
+  return i + scalarSpan(s + i, len - i, c);
+}
+
+size_t sse2Ascii(const char *s, size_t len) {
+  for (size_t i = 0; i + 16 <= len; i += 16) {
+    int m = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i)));
+    if (m) return i + __builtin_ctz(m);
+  }
+  size_t i = len & ~(size_t)15;
+  return i + scalarAscii(s + i, len - i);
+}
+
+// As signed bytes, printable ASCII is above 0x1f and below 0x7f, and
+// everything from 0x80 up is negative
+size_t sse2Plain(const char *s, size_t len) {
+  __m128i lo = _mm_set1_epi8(0x1f), hi = _mm_set1_epi8(0x7f);
+  for (size_t i = 0; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi));
+    int m = ~_mm_movemask_epi8(ok) & 0xffff;
+    if (m) return i + __builtin_ctz(m);
+  }
+  size_t i = len & ~(size_t)15;
+  return i + scalarPlain(s + i, len - i);
+}
+
+#define KERNEL_AVX2 __attribute__((target("avx2")))
+
+KERNEL_AVX2 size_t avx2CountLong(const char *s, size_t len, char c) {
+  __m256i pat = _mm256_set1_epi8(c), zero = _mm256_setzero_si256();
+  size_t n = 0, i = 0;
+  while (i + 32 <= len) {
+    __m256i acc = zero;
+    for (int k = 0; k < 255 && i + 32 <= len; k++, i += 32) {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+      acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(v, pat));
+    }
+    __m256i sums = _mm256_sad_epu8(acc, zero);
+    n += _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) +
+         _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3);
+  }
+  return n + scalarCount(s + i, len - i, c);
+}
+
+KERNEL_AVX2 size_t avx2FindLong(const char *s, size_t len, char c) {
+  __m256i pat = _mm256_set1_epi8(c);
+  for (size_t i = 0; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+    unsigned m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, pat));
+    if (m) return i + __builtin_ctz(m);
+  }
+  size_t i = len & ~(size_t)31;
+  return i + scalarFind(s + i, len - i, c);
+}
+
+KERNEL_AVX2 size_t avx2SpanLong(const char *s, size_t len, char c) {
+  __m256i pat = _mm256_set1_epi8(c);
+  for (size_t i = 0; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+    unsigned m = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, pat));
+    if (m) return i + __builtin_ctz(m);
+  }
+  size_t i = len & ~(size_t)31;
+  return i + scalarSpan(s + i, len - i, c);
+}
+
+KERNEL_AVX2 size_t avx2AsciiLong(const char *s, size_t len) {
+  for (size_t i = 0; i + 32 <= len; i += 32) {
+    unsigned m = _mm256_movemask_epi8(
+      _mm256_loadu_si256((const __m256i *)(s + i)));
+    if (m) return i + __builtin_ctz(m);
+  }
+  size_t i = len & ~(size_t)31;
+  return i + scalarAscii(s + i, len - i);
+}
+
+KERNEL_AVX2 size_t avx2PlainLong(const char *s, size_t len) {
+  __m256i lo = _mm256_set1_epi8(0x1f), hi = _mm256_set1_epi8(0x7f);
+  for (size_t i = 0; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+    __m256i ok = _mm256_and_si256(_mm256_cmpgt_epi8(v, lo),
+                                  _mm256_cmpgt_epi8(hi, v));
+    unsigned m = ~(unsigned)_mm256_movemask_epi8(ok);
+    if (m) return i + __builtin_ctz(m);
+  }
+  size_t i = len & ~(size_t)31;
+  return i + scalarPlain(s + i, len - i);
+}
+
+// Short rows go to SSE2: the ymm registers do not pay for themselves
+// there, and leaving code that used them costs a vzeroupper
+#define KERNEL_AVX2_MIN 256
+
+size_t avx2Count(const char *s, size_t len, char c) {
+  return len < KERNEL_AVX2_MIN ? sse2Count(s, len, c)
+                               : avx2CountLong(s, len, c);
+}
+
+size_t avx2Find(const char *s, size_t len, char c) {
+  return len < KERNEL_AVX2_MIN ? sse2Find(s, len, c)
+                               : avx2FindLong(s, len, c);
+}
+
+size_t avx2Span(const char *s, size_t len, char c) {
+  return len < KERNEL_AVX2_MIN ? sse2Span(s, len, c)
+                               : avx2SpanLong(s, len, c);
+}
+
+size_t avx2Ascii(const char *s, size_t len) {
+  return len < KERNEL_AVX2_MIN ? sse2Ascii(s, len) : avx2AsciiLong(s, len);
+}
+
+size_t avx2Plain(const char *s, size_t len) {
+  return len < KERNEL_AVX2_MIN ? sse2Plain(s, len) : avx2PlainLong(s, len);
+}
+
+#endif
+
+// Every set this build has, narrowest first; the byte loops come first
+// and are only there to compare against
+const struct byteKernels kernelSets[] = {
+  { "byte", byteCount, byteFind, byteSpan, byteAscii, bytePlain },
+  { "scalar", scalarCount, scalarFind, scalarSpan, scalarAscii, scalarPlain },
+#ifdef CAX_X86_KERNELS
+  { "sse2", sse2Count, sse2Find, sse2Span, sse2Ascii, sse2Plain },
+  { "avx2", avx2Count, avx2Find, avx2Span, avx2Ascii, avx2Plain },
+#endif
+};
+
+#define KERNEL_SETS (sizeof(kernelSets) / sizeof(kernelSets[0]))
+
+struct byteKernels K;
+
+int kernelSupported(const struct byteKernels *k) {
+#ifdef CAX_X86_KERNELS
+  if (!strcmp(k->name, "avx2")) return __builtin_cpu_supports("avx2");
+#endif
+  (void)k;
+  return 1;
+}
+
+void kernelsInit() {
+  const char *want = getenv("CAX_KERNELS");
+  K = kernelSets[1];
+  for (size_t i = 0; i < KERNEL_SETS; i++) {
+    if (!kernelSupported(&kernelSets[i])) continue;
+    if (want && *want ? !strcmp(want, kernelSets[i].name) : i > 0)
+      K = kernelSets[i];
+  }
+}
+
+/* What --bench-kernels runs, each over a whole input a line at a time */
+enum kernelOp {
+  KERNEL_COUNT,               // count tabs
+  KERNEL_FIND,                // step from tab to tab
+  KERNEL_SPAN,                // step from one highlight run to the next
+  KERNEL_ASCII,               // step over ASCII runs
+  KERNEL_PLAIN,               // step over printable runs
+  KERNEL_RENDER,              // editorRenderRow
+  KERNEL_OPS
+};
+
+// Runs op on every line with the kernels in K, and returns a checksum of
+// the results so that the sets can be compared
+uint64_t kernelsRun(int op, char **lines, size_t *lens, char **classes,
+                    size_t nlines) {
+  uint64_t sum = 0;
+  for (size_t l = 0; l < nlines; l++) {
+    const char *s = op == KERNEL_SPAN ? classes[l] : lines[l];
+    size_t len = lens[l], i = 0;
+    switch (op) {
+    case KERNEL_COUNT:
+      sum += K.count(s, len, '\t');
+      break;
+    case KERNEL_FIND:
+      for (; i < len; i++) sum += i += K.find(s + i, len - i, '\t');
+      break;
+    case KERNEL_SPAN:
+      while (i < len) sum += i += K.span(s + i, len - i, s[i]);
+      break;
+    case KERNEL_ASCII:
+      for (; i < len; i++) sum += i += K.ascii(s + i, len - i);
+      break;
+    case KERNEL_PLAIN:
+      for (; i < len; i++) sum += i += K.plain(s + i, len - i);
+      break;
+    case KERNEL_RENDER: {
+      erow row;
+      memset(&row, 0, sizeof(row));
+      row.chars = lines[l];
+      row.size = len;
+      editorRenderRow(&row);
+      sum += row.rsize;
+      for (size_t i = 0; i + 8 <= row.rsize; i += 8) {
+        uint64_t w;
+        memcpy(&w, row.render + i, 8);
+        sum ^= w;
+      }
+      free(row.render);
+      break;
+    }
+    }
+  }
+  return sum;
+}
+
+// Appends one generated line of C to buf: indentation, then tokens up to
+// about width bytes
+size_t kernelsLine(char *buf, size_t width, unsigned *seed) {
+  static const char *tokens[] = {
+    "int", "return", "if (", "while (", "x", "count", "->next", "= 0;",
+    "\"text\"", "/* note */", "// comment", "\t", "0x1f", "é", "{", "}",
+  };
+  size_t len = 0, depth = rand_r(seed) % 5;
+  while (depth--) buf[len++] = '\t';
+  while (len < width) {
+    const char *t = tokens[rand_r(seed) % (sizeof(tokens) / sizeof(*tokens))];
+    memcpy(buf + len, t, strlen(t));
+    len += strlen(t);
+    buf[len++] = ' ';
+  }
+  return len;
+}
+
+// Times every kernel set on generated source, in lines of ordinary length
+// and in very long ones, and checks that they agree with the byte loops
+int kernelsBench() {
+  const size_t total = 16 << 20;
+  static const char *opnames[] = {
+    "count", "find", "span", "ascii", "plain", "render"
+  };
+  struct byteKernels chosen = K;
+  int failed = 0;
+  printf("ns/byte%*s", 12, "");
+  for (size_t k = 0; k < KERNEL_SETS; k++)
+    if (kernelSupported(&kernelSets[k])) printf("%9s", kernelSets[k].name);
+  printf("   speedup (%s)\n", chosen.name);
+  for (int input = 0; input < 2; input++) {
+    size_t width = input ? 4096 : 40, nlines = 0, cap = 1024;
+    char **lines = malloc(sizeof(char *) * cap);
+    char **classes = malloc(sizeof(char *) * cap);
+    size_t *lens = malloc(sizeof(size_t) * cap);
+    unsigned seed = 1;
+    for (size_t bytes = 0; bytes < total; bytes += lens[nlines++]) {
+      if (nlines == cap) {
+        cap *= 2;
+        lines = realloc(lines, sizeof(char *) * cap);
+        classes = realloc(classes, sizeof(char *) * cap);
+        lens = realloc(lens, sizeof(size_t) * cap);
+      }
+      lines[nlines] = malloc(width + 16);
+      lens[nlines] = kernelsLine(lines[nlines], width, &seed);
+      // a stand-in for highlighting: runs of word and other bytes
+      classes[nlines] = malloc(lens[nlines]);
+      for (size_t i = 0; i < lens[nlines]; i++)
+        classes[nlines][i] = isalnum((unsigned char)lines[nlines][i]) != 0;
+    }
+    for (int op = 0; op < KERNEL_OPS; op++) {
+      printf("%-7s %-11s", opnames[op], input ? "long lines" : "code lines");
+      double first = 0, mine = 0;
+      uint64_t expect = 0;
+      for (size_t k = 0; k < KERNEL_SETS; k++) {
+        if (!kernelSupported(&kernelSets[k])) continue;
+        K = kernelSets[k];
+        uint64_t sum = kernelsRun(op, lines, lens, classes, nlines);
+        uint64_t start = traceNow(), reps = 0;
+        do {
+          if (kernelsRun(op, lines, lens, classes, nlines) != sum) failed = 1;
+          reps++;
+        } while (traceNow() - start < 200000000ull);
+        double ns = (double)(traceNow() - start) / reps / total;
+        if (k == 0) {
+          expect = sum;
+          first = ns;
+        } else if (sum != expect) {
+          failed = 1;
+        }
+        if (!strcmp(K.name, chosen.name)) mine = ns;
+        printf("%9.3f", ns);
+      }
+      printf("   %6.1fx\n", first / mine);
+    }
+    for (size_t l = 0; l < nlines; l++) {
+      free(lines[l]);
+      free(classes[l]);
+    }
+    free(lines);
+    free(classes);
+    free(lens);
+  }
+  K = chosen;
+  if (failed) fprintf(stderr, "kernel sets disagree\n");
+  return failed;
+}
+
+/*** UTF-8 ***/
+
+/*
+ * Columns taken by a code point, as ranges of everything that is not one
+ * column wide: combining marks and format characters take none, East Asian
+ * wide and fullwidth characters take two (Unicode 14). utf8WidthInit()
+ * turns them into a two level table, 256 code points to a block and two
+ * bits to a code point, so a lookup is two loads and a shift.
+ */
+#define UTF8_INVALID 0xFFFFFFFFu
+
+struct widthRange { uint32_t first, last; uint8_t width; };
+
+static const struct widthRange utf8WidthRanges[] = {
+  {0x0300, 0x036F, 0}, {0x0483, 0x0489, 0}, {0x0591, 0x05BD, 0},
+  {0x05BF, 0x05BF, 0}, {0x05C1, 0x05C2, 0}, {0x05C4, 0x05C5, 0},
+  {0x05C7, 0x05C7, 0}, {0x0600, 0x0605, 0}, {0x0610, 0x061A, 0},
+  {0x061C, 0x061C, 0}, {0x064B, 0x065F, 0}, {0x0670, 0x0670, 0},
+  {0x06D6, 0x06DD, 0}, {0x06DF, 0x06E4, 0}, {0x06E7, 0x06E8, 0},
+  {0x06EA, 0x06ED, 0}, {0x070F, 0x070F, 0}, {0x0711, 0x0711, 0},
+  {0x0730, 0x074A, 0}, {0x07A6, 0x07B0, 0}, {0x07EB, 0x07F3, 0},
+  {0x07FD, 0x07FD, 0}, {0x0816, 0x0819, 0}, {0x081B, 0x0823, 0},
+  {0x0825, 0x0827, 0}, {0x0829, 0x082D, 0}, {0x0859, 0x085B, 0},
+  {0x0890, 0x089F, 0}, {0x08CA, 0x0902, 0}, {0x093A, 0x093A, 0},
+  {0x093C, 0x093C, 0}, {0x0941, 0x0948, 0}, {0x094D, 0x094D, 0},
+  {0x0951, 0x0957, 0}, {0x0962, 0x0963, 0}, {0x0981, 0x0981, 0},
+  {0x09BC, 0x09BC, 0}, {0x09C1, 0x09C4, 0}, {0x09CD, 0x09CD, 0},
+  {0x09E2, 0x09E3, 0}, {0x09FE, 0x0A02, 0}, {0x0A3C, 0x0A3C, 0},
+  {0x0A41, 0x0A51, 0}, {0x0A70, 0x0A71, 0}, {0x0A75, 0x0A75, 0},
+  {0x0A81, 0x0A82, 0}, {0x0ABC, 0x0ABC, 0}, {0x0AC1, 0x0AC8, 0},
+  {0x0ACD, 0x0ACD, 0}, {0x0AE2, 0x0AE3, 0}, {0x0AFA, 0x0B01, 0},
+  {0x0B3C, 0x0B3C, 0}, {0x0B3F, 0x0B3F, 0}, {0x0B41, 0x0B44, 0},
+  {0x0B4D, 0x0B56, 0}, {0x0B62, 0x0B63, 0}, {0x0B82, 0x0B82, 0},
+  {0x0BC0, 0x0BC0, 0}, {0x0BCD, 0x0BCD, 0}, {0x0C00, 0x0C00, 0},
+  {0x0C04, 0x0C04, 0}, {0x0C3C, 0x0C3C, 0}, {0x0C3E, 0x0C40, 0},
+  {0x0C46, 0x0C56, 0}, {0x0C62, 0x0C63, 0}, {0x0C81, 0x0C81, 0},
+  {0x0CBC, 0x0CBC, 0}, {0x0CBF, 0x0CBF, 0}, {0x0CC6, 0x0CC6, 0},
+  {0x0CCC, 0x0CCD, 0}, {0x0CE2, 0x0CE3, 0}, {0x0D00, 0x0D01, 0},
+  {0x0D3B, 0x0D3C, 0}, {0x0D41, 0x0D44, 0}, {0x0D4D, 0x0D4D, 0},
+  {0x0D62, 0x0D63, 0}, {0x0D81, 0x0D81, 0}, {0x0DCA, 0x0DCA, 0},
+  {0x0DD2, 0x0DD6, 0}, {0x0E31, 0x0E31, 0}, {0x0E34, 0x0E3A, 0},
+  {0x0E47, 0x0E4E, 0}, {0x0EB1, 0x0EB1, 0}, {0x0EB4, 0x0EBC, 0},
+  {0x0EC8, 0x0ECD, 0}, {0x0F18, 0x0F19, 0}, {0x0F35, 0x0F35, 0},
+  {0x0F37, 0x0F37, 0}, {0x0F39, 0x0F39, 0}, {0x0F71, 0x0F7E, 0},
+  {0x0F80, 0x0F84, 0}, {0x0F86, 0x0F87, 0}, {0x0F8D, 0x0FBC, 0},
+  {0x0FC6, 0x0FC6, 0}, {0x102D, 0x1030, 0}, {0x1032, 0x1037, 0},
+  {0x1039, 0x103A, 0}, {0x103D, 0x103E, 0}, {0x1058, 0x1059, 0},
+  {0x105E, 0x1060, 0}, {0x1071, 0x1074, 0}, {0x1082, 0x1082, 0},
+  {0x1085, 0x1086, 0}, {0x108D, 0x108D, 0}, {0x109D, 0x109D, 0},
+  {0x1100, 0x115F, 2}, {0x1160, 0x11FF, 0}, {0x135D, 0x135F, 0},
+  {0x1712, 0x1714, 0}, {0x1732, 0x1733, 0}, {0x1752, 0x1753, 0},
+  {0x1772, 0x1773, 0}, {0x17B4, 0x17B5, 0}, {0x17B7, 0x17BD, 0},
+  {0x17C6, 0x17C6, 0}, {0x17C9, 0x17D3, 0}, {0x17DD, 0x17DD, 0},
+  {0x180B, 0x180F, 0}, {0x1885, 0x1886, 0}, {0x18A9, 0x18A9, 0},
+  {0x1920, 0x1922, 0}, {0x1927, 0x1928, 0}, {0x1932, 0x1932, 0},
+  {0x1939, 0x193B, 0}, {0x1A17, 0x1A18, 0}, {0x1A1B, 0x1A1B, 0},
+  {0x1A56, 0x1A56, 0}, {0x1A58, 0x1A60, 0}, {0x1A62, 0x1A62, 0},
+  {0x1A65, 0x1A6C, 0}, {0x1A73, 0x1A7F, 0}, {0x1AB0, 0x1B03, 0},
+  {0x1B34, 0x1B34, 0}, {0x1B36, 0x1B3A, 0}, {0x1B3C, 0x1B3C, 0},
+  {0x1B42, 0x1B42, 0}, {0x1B6B, 0x1B73, 0}, {0x1B80, 0x1B81, 0},
+  {0x1BA2, 0x1BA5, 0}, {0x1BA8, 0x1BA9, 0}, {0x1BAB, 0x1BAD, 0},
+  {0x1BE6, 0x1BE6, 0}, {0x1BE8, 0x1BE9, 0}, {0x1BED, 0x1BED, 0},
+  {0x1BEF, 0x1BF1, 0}, {0x1C2C, 0x1C33, 0}, {0x1C36, 0x1C37, 0},
+  {0x1CD0, 0x1CD2, 0}, {0x1CD4, 0x1CE0, 0}, {0x1CE2, 0x1CE8, 0},
+  {0x1CED, 0x1CED, 0}, {0x1CF4, 0x1CF4, 0}, {0x1CF8, 0x1CF9, 0},
+  {0x1DC0, 0x1DFF, 0}, {0x200B, 0x200F, 0}, {0x202A, 0x202E, 0},
+  {0x2060, 0x206F, 0}, {0x20D0, 0x20F0, 0}, {0x231A, 0x231B, 2},
+  {0x2329, 0x232A, 2}, {0x23E9, 0x23EC, 2}, {0x23F0, 0x23F0, 2},
+  {0x23F3, 0x23F3, 2}, {0x25FD, 0x25FE, 2}, {0x2614, 0x2615, 2},
+  {0x2648, 0x2653, 2}, {0x267F, 0x267F, 2}, {0x2693, 0x2693, 2},
+  {0x26A1, 0x26A1, 2}, {0x26AA, 0x26AB, 2}, {0x26BD, 0x26BE, 2},
+  {0x26C4, 0x26C5, 2}, {0x26CE, 0x26CE, 2}, {0x26D4, 0x26D4, 2},
+  {0x26EA, 0x26EA, 2}, {0x26F2, 0x26F3, 2}, {0x26F5, 0x26F5, 2},
+  {0x26FA, 0x26FA, 2}, {0x26FD, 0x26FD, 2}, {0x2705, 0x2705, 2},
+  {0x270A, 0x270B, 2}, {0x2728, 0x2728, 2}, {0x274C, 0x274C, 2},
+  {0x274E, 0x274E, 2}, {0x2753, 0x2755, 2}, {0x2757, 0x2757, 2},
+  {0x2795, 0x2797, 2}, {0x27B0, 0x27B0, 2}, {0x27BF, 0x27BF, 2},
+  {0x2B1B, 0x2B1C, 2}, {0x2B50, 0x2B50, 2}, {0x2B55, 0x2B55, 2},
+  {0x2CEF, 0x2CF1, 0}, {0x2D7F, 0x2D7F, 0}, {0x2DE0, 0x2DFF, 0},
+  {0x2E80, 0x3029, 2}, {0x302A, 0x302D, 0}, {0x302E, 0x303E, 2},
+  {0x3041, 0x3096, 2}, {0x3099, 0x309A, 0}, {0x309B, 0x3247, 2},
+  {0x3250, 0x4DBF, 2}, {0x4E00, 0xA4C6, 2}, {0xA66F, 0xA672, 0},
+  {0xA674, 0xA67D, 0}, {0xA69E, 0xA69F, 0}, {0xA6F0, 0xA6F1, 0},
+  {0xA802, 0xA802, 0}, {0xA806, 0xA806, 0}, {0xA80B, 0xA80B, 0},
+  {0xA825, 0xA826, 0}, {0xA82C, 0xA82C, 0}, {0xA8C4, 0xA8C5, 0},
+  {0xA8E0, 0xA8F1, 0}, {0xA8FF, 0xA8FF, 0}, {0xA926, 0xA92D, 0},
+  {0xA947, 0xA951, 0}, {0xA960, 0xA97C, 2}, {0xA980, 0xA982, 0},
+  {0xA9B3, 0xA9B3, 0}, {0xA9B6, 0xA9B9, 0}, {0xA9BC, 0xA9BD, 0},
+  {0xA9E5, 0xA9E5, 0}, {0xAA29, 0xAA2E, 0}, {0xAA31, 0xAA32, 0},
+  {0xAA35, 0xAA36, 0}, {0xAA43, 0xAA43, 0}, {0xAA4C, 0xAA4C, 0},
+  {0xAA7C, 0xAA7C, 0}, {0xAAB0, 0xAAB0, 0}, {0xAAB2, 0xAAB4, 0},
+  {0xAAB7, 0xAAB8, 0}, {0xAABE, 0xAABF, 0}, {0xAAC1, 0xAAC1, 0},
+  {0xAAEC, 0xAAED, 0}, {0xAAF6, 0xAAF6, 0}, {0xABE5, 0xABE5, 0},
+  {0xABE8, 0xABE8, 0}, {0xABED, 0xABED, 0}, {0xAC00, 0xD7A3, 2},
+  {0xF900, 0xFAD9, 2}, {0xFB1E, 0xFB1E, 0}, {0xFE00, 0xFE0F, 0},
+  {0xFE10, 0xFE19, 2}, {0xFE20, 0xFE2F, 0}, {0xFE30, 0xFE6B, 2},
+  {0xFEFF, 0xFEFF, 0}, {0xFF01, 0xFF60, 2}, {0xFFE0, 0xFFE6, 2},
+  {0xFFF9, 0xFFFB, 0}, {0x101FD, 0x101FD, 0}, {0x102E0, 0x102E0, 0},
+  {0x10376, 0x1037A, 0}, {0x10A01, 0x10A0F, 0}, {0x10A38, 0x10A3F, 0},
+  {0x10AE5, 0x10AE6, 0}, {0x10D24, 0x10D27, 0}, {0x10EAB, 0x10EAC, 0},
+  {0x10F46, 0x10F50, 0}, {0x10F82, 0x10F85, 0}, {0x11001, 0x11001, 0},
+  {0x11038, 0x11046, 0}, {0x11070, 0x11070, 0}, {0x11073, 0x11074, 0},
+  {0x1107F, 0x11081, 0}, {0x110B3, 0x110B6, 0}, {0x110B9, 0x110BA, 0},
+  {0x110BD, 0x110BD, 0}, {0x110C2, 0x110CD, 0}, {0x11100, 0x11102, 0},
+  {0x11127, 0x1112B, 0}, {0x1112D, 0x11134, 0}, {0x11173, 0x11173, 0},
+  {0x11180, 0x11181, 0}, {0x111B6, 0x111BE, 0}, {0x111C9, 0x111CC, 0},
+  {0x111CF, 0x111CF, 0}, {0x1122F, 0x11231, 0}, {0x11234, 0x11234, 0},
+  {0x11236, 0x11237, 0}, {0x1123E, 0x1123E, 0}, {0x112DF, 0x112DF, 0},
+  {0x112E3, 0x112EA, 0}, {0x11300, 0x11301, 0}, {0x1133B, 0x1133C, 0},
+  {0x11340, 0x11340, 0}, {0x11366, 0x11374, 0}, {0x11438, 0x1143F, 0},
+  {0x11442, 0x11444, 0}, {0x11446, 0x11446, 0}, {0x1145E, 0x1145E, 0},
+  {0x114B3, 0x114B8, 0}, {0x114BA, 0x114BA, 0}, {0x114BF, 0x114C0, 0},
+  {0x114C2, 0x114C3, 0}, {0x115B2, 0x115B5, 0}, {0x115BC, 0x115BD, 0},
+  {0x115BF, 0x115C0, 0}, {0x115DC, 0x115DD, 0}, {0x11633, 0x1163A, 0},
+  {0x1163D, 0x1163D, 0}, {0x1163F, 0x11640, 0}, {0x116AB, 0x116AB, 0},
+  {0x116AD, 0x116AD, 0}, {0x116B0, 0x116B5, 0}, {0x116B7, 0x116B7, 0},
+  {0x1171D, 0x1171F, 0}, {0x11722, 0x11725, 0}, {0x11727, 0x1172B, 0},
+  {0x1182F, 0x11837, 0}, {0x11839, 0x1183A, 0}, {0x1193B, 0x1193C, 0},
+  {0x1193E, 0x1193E, 0}, {0x11943, 0x11943, 0}, {0x119D4, 0x119DB, 0},
+  {0x119E0, 0x119E0, 0}, {0x11A01, 0x11A0A, 0}, {0x11A33, 0x11A38, 0},
+  {0x11A3B, 0x11A3E, 0}, {0x11A47, 0x11A47, 0}, {0x11A51, 0x11A56, 0},
+  {0x11A59, 0x11A5B, 0}, {0x11A8A, 0x11A96, 0}, {0x11A98, 0x11A99, 0},
+  {0x11C30, 0x11C3D, 0}, {0x11C3F, 0x11C3F, 0}, {0x11C92, 0x11CA7, 0},
+  {0x11CAA, 0x11CB0, 0}, {0x11CB2, 0x11CB3, 0}, {0x11CB5, 0x11CB6, 0},
+  {0x11D31, 0x11D45, 0}, {0x11D47, 0x11D47, 0}, {0x11D90, 0x11D91, 0},
+  {0x11D95, 0x11D95, 0}, {0x11D97, 0x11D97, 0}, {0x11EF3, 0x11EF4, 0},
+  {0x13430, 0x13438, 0}, {0x16AF0, 0x16AF4, 0}, {0x16B30, 0x16B36, 0},
+  {0x16F4F, 0x16F4F, 0}, {0x16F8F, 0x16F92, 0}, {0x16FE0, 0x16FE3, 2},
+  {0x16FE4, 0x16FE4, 0}, {0x16FF0, 0x1B2FB, 2}, {0x1BC9D, 0x1BC9E, 0},
+  {0x1BCA0, 0x1CF46, 0}, {0x1D167, 0x1D169, 0}, {0x1D173, 0x1D182, 0},
+  {0x1D185, 0x1D18B, 0}, {0x1D1AA, 0x1D1AD, 0}, {0x1D242, 0x1D244, 0},
+  {0x1DA00, 0x1DA36, 0}, {0x1DA3B, 0x1DA6C, 0}, {0x1DA75, 0x1DA75, 0},
+  {0x1DA84, 0x1DA84, 0}, {0x1DA9B, 0x1DAAF, 0}, {0x1E000, 0x1E02A, 0},
+  {0x1E130, 0x1E136, 0}, {0x1E2AE, 0x1E2AE, 0}, {0x1E2EC, 0x1E2EF, 0},
+  {0x1E8D0, 0x1E8D6, 0}, {0x1E944, 0x1E94A, 0}, {0x1F004, 0x1F004, 2},
+  {0x1F0CF, 0x1F0CF, 2}, {0x1F18E, 0x1F18E, 2}, {0x1F191, 0x1F19A, 2},
+  {0x1F200, 0x1F320, 2}, {0x1F32D, 0x1F335, 2}, {0x1F337, 0x1F37C, 2},
+  {0x1F37E, 0x1F393, 2}, {0x1F3A0, 0x1F3CA, 2}, {0x1F3CF, 0x1F3D3, 2},
+  {0x1F3E0, 0x1F3F0, 2}, {0x1F3F4, 0x1F3F4, 2}, {0x1F3F8, 0x1F43E, 2},
+  {0x1F440, 0x1F440, 2}, {0x1F442, 0x1F4FC, 2}, {0x1F4FF, 0x1F53D, 2},
+  {0x1F54B, 0x1F54E, 2}, {0x1F550, 0x1F567, 2}, {0x1F57A, 0x1F57A, 2},
+  {0x1F595, 0x1F596, 2}, {0x1F5A4, 0x1F5A4, 2}, {0x1F5FB, 0x1F64F, 2},
+  {0x1F680, 0x1F6C5, 2}, {0x1F6CC, 0x1F6CC, 2}, {0x1F6D0, 0x1F6D2, 2},
+  {0x1F6D5, 0x1F6DF, 2}, {0x1F6EB, 0x1F6EC, 2}, {0x1F6F4, 0x1F6FC, 2},
+  {0x1F7E0, 0x1F7F0, 2}, {0x1F90C, 0x1F93A, 2}, {0x1F93C, 0x1F945, 2},
+  {0x1F947, 0x1F9FF, 2}, {0x1FA70, 0x1FAF6, 2}, {0x20000, 0x3FFFD, 2},
+  {0xE0001, 0xE01EF, 0}
+};
+
+uint8_t utf8WidthIndex[0x110000 >> 8];
+uint8_t (*utf8WidthBlocks)[64];
+
+void utf8WidthInit() {
+  if (utf8WidthBlocks) return;
+  size_t nranges = sizeof(utf8WidthRanges) / sizeof(utf8WidthRanges[0]);
+  // block 0 has every code point one column wide
+  size_t nblocks = 1, r = 0;
+  utf8WidthBlocks = malloc(64);
+  memset(utf8WidthBlocks[0], 0x55, 64);
+  for (uint32_t b = 0; b < (0x110000 >> 8); b++) {
+    uint32_t lo = b << 8, hi = lo + 255;
+    while (r < nranges && utf8WidthRanges[r].last < lo) r++;
+    if (r == nranges || utf8WidthRanges[r].first > hi) continue;
+    uint8_t block[64];
+    memset(block, 0x55, sizeof(block));
+    for (size_t k = r; k < nranges && utf8WidthRanges[k].first <= hi; k++) {
+      uint32_t from = utf8WidthRanges[k].first < lo ? lo : utf8WidthRanges[k].first;
+      uint32_t to = utf8WidthRanges[k].last > hi ? hi : utf8WidthRanges[k].last;
+      if (from == lo && to == hi) {
+        memset(block, utf8WidthRanges[k].width * 0x55, sizeof(block));
+        continue;
+      }
+      for (uint32_t cp = from - lo; cp <= to - lo; cp++) {
+        block[cp >> 2] &= ~(3 << ((cp & 3) * 2));
+        block[cp >> 2] |= utf8WidthRanges[k].width << ((cp & 3) * 2);
+      }
+    }
+    // runs of identical blocks are common, so try the previous one first
+    size_t j = b > 0 ? utf8WidthIndex[b - 1] : 0;
+    if (memcmp(utf8WidthBlocks[j], block, sizeof(block)))
+      for (j = 0; j < nblocks; j++)
+        if (!memcmp(utf8WidthBlocks[j], block, sizeof(block))) break;
+    if (j == nblocks) {
+      utf8WidthBlocks = realloc(utf8WidthBlocks, sizeof(block) * ++nblocks);
+      memcpy(utf8WidthBlocks[j], block, sizeof(block));
+    }
+    utf8WidthIndex[b] = j;
+  }
+}
+
+int utf8Width(uint32_t cp) {
+  if (cp >= 0x110000) return 1;
+  uint32_t k = cp & 0xff;
+  return (utf8WidthBlocks[utf8WidthIndex[cp >> 8]][k >> 2] >> ((k & 3) * 2)) & 3;
+}
+
+// Decodes the character at s into *cp and returns its length in bytes. A
+// malformed sequence decodes one byte at a time as UTF8_INVALID.
+size_t utf8Decode(const char *s, size_t len, uint32_t *cp) {
+  const unsigned char *u = (const unsigned char *)s;
+  size_t n;
+  uint32_t c, min;
+  if (u[0] < 0x80) {
+    *cp = u[0];
+    return 1;
+  } else if ((u[0] & 0xe0) == 0xc0) {
+    n = 2, c = u[0] & 0x1f, min = 0x80;
+  } else if ((u[0] & 0xf0) == 0xe0) {
+    n = 3, c = u[0] & 0x0f, min = 0x800;
+  } else if ((u[0] & 0xf8) == 0xf0) {
+    n = 4, c = u[0] & 0x07, min = 0x10000;
+  } else {
+    *cp = UTF8_INVALID;
+    return 1;
+  }
+  if (n > len) n = 0;
+  for (size_t i = 1; i < n; i++) {
+    if ((u[i] & 0xc0) != 0x80) {
+      n = 0;
+      break;
+    }
+    c = (c << 6) | (u[i] & 0x3f);
+  }
+  if (n == 0 || c < min || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff)) {
+    *cp = UTF8_INVALID;
+    return 1;
+  }
+  *cp = c;
+  return n;
+}
+
+// Length of the plain ASCII prefix of s
+size_t utf8AsciiPrefix(const char *s, size_t len) {
+  return K.ascii(s, len);
+}
+
+// Columns of the character at s on screen; control characters and
+// malformed bytes are drawn as a single inverted symbol
+int utf8Cols(const char *s, size_t len, size_t *n) {
+  uint32_t cp;
+  *n = utf8Decode(s, len, &cp);
+  return cp == UTF8_INVALID ? 1 : utf8Width(cp);
+}
+
+// Start of the character before byte i
+size_t utf8Prev(const char *s, size_t i) {
+  if (i == 0) return 0;
+  size_t j = i - 1;
+  while (j > 0 && i - j < 4 && (s[j] & 0xc0) == 0x80) j--;
+  uint32_t cp;
+  return j + utf8Decode(&s[j], i - j, &cp) == i ? j : i - 1;
+}
+
+/*** Word index ***/
+
+/*
+ * Every identifier in the buffer, with the number of times it occurs, for
+ * completion. A row's words are added when it is rendered and taken away
+ * again, from its old render, when it is rendered after a change, so an
+ * edit costs the length of the row and nothing more. Cooling a row keeps
+ * its words counted. Rows loaded with a file are only counted when the
+ * first completion asks for them, so opening a file pays nothing.
+ *
+ * Words live in W.words, found through an open addressed table of their
+ * indices. Prefix lookups binary search W.sorted, the words in byte order;
+ * words seen since it was last built wait in W.recent, which is sorted and
+ * merged into it once it grows past CAX_WORD_RECENT.
+ */
+
+#define CAX_WORD_RECENT 256
+
+struct wordEntry {
+  char *word;
+  uint32_t len;
+  uint32_t count;
+  uint64_t hash;
+  int listed;                 // in W.sorted or W.recent
+};
+
+struct wordIndex {
+  struct wordEntry *words;
+  size_t nwords;
+  size_t cap;
+  uint32_t *table;            // 1 + index into words, 0 when free
+  size_t tablecap;
+  uint32_t *sorted;
+  size_t nsorted;
+  uint32_t *recent;
+  size_t nrecent;
+  size_t recentcap;
+  int complete;               // every row of the buffer has been counted;
+                              // until then no row is
+};
+
+struct wordIndex W = { NULL, 0, 0, NULL, 0, NULL, 0, NULL, 0, 0, 1 };
+
+int wordChar(unsigned char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') || c == '_' || c >= 0x80;
+}
+
+void wordIndexReset() {
+  for (size_t i = 0; i < W.nwords; i++) free(W.words[i].word);
+  free(W.words);
+  free(W.table);
+  free(W.sorted);
+  free(W.recent);
+  memset(&W, 0, sizeof(W));
+  W.complete = 1;
+}
+
+void wordIndexGrow() {
+  size_t cap = W.tablecap ? W.tablecap * 2 : 1024;
+  uint32_t *table = calloc(cap, sizeof(uint32_t));
+  for (size_t i = 0; i < W.nwords; i++) {
+    size_t h = W.words[i].hash & (cap - 1);
+    while (table[h]) h = (h + 1) & (cap - 1);
+    table[h] = i + 1;
+  }
+  free(W.table);
+  W.table = table;
+  W.tablecap = cap;
+}
+
+void wordIndexAdd(const char *s, size_t len, uint64_t hash, int delta) {
+  if (W.nwords * 2 >= W.tablecap) wordIndexGrow();
+  size_t h = hash & (W.tablecap - 1);
+  struct wordEntry *e = NULL;
+  for (; W.table[h]; h = (h + 1) & (W.tablecap - 1)) {
+    e = &W.words[W.table[h] - 1];
+    if (e->hash == hash && e->len == len && !memcmp(e->word, s, len)) break;
+    e = NULL;
+  }
+  if (!e) {
+    if (delta < 0) return;
+    if (W.nwords == W.cap) {
+      W.cap = W.cap ? W.cap * 2 : 1024;
+      W.words = realloc(W.words, sizeof(struct wordEntry) * W.cap);
+    }
+    e = &W.words[W.nwords];
+    e->word = malloc(len);
+    memcpy(e->word, s, len);
+    e->len = len;
+    e->count = 0;
+    e->hash = hash;
+    e->listed = 0;
+    W.table[h] = ++W.nwords;
+  }
+  if (delta < 0 && e->count == 0) return;
+  e->count += delta;
+  if (e->count && !e->listed) {
+    if (W.nrecent == W.recentcap) {
+      W.recentcap = W.recentcap ? W.recentcap * 2 : CAX_WORD_RECENT;
+      W.recent = realloc(W.recent, sizeof(uint32_t) * W.recentcap);
+    }
+    W.recent[W.nrecent++] = e - W.words;
+    e->listed = 1;
+  }
+}
+
+// Adds delta to the count of every identifier in s
+void wordIndexText(const char *s, size_t len, int delta) {
+  size_t i = 0;
+  while (i < len) {
+    while (i < len && !wordChar(s[i])) i++;
+    size_t start = i;
+    // FNV-1a of the word as it is scanned
+    uint64_t hash = FNV1A_INIT;
+    for (; i < len && wordChar(s[i]); i++) {
+      hash ^= (unsigned char)s[i];
+      hash *= 1099511628211ull;
+    }
+    if (i - start > 1 && !isdigit((unsigned char)s[start]))
+      wordIndexAdd(&s[start], i - start, hash, delta);
+  }
+}
+
+int wordCmp(const struct wordEntry *a, const struct wordEntry *b) {
+  int c = memcmp(a->word, b->word, a->len < b->len ? a->len : b->len);
+  if (c) return c;
+  return a->len < b->len ? -1 : a->len > b->len;
+}
+
+int wordIndexCmp(const void *a, const void *b) {
+  return wordCmp(&W.words[*(const uint32_t *)a],
+                 &W.words[*(const uint32_t *)b]);
+}
+
+// Sorts W.recent into W.sorted, dropping words no longer in the buffer
+void wordIndexMerge() {
+  qsort(W.recent, W.nrecent, sizeof(uint32_t), wordIndexCmp);
+  uint32_t *out = malloc(sizeof(uint32_t) * (W.nsorted + W.nrecent + 1));
+  size_t i = 0, j = 0, n = 0;
+  while (i < W.nsorted || j < W.nrecent) {
+    uint32_t w;
+    if (j == W.nrecent ||
+        (i < W.nsorted && wordIndexCmp(&W.sorted[i], &W.recent[j]) < 0))
+      w = W.sorted[i++];
+    else
+      w = W.recent[j++];
+    if (W.words[w].count) out[n++] = w;
+    else W.words[w].listed = 0;
+  }
+  free(W.sorted);
+  W.sorted = out;
+  W.nsorted = n;
+  W.nrecent = 0;
+}
+
+// Counts rows that were never rendered, as rows from the open cache are
+void wordIndexComplete() {
+  if (W.complete) return;
+  for (size_t j = 0; j < E.numrows; j++) {
+    erow *row = &E.row[j];
+    if (row->indexed) continue;
+    wordIndexText(editorRowPeek(row), row->size, 1);
+    row->indexed = 1;
+  }
+  W.complete = 1;
+}
+
+// Better completions sort first: more frequent, then shorter, then in
+// byte order
+int wordRankBefore(struct wordEntry *a, struct wordEntry *b) {
+  if (a->count != b->count) return a->count > b->count;
+  if (a->len != b->len) return a->len < b->len;
+  return wordCmp(a, b) < 0;
+}
+
+void wordRankInsert(uint32_t *out, size_t *n, size_t max, uint32_t w) {
+  struct wordEntry *e = &W.words[w];
+  size_t k = *n < max ? (*n)++ : max;
+  while (k > 0 && wordRankBefore(e, &W.words[out[k - 1]])) {
+    if (k < max) out[k] = out[k - 1];
+    k--;
+  }
+  if (k < max) out[k] = w;
+}
+
+// The best max words that are longer than prefix and start with it
+size_t wordIndexQuery(const char *prefix, size_t plen, uint32_t *out,
+                      size_t max) {
+  wordIndexComplete();
+  if (W.nrecent > CAX_WORD_RECENT) wordIndexMerge();
+  size_t n = 0;
+  size_t lo = 0, hi = W.nsorted;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    struct wordEntry *e = &W.words[W.sorted[mid]];
+    size_t l = e->len < plen ? e->len : plen;
+    int c = memcmp(e->word, prefix, l);
+    if (c < 0 || (c == 0 && e->len < plen)) lo = mid + 1;
+    else hi = mid;
+  }
+  for (; lo < W.nsorted; lo++) {
+    struct wordEntry *e = &W.words[W.sorted[lo]];
+    if (e->len < plen || memcmp(e->word, prefix, plen)) break;
+    if (e->count && e->len > plen) wordRankInsert(out, &n, max, W.sorted[lo]);
+  }
+  for (size_t j = 0; j < W.nrecent; j++) {
+    struct wordEntry *e = &W.words[W.recent[j]];
+    if (e->count && e->len > plen && !memcmp(e->word, prefix, plen))
+      wordRankInsert(out, &n, max, W.recent[j]);
+  }
+  return n;
+}
+
+/*** Row operations ***/
+
+// Columns taken by the character at byte at of row
+int editorCharCols(erow *row, size_t at) {
+  size_t n;
+  return utf8Cols(&row->chars[at], row->size - at, &n);
+}
+
+// Screen column of byte cx; ASCII prefixes are one column per byte
+size_t editorRowCxToRx(erow *row, size_t cx) {
+  size_t rx = 0;
+  size_t j = 0;
+  while (j < cx) {
+    // ASCII is a column a byte, up to the next tab
+    size_t ascii = j + utf8AsciiPrefix(&row->chars[j], cx - j);
+    while (j < ascii) {
+      size_t run = K.find(&row->chars[j], ascii - j, '\t');
+      rx += run;
+      j += run;
+      if (j < ascii) {
+        rx += CAX_TAB_STOP - (rx % CAX_TAB_STOP);
+        j++;
+      }
+    }
+    if (j < cx) {
+      size_t n;
+      rx += utf8Cols(&row->chars[j], row->size - j, &n);
+      j += n;
+    }
+  }
+  return rx;
+}
+
+// Byte offset of the character drawn at screen column rx
+size_t editorRowRxToCx(erow *row, size_t rx) {
+  size_t cur_rx = 0;
+  size_t cx = 0;
+  while (cx < row->size) {
+    size_t n;
+    if (row->chars[cx] == '\t')
+      cur_rx += CAX_TAB_STOP - (cur_rx % CAX_TAB_STOP), n = 1;
+    else
+      cur_rx += utf8Cols(&row->chars[cx], row->size - cx, &n);
+    if (cur_rx > rx) return cx;
+    cx += n;
+  }
+  return cx;
+}
+
+// Byte offset in render of byte cx of chars
+size_t editorRowCxToRender(erow *row, size_t cx) {
+  size_t ascii = utf8AsciiPrefix(row->chars, cx);
+  if (ascii == cx && !memchr(row->chars, '\t', cx)) return cx;
+  size_t col = 0, roff = 0;
+  size_t j = 0;
+  while (j < cx) {
+    size_t n;
+    if (row->chars[j] == '\t') {
+      size_t spaces = CAX_TAB_STOP - (col % CAX_TAB_STOP);
+      col += spaces;
+      roff += spaces;
+      n = 1;
+    } else {
+      col += utf8Cols(&row->chars[j], row->size - j, &n);
+      roff += n;
+    }
+    j += n;
+  }
+  return roff;
+}
+
+// Byte offset in chars of byte off of render
+size_t editorRowRenderToCx(erow *row, size_t off) {
+  size_t col = 0, roff = 0;
+  size_t cx = 0;
+  while (cx < row->size) {
+    size_t n;
+    if (row->chars[cx] == '\t') {
+      size_t spaces = CAX_TAB_STOP - (col % CAX_TAB_STOP);
+      col += spaces;
+      roff += spaces;
+      n = 1;
+    } else {
+      col += utf8Cols(&row->chars[cx], row->size - cx, &n);
+      roff += n;
+    }
+    if (roff > off) return cx;
+    cx += n;
+  }
+  return cx;
+}
+
+
+// Rebuilds render from chars, without touching the highlighting
+void editorRenderRow(erow *row) {
+  if (E.headless) return;
+  size_t tabs = K.count(row->chars, row->size, '\t');
+  size_t j = 0;
+  if (tabs > (SIZE_MAX - row->size - 1) / (CAX_TAB_STOP - 1))
+    die("row too long");
+  // the old render still holds the words that were counted; a row thawed
+  // without one has not changed since it was counted
+  if (row->render && row->indexed) {
+    wordIndexText(row->render, row->rsize, -1);
+    row->indexed = 0;
+  }
+  free(row->render);
+  row->render = malloc(row->size + tabs*(CAX_TAB_STOP - 1) + 1);
+  if (!row->render) die("malloc");
+  // tab stops are screen columns, which stop matching idx after the
+  // first character that is not ASCII
+  size_t idx = 0, col = 0;
+  while (j < row->size) {
+    // ASCII up to the next tab is copied as it is, a column a byte
+    size_t ascii = j + utf8AsciiPrefix(&row->chars[j], row->size - j);
+    while (j < ascii) {
+      size_t run = K.find(&row->chars[j], ascii - j, '\t');
+      memcpy(&row->render[idx], &row->chars[j], run);
+      idx += run;
+      col += run;
+      j += run;
+      if (j < ascii) {
+        size_t spaces = CAX_TAB_STOP - (col % CAX_TAB_STOP);
+        memset(&row->render[idx], ' ', spaces);
+        idx += spaces;
+        col += spaces;
+        j++;
+      }
+    }
+    if (j < row->size) {
+      size_t n;
+      col += utf8Cols(&row->chars[j], row->size - j, &n);
+      memcpy(&row->render[idx], &row->chars[j], n);
+      idx += n;
+      j += n;
+    }
+  }
+  row->render[idx] = '\0';
+  row->rsize = idx;
+  if (!row->indexed && W.complete) {
+    wordIndexText(row->render, row->rsize, 1);
+    row->indexed = 1;
+  }
+}
+
+// Tells the journal and the diff gutter about a change; deletions are
+// passed on before the rows go
+void editorRowsChanged(int op, size_t at, size_t count, size_t shift) {
+  journalPut(op, at, count, shift,
+             op == ROW_SET ? 1 : op == ROW_INSERT ? count : 0);
+  diffRowsChanged(op, at, count, shift);
+  foldRowsChanged(op, at, count);
+}
+
+void editorUpdateRow(erow *row) {
+  row->foff = -1;
+  editorRenderRow(row);
+  editorUpdateSyntax(row);
+  editorRowAccount(row);
+  // only rows laid out before need it again; the rest wait to be drawn
+  if (E.wrap && row->wrapgen == E.wrap_gen) editorWrapRelayout(row);
+  editorRowsChanged(ROW_SET, row->idx, 1, 0);
+}
+
+
+
+void editorInsertRow(size_t at, char *s, size_t len) {
+  if (at > E.numrows) 
+    return;
+  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
+  memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+  for (size_t j = at + 1; j <= E.numrows; j++) E.row[j].idx++;
+
+  E.row[at].idx = at;
+
+  E.row[at].size = len;
+  E.row[at].chars = malloc(len + 1);
+  memcpy(E.row[at].chars, s, len);
+  E.row[at].chars[len] = '\0';
+
+
+  E.row[at].rsize = 0;
+  E.row[at].render = NULL;
+  E.row[at].hl = NULL;
+  E.row[at].hl_open_comment = 0;
+  E.row[at].indexed = 0;
+  E.row[at].bmin = 1;
+  E.row[at].hidden = 0;
+  E.row[at].mem = 0;
+  E.row[at].cold = NULL;
+  E.row[at].coff = 0;
+  E.row[at].foff = -1;
+  E.row[at].wrapgen = 0;
+  E.numrows++;
+  rowIndexInsert(at, 1);
+  editorUpdateRows(at, 1);
+
+  E.dirty++;
+  editorUndoInsert(at);
+  editorRowsChanged(ROW_INSERT, at, 1, 0);
+}
+
+void editorFreeRow(erow *row) {
+  if (row->indexed)
+    wordIndexText(row->render ? row->render : editorRowPeek(row),
+                  row->render ? row->rsize : row->size, -1);
+  if (row->cold) coldBlockRelease(row->cold);
+  E.hot_bytes -= row->mem;
+  free(row->render);
+  free(row->chars);
+  free(row->hl);
+}
+
+void editorDelRow(size_t at) {
+  if (at >= E.numrows) return;
+  editorUndoDelete(at);
+  editorRowsChanged(ROW_DELETE, at, 1, 0);
+  rowIndexDelete(at, 1);
+  editorFreeRow(&E.row[at]);
+  memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
+  for (size_t j = at; j + 1 < E.numrows; j++) E.row[j].idx--;
+  E.numrows--;
+  E.dirty++;
+}
+
+/*
+ * Range versions of the row primitives: the tail of E.row moves once and
+ * idx is fixed once, however many rows there are, and highlighting runs
+ * from the first changed row only until the comment state settles.
+ */
+
+// Highlights rows at..at+n-1, then the rows below them for as long as the
+// comment state they inherit keeps changing
+void editorHighlightRange(size_t at, size_t n) {
+  int changed = 0;
+  for (size_t j = at; j < E.numrows && (j < at + n || changed); j++)
+    changed = editorHighlightRow(editorRow(j));
+}
+
+// editorUpdateRow for n rows at once
+void editorUpdateRows(size_t at, size_t n) {
+  for (size_t j = at; j < at + n; j++) {
+    erow *row = editorRow(j);
+    row->foff = -1;
+    editorRenderRow(row);
+  }
+  editorHighlightRange(at, n);
+  for (size_t j = at; j < at + n; j++) {
+    editorRowAccount(&E.row[j]);
+    if (E.wrap && E.row[j].wrapgen == E.wrap_gen)
+      editorWrapRelayout(&E.row[j]);
+  }
+}
+
+void editorInsertRows(size_t at, char **lines, size_t *lens, size_t n) {
+  if (at > E.numrows || n == 0) return;
+  E.row = realloc(E.row, sizeof(erow) * (E.numrows + n));
+  memmove(&E.row[at + n], &E.row[at], sizeof(erow) * (E.numrows - at));
+  for (size_t j = at + n; j < E.numrows + n; j++) E.row[j].idx += n;
+  for (size_t k = 0; k < n; k++) {
+    erow *row = &E.row[at + k];
+    row->idx = at + k;
+    row->size = lens[k];
+    row->chars = malloc(lens[k] + 1);
+    memcpy(row->chars, lines[k], lens[k]);
+    row->chars[lens[k]] = '\0';
+    row->rsize = 0;
+    row->render = NULL;
+    row->hl = NULL;
+    row->hl_open_comment = 0;
+    row->indexed = 0;
+    row->bmin = 1;
+    row->hidden = 0;
+    row->mem = 0;
+    row->cold = NULL;
+    row->coff = 0;
+    row->wrapgen = 0;
+  }
+  E.numrows += n;
+  rowIndexInsert(at, n);
+  editorUpdateRows(at, n);
+  E.dirty++;
+  editorUndoInsertRange(at, n);
+  editorRowsChanged(ROW_INSERT, at, n, 0);
+}
+
+void editorDelRows(size_t at, size_t n) {
+  if (at >= E.numrows) return;
+  if (n > E.numrows - at) n = E.numrows - at;
+  editorUndoDeleteRange(at, n);
+  editorRowsChanged(ROW_DELETE, at, n, 0);
+  rowIndexDelete(at, n);
+  for (size_t j = at; j < at + n; j++) editorFreeRow(&E.row[j]);
+  memmove(&E.row[at], &E.row[at + n], sizeof(erow) * (E.numrows - at - n));
+  E.numrows -= n;
+  for (size_t j = at; j < E.numrows; j++) E.row[j].idx -= n;
+  E.dirty++;
+  // the row now at at inherits a different comment state
+  editorHighlightRange(at, 1);
+}
+
+// Rotates rows at..at+n-1 left by k, so that row at+k comes first
+void editorRotateRows(size_t at, size_t n, size_t k) {
+  if (at + n > E.numrows || k == 0 || k >= n) return;
+  erow *tmp = malloc(sizeof(erow) * k);
+  memcpy(tmp, &E.row[at], sizeof(erow) * k);
+  memmove(&E.row[at], &E.row[at + k], sizeof(erow) * (n - k));
+  memcpy(&E.row[at + n - k], tmp, sizeof(erow) * k);
+  free(tmp);
+  for (size_t j = at; j < at + n; j++) E.row[j].idx = j;
+  rowIndexAdjust(at, n);
+  E.dirty++;
+  editorUndoRotate(at, n, k);
+  editorRowsChanged(ROW_ROTATE, at, n, k);
+  editorHighlightRange(at, n);
+}
+
+void editorRowInsertChar(erow *row, size_t at, int c) {
+  if (at > row->size) at = row->size;
+  editorUndoChange(row->idx);
+  row->chars = realloc(row->chars, row->size + 2);
+  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+  row->size++;
+  row->chars[at] = c;
+  editorUpdateRow(row);
+  E.dirty++;
+}
+
+void editorInsertNewline() {
+  if (E.cx == 0) {
+    editorInsertRow(E.cy, "", 0);
+  } else {
+    erow *row = editorRow(E.cy);
+    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+    row = &E.row[E.cy];
+    editorUndoChange(E.cy);
+    row->size = E.cx;
+    row->chars[row->size] = '\0';
+    editorUpdateRow(row);
+  }
+  E.cy++;
+  E.cx = 0;
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len) {
+  editorUndoChange(row->idx);
+  row->chars = realloc(row->chars, row->size + len + 1);
+  memcpy(&row->chars[row->size], s, len);
+  row->size += len;
+  row->chars[row->size] = '\0';
+  editorUpdateRow(row);
+  E.dirty++;
+}
+
+void editorRowDelChar(erow *row, size_t at, size_t len) {
+  if (at >= row->size) return;
+  if (len > row->size - at) len = row->size - at;
+  editorUndoChange(row->idx);
+  memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+  row->size -= len;
+  editorUpdateRow(row);
+  E.dirty++;
+}
+
+
 /*** Editor Operations ***/
 
-void editorInsertChar(int c){
-  if(E.cy == E.numrows){
-    editorInsertRow(E.numrows , "" , 0);
+void editorInsertChar(int c){
+  if(E.cy == E.numrows){
+    editorInsertRow(E.numrows , "" , 0);
+  }
+  editorRowInsertChar(editorRow(E.cy) , E.cx , c);
+  E.cx++;
+}
+
+
+void editorDelChar() {
+  if (E.cy == E.numrows) return;
+  if (E.cx == 0 && E.cy == 0) return;
+  erow *row = editorRow(E.cy);
+  if (E.cx > 0) {
+    size_t at = utf8Prev(row->chars, E.cx);
+    editorRowDelChar(row, at, E.cx - at);
+    E.cx = at;
+  } else {
+    E.cx = E.row[E.cy - 1].size;
+    editorRowAppendString(editorRow(E.cy - 1), row->chars, row->size);
+    editorDelRow(E.cy);
+    E.cy--;
+  }
+}
+
+/*** Undo ***/
+
+/*
+ * Every row primitive records how to revert itself into the open undo
+ * group: the old contents of a changed or deleted row, or the index of an
+ * inserted row. A group is closed by editorUndoBreak(), normally once per
+ * command, so Ctrl-Z reverts whole commands. Loading a file or streaming
+ * rows suspends recording.
+ */
+
+void editorUndoFreeGroup(struct undoGroup *g) {
+  for (size_t j = 0; j < g->nrecs; j++) free(g->recs[j].chars);
+  free(g->recs);
+}
+
+void editorUndoReset() {
+  for (size_t j = 0; j < E.nundo; j++) editorUndoFreeGroup(&E.undo[j]);
+  free(E.undo);
+  E.undo = NULL;
+  E.nundo = 0;
+  E.undo_break = 1;
+}
+
+void editorUndoBreak() {
+  E.undo_break = 1;
+}
+
+struct undoRecord *editorUndoPush(int type, size_t at) {
+  if (E.undo_suspended) return NULL;
+  if (E.undo_break || E.nundo == 0) {
+    if (E.nundo == CAX_UNDO_LEVELS) {
+      editorUndoFreeGroup(&E.undo[0]);
+      memmove(&E.undo[0], &E.undo[1], sizeof(struct undoGroup) * --E.nundo);
+    }
+    E.undo = realloc(E.undo, sizeof(struct undoGroup) * (E.nundo + 1));
+    struct undoGroup *g = &E.undo[E.nundo++];
+    g->recs = NULL;
+    g->nrecs = g->cap = 0;
+    g->cx = E.cx;
+    g->cy = E.cy;
+    E.undo_break = 0;
+  }
+  struct undoGroup *g = &E.undo[E.nundo - 1];
+  if (g->nrecs == g->cap) {
+    g->cap = g->cap ? g->cap * 2 : 8;
+    g->recs = realloc(g->recs, sizeof(struct undoRecord) * g->cap);
+  }
+  struct undoRecord *r = &g->recs[g->nrecs++];
+  r->type = type;
+  r->at = at;
+  r->chars = NULL;
+  r->size = 0;
+  r->count = r->shift = 0;
+  return r;
+}
+
+// Records the current contents of row at, which is about to change. A run
+// of edits to the same row only needs the contents from before the first.
+void editorUndoChange(size_t at) {
+  if (E.undo_suspended) return;
+  if (!E.undo_break && E.nundo) {
+    struct undoGroup *g = &E.undo[E.nundo - 1];
+    if (g->nrecs && g->recs[g->nrecs - 1].type == UNDO_CHANGE &&
+        g->recs[g->nrecs - 1].at == at)
+      return;
+  }
+  struct undoRecord *r = editorUndoPush(UNDO_CHANGE, at);
+  r->size = E.row[at].size;
+  r->chars = malloc(r->size + 1);
+  editorRowCopyChars(&E.row[at], r->chars);
+  r->chars[r->size] = '\0';
+}
+
+// Like editorUndoChange, but takes ownership of the old contents
+void editorUndoChangeTake(size_t at, char *chars, size_t size) {
+  struct undoRecord *r = editorUndoPush(UNDO_CHANGE, at);
+  if (!r) {
+    free(chars);
+    return;
+  }
+  r->chars = chars;
+  r->size = size;
+}
+
+void editorUndoInsert(size_t at) {
+  editorUndoPush(UNDO_INSERT, at);
+}
+
+void editorUndoDelete(size_t at) {
+  if (E.undo_suspended) return;
+  struct undoRecord *r = editorUndoPush(UNDO_DELETE, at);
+  r->size = E.row[at].size;
+  r->chars = malloc(r->size + 1);
+  editorRowCopyChars(&E.row[at], r->chars);
+  r->chars[r->size] = '\0';
+}
+
+void editorUndoInsertRange(size_t at, size_t count) {
+  struct undoRecord *r = editorUndoPush(UNDO_INSERT_RANGE, at);
+  if (r) r->count = count;
+}
+
+// Keeps rows at..at+count-1 as one '\n' joined string
+void editorUndoDeleteRange(size_t at, size_t count) {
+  if (E.undo_suspended) return;
+  size_t total = 0;
+  for (size_t j = at; j < at + count; j++) total += E.row[j].size + 1;
+  struct undoRecord *r = editorUndoPush(UNDO_DELETE_RANGE, at);
+  r->chars = malloc(total);
+  r->size = total - 1;
+  r->count = count;
+  char *p = r->chars;
+  for (size_t j = at; j < at + count; j++) {
+    editorRowCopyChars(&E.row[j], p);
+    p += E.row[j].size;
+    *p++ = '\n';
+  }
+  r->chars[r->size] = '\0';
+}
+
+void editorUndoRotate(size_t at, size_t count, size_t shift) {
+  struct undoRecord *r = editorUndoPush(UNDO_ROTATE, at);
+  if (!r) return;
+  r->count = count;
+  r->shift = shift;
+}
+
+void editorUndo() {
+  if (E.nundo == 0) {
+    editorSetStatusMessage("Nothing to undo");
+    return;
+  }
+  struct undoGroup *g = &E.undo[--E.nundo];
+  // the extra cursors would point at the text that was there before
+  editorCursorsClear();
+  E.undo_suspended++;
+  for (size_t j = g->nrecs; j-- > 0;) {
+    struct undoRecord *r = &g->recs[j];
+    switch (r->type) {
+      case UNDO_CHANGE: {
+        erow *row = editorRow(r->at);
+        free(row->chars);
+        row->chars = r->chars;
+        row->size = r->size;
+        r->chars = NULL;
+        editorUpdateRow(row);
+        break;
+      }
+      case UNDO_INSERT:
+        editorDelRow(r->at);
+        break;
+      case UNDO_DELETE:
+        editorInsertRow(r->at, r->chars, r->size);
+        break;
+      case UNDO_INSERT_RANGE:
+        editorDelRows(r->at, r->count);
+        break;
+      case UNDO_DELETE_RANGE: {
+        char **lines = malloc(sizeof(char *) * r->count);
+        size_t *lens = malloc(sizeof(size_t) * r->count);
+        char *p = r->chars;
+        for (size_t k = 0; k < r->count; k++) {
+          char *nl = memchr(p, '\n', r->chars + r->size - p);
+          lines[k] = p;
+          lens[k] = nl ? (size_t)(nl - p) : (size_t)(r->chars + r->size - p);
+          p += lens[k] + 1;
+        }
+        editorInsertRows(r->at, lines, lens, r->count);
+        free(lines);
+        free(lens);
+        break;
+      }
+      case UNDO_ROTATE:
+        editorRotateRows(r->at, r->count, r->count - r->shift);
+        break;
+    }
+  }
+  E.undo_suspended--;
+  E.cx = g->cx;
+  E.cy = g->cy;
+  if (E.cy > E.numrows) E.cy = E.numrows;
+  if (E.cy < E.numrows && E.cx > E.row[E.cy].size) E.cx = E.row[E.cy].size;
+  E.dirty++;
+  E.undo_break = 1;
+  editorUndoFreeGroup(g);
+}
+
+/*** Multiple cursors ***/
+
+/*
+ * Ctrl-N adds a cursor on the next line and Ctrl-E one at every match of
+ * a string. While there are extra cursors, typing, deleting, Enter and the
+ * cursor keys act on all of them as one batch: the cursors of a row are
+ * applied to it in a single pass, each changed row is updated and
+ * highlighted once, and the batch is a single undo step drawn in a single
+ * frame. Escape drops the extra cursors.
+ */
+
+enum multiEdit { MULTI_INSERT, MULTI_BACKSPACE, MULTI_DELETE };
+
+int cursorCmp(const void *a, const void *b) {
+  const struct editorCursor *x = a, *y = b;
+  if (x->cy != y->cy) return x->cy < y->cy ? -1 : 1;
+  if (x->cx != y->cx) return x->cx < y->cx ? -1 : 1;
+  return 0;
+}
+
+// First cursor at or after row cy, column cx
+size_t cursorLowerBound(size_t cy, size_t cx) {
+  size_t lo = 0, hi = E.ncursors;
+  struct editorCursor key = { cx, cy };
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (cursorCmp(&E.cursors[mid], &key) < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// Sorts the extra cursors and drops the ones that landed on another
+void editorCursorsNormalize() {
+  qsort(E.cursors, E.ncursors, sizeof(struct editorCursor), cursorCmp);
+  size_t n = 0;
+  for (size_t j = 0; j < E.ncursors; j++) {
+    struct editorCursor *c = &E.cursors[j];
+    if (c->cx == E.cx && c->cy == E.cy) continue;
+    if (n && !cursorCmp(&E.cursors[n - 1], c)) continue;
+    E.cursors[n++] = *c;
+  }
+  E.ncursors = n;
+}
+
+void editorCursorsClear() {
+  free(E.cursors);
+  E.cursors = NULL;
+  E.ncursors = 0;
+}
+
+void editorCursorAdd(size_t cx, size_t cy) {
+  E.cursors = realloc(E.cursors, sizeof(struct editorCursor) * (E.ncursors + 1));
+  E.cursors[E.ncursors].cx = cx;
+  E.cursors[E.ncursors].cy = cy;
+  E.ncursors++;
+}
+
+// Puts the primary cursor in the sorted list for a batch; returns where
+size_t cursorsWithPrimary() {
+  size_t at = cursorLowerBound(E.cy, E.cx);
+  E.cursors = realloc(E.cursors, sizeof(struct editorCursor) * (E.ncursors + 1));
+  memmove(&E.cursors[at + 1], &E.cursors[at],
+          sizeof(struct editorCursor) * (E.ncursors - at));
+  E.cursors[at].cx = E.cx;
+  E.cursors[at].cy = E.cy;
+  E.ncursors++;
+  return at;
+}
+
+void cursorsTakePrimary(size_t at) {
+  E.cx = E.cursors[at].cx;
+  E.cy = E.cursors[at].cy;
+  memmove(&E.cursors[at], &E.cursors[at + 1],
+          sizeof(struct editorCursor) * (E.ncursors - at - 1));
+  E.ncursors--;
+  editorCursorsNormalize();
+}
+
+// Applies one edit at every cursor, rebuilding each row once
+void editorMultiEdit(int op, int c) {
+  size_t primary = cursorsWithPrimary();
+  if (op == MULTI_INSERT && E.cursors[E.ncursors - 1].cy == E.numrows)
+    editorInsertRow(E.numrows, "", 0);
+  size_t i = 0;
+  while (i < E.ncursors) {
+    size_t cy = E.cursors[i].cy, k = i;
+    while (k < E.ncursors && E.cursors[k].cy == cy) k++;
+    if (cy >= E.numrows) break;
+    erow *row = editorRow(cy);
+    char *chars = malloc(row->size + (k - i) + 1);
+    size_t from = 0, to = 0;
+    int changed = 0;
+    for (size_t m = i; m < k; m++) {
+      size_t at = E.cursors[m].cx < row->size ? E.cursors[m].cx : row->size;
+      size_t del_from = at, del_to = at;
+      if (at < from) at = del_from = del_to = from;
+      if (op == MULTI_BACKSPACE && at > from) {
+        del_from = utf8Prev(row->chars, at);
+        if (del_from < from) del_from = from;
+      } else if (op == MULTI_DELETE && at < row->size) {
+        size_t n;
+        utf8Cols(&row->chars[at], row->size - at, &n);
+        del_to = at + n;
+      }
+      memcpy(&chars[to], &row->chars[from], del_from - from);
+      to += del_from - from;
+      if (op == MULTI_INSERT) chars[to++] = c;
+      changed |= op == MULTI_INSERT || del_to > del_from;
+      E.cursors[m].cx = to;
+      from = del_to;
+    }
+    if (changed) {
+      memcpy(&chars[to], &row->chars[from], row->size - from);
+      to += row->size - from;
+      chars[to] = '\0';
+      editorUndoChange(cy);
+      free(row->chars);
+      row->chars = chars;
+      row->size = to;
+      editorUpdateRow(row);
+      E.dirty++;
+    } else {
+      free(chars);
+    }
+    i = k;
+  }
+  cursorsTakePrimary(primary);
+}
+
+// Splits the rows at every cursor, from the bottom up so that the rows a
+// split adds do not move the cursors still to be done
+void editorMultiNewline() {
+  size_t primary = cursorsWithPrimary();
+  for (size_t m = E.ncursors; m-- > 0;) {
+    E.cx = E.cursors[m].cx;
+    E.cy = E.cursors[m].cy;
+    if (E.cy < E.numrows && E.cx > E.row[E.cy].size) E.cx = E.row[E.cy].size;
+    editorInsertNewline();
+    // each cursor above this one adds a row before it
+    E.cursors[m].cx = E.cx;
+    E.cursors[m].cy = E.cy + m;
+  }
+  cursorsTakePrimary(primary);
+}
+
+void editorMultiMove(int key) {
+  size_t primary = cursorsWithPrimary();
+  for (size_t m = 0; m < E.ncursors; m++) {
+    E.cx = E.cursors[m].cx;
+    E.cy = E.cursors[m].cy;
+    if (key == HOME_KEY) E.cx = 0;
+    else if (key == END_KEY) E.cx = E.cy < E.numrows ? E.row[E.cy].size : 0;
+    else editorMoveCursor(key);
+    E.cursors[m].cx = E.cx;
+    E.cursors[m].cy = E.cy;
+  }
+  cursorsTakePrimary(primary);
+}
+
+// Handles c for all cursors; returns 0 for keys that only concern the
+// primary one
+int editorMultiKey(int c) {
+  switch (c) {
+    case '\r':
+      editorMultiNewline();
+      return 1;
+    case BACKSPACE:
+    case CTRL_KEY('h'):
+      editorMultiEdit(MULTI_BACKSPACE, 0);
+      return 1;
+    case DEL_KEY:
+      editorMultiEdit(MULTI_DELETE, 0);
+      return 1;
+    case HOME_KEY:
+    case END_KEY:
+    case ARROW_UP:
+    case ARROW_DOWN:
+    case ARROW_LEFT:
+    case ARROW_RIGHT:
+      editorMultiMove(c);
+      return 1;
+    case '\x1b':
+      editorCursorsClear();
+      editorSetStatusMessage("");
+      return 1;
+  }
+  if (c == '\t' || (!iscntrl(c) && c < 256)) {
+    editorMultiEdit(MULTI_INSERT, c);
+    return 1;
+  }
+  return 0;
+}
+
+// Ctrl-N: keeps a cursor here and moves down a line
+void editorCursorBelow() {
+  if (E.cy >= E.numrows) return;
+  editorCursorAdd(E.cx, E.cy);
+  editorMoveCursor(ARROW_DOWN);
+  editorCursorsNormalize();
+  editorSetStatusMessage("%zu cursors (Esc drops them)", E.ncursors + 1);
+}
+
+// Ctrl-E: a cursor at the start of every occurrence of a string
+void editorCursorsAtMatches() {
+  char *query = editorPrompt("Cursors at: %s (ESC to cancel)", NULL);
+  if (query == NULL) return;
+  size_t qlen = strlen(query);
+  editorCursorsClear();
+  int have_primary = 0;
+  for (size_t y = 0; y < E.numrows; y++) {
+    erow *row = editorRow(y);
+    char *p = row->chars, *end = row->chars + row->size;
+    while ((p = memmem(p, end - p, query, qlen))) {
+      if (!have_primary) {
+        E.cy = y;
+        E.cx = p - row->chars;
+        have_primary = 1;
+      } else {
+        editorCursorAdd(p - row->chars, y);
+      }
+      p += qlen;
+    }
+    if ((y & 1023) == 0) editorColdMaybeSweep();
+  }
+  free(query);
+  editorCursorsNormalize();
+  if (!have_primary)
+    editorSetStatusMessage("No matches");
+  else
+    editorSetStatusMessage("%zu cursors (Esc drops them)", E.ncursors + 1);
+}
+
+// Render offsets of the cursors on row filerow, ending with SIZE_MAX
+size_t *editorCursorMarks(size_t filerow) {
+  size_t j = cursorLowerBound(filerow, 0), k = j;
+  while (k < E.ncursors && E.cursors[k].cy == filerow) k++;
+  if (j == k) return NULL;
+  size_t *marks = malloc(sizeof(size_t) * (k - j + 1));
+  erow *row = editorRow(filerow);
+  for (size_t m = j; m < k; m++)
+    marks[m - j] = editorRowCxToRender(row, E.cursors[m].cx);
+  marks[k - j] = SIZE_MAX;
+  return marks;
+}
+
+/*** Line ranges ***/
+
+/*
+ * Ctrl-B marks the current line; the lines between it and the cursor, or
+ * just the cursor line when nothing is marked, then form the range that
+ * Ctrl-K deletes, Ctrl-D duplicates, Alt-Up and Alt-Down move and Tab and
+ * Shift-Tab indent and dedent. Each one goes through the row range
+ * primitives and is a single undo step.
+ */
+
+// The marked lines, or 0 when the cursor is past the end of the file
+size_t editorRangeGet(size_t *lo) {
+  if (E.mark != (size_t)-1 && E.mark >= E.numrows)
+    E.mark = E.numrows ? E.numrows - 1 : (size_t)-1;
+  if (E.mark == (size_t)-1) {
+    *lo = E.cy;
+    return E.cy < E.numrows;
+  }
+  size_t hi = E.cy < E.numrows ? E.cy : E.numrows - 1;
+  *lo = E.mark < hi ? E.mark : hi;
+  return (E.mark > hi ? E.mark : hi) - *lo + 1;
+}
+
+void editorToggleMark() {
+  if (E.mark != (size_t)-1) {
+    E.mark = (size_t)-1;
+  } else if (E.cy < E.numrows) {
+    E.mark = E.cy;
+    editorSetStatusMessage("Mark set: Ctrl-K delete | Ctrl-D duplicate | "
+      "Alt-Up/Down move | Tab/Shift-Tab indent");
+  }
+}
+
+void editorRangeDelete() {
+  size_t lo, n = editorRangeGet(&lo);
+  if (n == 0) return;
+  editorUndoBreak();
+  editorDelRows(lo, n);
+  E.cy = lo;
+  E.cx = 0;
+  E.mark = (size_t)-1;
+  editorUndoBreak();
+}
+
+void editorRangeDuplicate() {
+  size_t lo, n = editorRangeGet(&lo);
+  if (n == 0) return;
+  // copied out first, reading a cold row may page others out
+  size_t total = 0;
+  for (size_t j = lo; j < lo + n; j++) total += E.row[j].size;
+  char *buf = malloc(total + 1);
+  char **lines = malloc(sizeof(char *) * n);
+  size_t *lens = malloc(sizeof(size_t) * n);
+  char *p = buf;
+  for (size_t k = 0; k < n; k++) {
+    lines[k] = p;
+    lens[k] = E.row[lo + k].size;
+    editorRowCopyChars(&E.row[lo + k], p);
+    p += lens[k];
+  }
+  editorUndoBreak();
+  editorInsertRows(lo + n, lines, lens, n);
+  editorUndoBreak();
+  free(buf);
+  free(lines);
+  free(lens);
+  // the copy is what stays marked
+  E.cy += n;
+  if (E.mark != (size_t)-1) E.mark += n;
+}
+
+void editorRangeMove(int key) {
+  size_t lo, n = editorRangeGet(&lo);
+  if (n == 0) return;
+  editorUndoBreak();
+  if (key == ALT_ARROW_UP) {
+    if (lo == 0) return;
+    editorRotateRows(lo - 1, n + 1, 1);
+    E.cy--;
+    if (E.mark != (size_t)-1) E.mark--;
+  } else {
+    if (lo + n >= E.numrows) return;
+    editorRotateRows(lo, n + 1, n);
+    E.cy++;
+    if (E.mark != (size_t)-1) E.mark++;
+  }
+  editorUndoBreak();
+}
+
+// Adds a tab in front of every non empty line, or takes away one tab or
+// up to a tab stop of spaces
+void editorRangeIndent(int dedent) {
+  size_t lo, n = editorRangeGet(&lo);
+  if (n == 0) return;
+  editorUndoBreak();
+  for (size_t j = lo; j < lo + n; j++) {
+    erow *row = editorRow(j);
+    size_t cut = 0;
+    if (dedent) {
+      if (row->size && row->chars[0] == '\t') cut = 1;
+      else
+        while (cut < row->size && cut < CAX_TAB_STOP && row->chars[cut] == ' ')
+          cut++;
+      if (cut == 0) continue;
+      editorUndoChange(j);
+      memmove(row->chars, row->chars + cut, row->size - cut + 1);
+      row->size -= cut;
+      if (j == E.cy) E.cx = E.cx > cut ? E.cx - cut : 0;
+    } else {
+      if (row->size == 0) continue;
+      editorUndoChange(j);
+      row->chars = realloc(row->chars, row->size + 2);
+      memmove(row->chars + 1, row->chars, row->size + 1);
+      row->chars[0] = '\t';
+      row->size++;
+      if (j == E.cy) E.cx++;
+    }
+  }
+  editorUpdateRows(lo, n);
+  for (size_t j = lo; j < lo + n; j++)
+    editorRowsChanged(ROW_SET, j, 1, 0);
+  E.dirty++;
+  editorUndoBreak();
+}
+
+/*** Row index ***/
+
+/*
+ * Soft wrap, folding and bracket matching need sums over ranges of rows:
+ * the visual lines above a row, the rows shown above it, the row at a
+ * given visual or shown line, and where the bracket depth next drops to
+ * some level. The rows are grouped into chunks of about CAX_INDEX_CHUNK
+ * consecutive ones, each keeping its totals, and a segment tree adds the
+ * chunks up. A query walks down the tree in O(log n) and then scans at
+ * most one chunk. Inserting or deleting rows patches the totals of the
+ * chunks they fall in; only a chunk that grows past twice the size is
+ * split, and one that empties is dropped, and then just the tree over the
+ * chunks is built again. Loading a file or deleting rows in bulk resets
+ * the index, and it is built from the rows when next needed.
+ *
+ * The bracket depth a chunk reaches cannot be patched without scanning
+ * it, so a patched chunk sets it to CAX_BRACKET_LOW instead, as does a
+ * row that was never highlighted. The tree then only ever holds a bound
+ * that is too low, which sends a search into the chunk to scan its rows;
+ * the search sums the chunk exactly again on the way.
+ */
+
+void rowSpanAdd(struct rowSpan *a, struct rowSpan b) {
+  a->rows += b.rows;
+  a->lines += b.lines;
+  a->shown += b.shown;
+  a->brackets = bracketCombine(a->brackets, b.brackets);
+}
+
+// Adds the rows in b to a, or with sign -1 takes them away, when they
+// lie somewhere inside a rather than after it
+void rowSpanPatch(struct rowSpan *a, struct rowSpan b, int sign) {
+  a->rows += sign * b.rows;
+  a->lines += sign * b.lines;
+  a->shown += sign * b.shown;
+  a->brackets.net += sign * b.brackets.net;
+  a->brackets.min = CAX_BRACKET_LOW;
+}
+
+// Brackets of a row, which count for nothing until it is highlighted
+struct bracketNode rowBrackets(erow *row) {
+  struct bracketNode b = { row->bnet, row->bmin };
+  if (row->bmin > 0) {
+    b.net = 0;
+    b.min = CAX_BRACKET_LOW;
+  }
+  return b;
+}
+
+// Totals of rows at..at+n-1
+struct rowSpan rowSpanOf(size_t at, size_t n) {
+  struct rowSpan s = { n, 0, 0, { 0, 0 } };
+  for (size_t j = at; j < at + n; j++) {
+    s.lines += wrapCount(&E.row[j]);
+    s.shown += !E.row[j].hidden;
+    s.brackets = bracketCombine(s.brackets, rowBrackets(&E.row[j]));
+  }
+  return s;
+}
+
+void rowIndexReset() {
+  free(E.rows.chunk);
+  free(E.rows.tree);
+  memset(&E.rows, 0, sizeof(E.rows));
+}
+
+void rowIndexPull(size_t c) {
+  struct rowSpan *t = E.rows.tree;
+  size_t i = E.rows.size + c;
+  t[i] = E.rows.chunk[c];
+  for (i /= 2; i > 0; i /= 2) {
+    t[i] = t[2 * i];
+    rowSpanAdd(&t[i], t[2 * i + 1]);
+  }
+}
+
+// Builds the tree over the chunks, after chunks came or went
+void rowIndexTree() {
+  size_t size = 1;
+  while (size < E.rows.nchunks) size *= 2;
+  free(E.rows.tree);
+  E.rows.tree = calloc(2 * size, sizeof(struct rowSpan));
+  E.rows.size = size;
+  struct rowSpan *t = E.rows.tree;
+  memcpy(&t[size], E.rows.chunk, sizeof(struct rowSpan) * E.rows.nchunks);
+  for (size_t i = size - 1; i > 0; i--) {
+    t[i] = t[2 * i];
+    rowSpanAdd(&t[i], t[2 * i + 1]);
+  }
+}
+
+// Makes room for n chunks at c
+void rowIndexOpen(size_t c, size_t n) {
+  if (E.rows.nchunks + n > E.rows.cap) {
+    E.rows.cap = (E.rows.nchunks + n) * 2;
+    E.rows.chunk = realloc(E.rows.chunk, sizeof(struct rowSpan) * E.rows.cap);
+  }
+  memmove(&E.rows.chunk[c + n], &E.rows.chunk[c],
+          sizeof(struct rowSpan) * (E.rows.nchunks - c));
+  E.rows.nchunks += n;
+}
+
+// Chunks rows first..first+n-1 into chunks c and on, which must be free
+void rowIndexFill(size_t c, size_t first, size_t n) {
+  for (size_t k = 0; k < n; k += CAX_INDEX_CHUNK) {
+    size_t len = n - k < CAX_INDEX_CHUNK ? n - k : CAX_INDEX_CHUNK;
+    E.rows.chunk[c++] = rowSpanOf(first + k, len);
+  }
+}
+
+size_t rowIndexChunks(size_t n) {
+  return (n + CAX_INDEX_CHUNK - 1) / CAX_INDEX_CHUNK;
+}
+
+void rowIndexBuild() {
+  rowIndexReset();
+  rowIndexOpen(0, rowIndexChunks(E.numrows));
+  rowIndexFill(0, 0, E.numrows);
+  rowIndexTree();
+  E.rows.built = 1;
+}
+
+struct rowSpan rowIndexTotal() {
+  if (!E.rows.built) rowIndexBuild();
+  return E.rows.tree[1];
+}
+
+// Chunk holding row at, or the last chunk past the end; its first row
+// goes in first and the totals of the rows before it in before
+size_t rowIndexFind(size_t at, size_t *first, struct rowSpan *before) {
+  struct rowSpan *t = E.rows.tree;
+  struct rowSpan sum = { 0, 0, 0, { 0, 0 } };
+  size_t i = 1;
+  if (at >= t[1].rows) at = t[1].rows - 1;
+  while (i < E.rows.size) {
+    if (at < sum.rows + t[2 * i].rows) {
+      i = 2 * i;
+    } else {
+      rowSpanAdd(&sum, t[2 * i]);
+      i = 2 * i + 1;
+    }
+  }
+  *first = sum.rows;
+  if (before) *before = sum;
+  return i - E.rows.size;
+}
+
+// Whether the index is built and has rows to patch
+int rowIndexLive() {
+  return E.rows.built && E.rows.nchunks > 0;
+}
+
+// Rows at..at+n-1 were inserted; they are already in E.row
+void rowIndexInsert(size_t at, size_t n) {
+  if (!rowIndexLive()) {
+    E.rows.built = 0;
+    return;
+  }
+  size_t first;
+  size_t c = rowIndexFind(at, &first, NULL);
+  struct rowSpan *ch = &E.rows.chunk[c];
+  rowSpanPatch(ch, rowSpanOf(at, n), 1);
+  if (ch->rows <= 2 * CAX_INDEX_CHUNK) {
+    rowIndexPull(c);
+    return;
+  }
+  size_t rows = ch->rows, k = rowIndexChunks(rows);
+  rowIndexOpen(c + 1, k - 1);
+  rowIndexFill(c, first, rows);
+  rowIndexTree();
+}
+
+// Rows at..at+n-1 are about to be deleted
+void rowIndexDelete(size_t at, size_t n) {
+  if (!rowIndexLive()) return;
+  size_t first;
+  size_t c = rowIndexFind(at, &first, NULL), c0 = c, emptied = 0;
+  while (n > 0) {
+    struct rowSpan *ch = &E.rows.chunk[c];
+    size_t end = first + ch->rows;
+    size_t k = end - at < n ? end - at : n;
+    rowSpanPatch(ch, rowSpanOf(at, k), -1);
+    emptied += ch->rows == 0;
+    at += k;
+    n -= k;
+    first = end;
+    c++;
+  }
+  if (!emptied) {
+    for (size_t i = c0; i < c; i++) rowIndexPull(i);
+    return;
+  }
+  size_t kept = c0;
+  for (size_t i = c0; i < E.rows.nchunks; i++)
+    if (E.rows.chunk[i].rows) E.rows.chunk[kept++] = E.rows.chunk[i];
+  E.rows.nchunks = kept;
+  if (kept == 0) E.rows.built = 0;
+  else rowIndexTree();
+}
+
+// What rows at..at+n-1 count for changed: their chunks are summed again
+void rowIndexAdjust(size_t at, size_t n) {
+  if (!rowIndexLive() || n == 0) return;
+  size_t first;
+  size_t c = rowIndexFind(at, &first, NULL);
+  while (first < at + n && c < E.rows.nchunks) {
+    size_t rows = E.rows.chunk[c].rows;
+    E.rows.chunk[c] = rowSpanOf(first, rows);
+    rowIndexPull(c);
+    first += rows;
+    c++;
+  }
+}
+
+// Row at now counts lines visual lines instead of old
+void rowIndexSetLines(size_t at, size_t old, size_t lines) {
+  if (!rowIndexLive()) return;
+  size_t first;
+  size_t c = rowIndexFind(at, &first, NULL);
+  E.rows.chunk[c].lines += lines - old;
+  rowIndexPull(c);
+}
+
+// Row at now adds net more to the bracket depth, and may reach lower
+void rowIndexBrackets(size_t at, int32_t net) {
+  if (!rowIndexLive()) return;
+  size_t first;
+  size_t c = rowIndexFind(at, &first, NULL);
+  E.rows.chunk[c].brackets.net += net;
+  E.rows.chunk[c].brackets.min = CAX_BRACKET_LOW;
+  rowIndexPull(c);
+}
+
+// Sums chunk c, whose first row is first, exactly again
+void rowIndexSum(size_t c, size_t first) {
+  E.rows.chunk[c] = rowSpanOf(first, E.rows.chunk[c].rows);
+  rowIndexPull(c);
+}
+
+// Every layout went stale, so every shown row counts one visual line
+void rowIndexStaleLines() {
+  if (!E.rows.built) return;
+  for (size_t c = 0; c < E.rows.nchunks; c++)
+    E.rows.chunk[c].lines = E.rows.chunk[c].shown;
+  rowIndexTree();
+}
+
+// Totals of the rows before row at
+struct rowSpan rowIndexBefore(size_t at) {
+  struct rowSpan total = rowIndexTotal();
+  if (at >= total.rows) return total;
+  size_t first;
+  struct rowSpan sum;
+  rowIndexFind(at, &first, &sum);
+  rowSpanAdd(&sum, rowSpanOf(first, at - first));
+  return sum;
+}
+
+// Row where a running count of visual lines, or with shown set of shown
+// rows, passes v; *rest is how far into the row v is. Past the end it is
+// E.numrows and *rest what is left over.
+size_t rowIndexNth(size_t v, int shown, size_t *rest) {
+  struct rowSpan *t = E.rows.tree;
+  struct rowSpan total = rowIndexTotal();
+  if (v >= (shown ? total.shown : total.lines)) {
+    *rest = v - (shown ? total.shown : total.lines);
+    return E.numrows;
+  }
+  size_t i = 1, first = 0;
+  while (i < E.rows.size) {
+    size_t left = shown ? t[2 * i].shown : t[2 * i].lines;
+    if (v < left) {
+      i = 2 * i;
+    } else {
+      v -= left;
+      first += t[2 * i].rows;
+      i = 2 * i + 1;
+    }
+  }
+  size_t j;
+  for (j = first; j < E.numrows; j++) {
+    size_t w = shown ? !E.row[j].hidden : wrapCount(&E.row[j]);
+    if (v < w) break;
+    v -= w;
+  }
+  *rest = v;
+  return j;
+}
+
+/*** Brackets ***/
+
+/*
+ * Each row keeps the net bracket depth it adds and the lowest depth it
+ * reaches, counting (, [ and { up and ), ] and } down unless hl puts them
+ * in a string or comment. The row index sums these per chunk, so the next
+ * row before or after the cursor where the depth drops to some level is
+ * found in O(log n), counting from the cursor, and only rows of the chunk
+ * it lies in are scanned. A row patches its chunk whenever highlighting
+ * changes its brackets. A row that was never highlighted, say one read
+ * from the open cache, is highlighted when a jump reaches it; the match
+ * drawn for the bracket under the cursor is only looked for up to the
+ * first such row, so drawing never thaws rows to find it.
+ *
+ * Ctrl-] jumps to the bracket matching the one under the cursor, or to the
+ * end of the enclosing block, and Ctrl-\ to the start of the enclosing
+ * block. The bracket under the cursor and its match are drawn inverted.
+ */
+
+// 1 for an opening bracket at render offset j, -1 for a closing one
+int bracketAt(erow *row, size_t j) {
+  if (row->hl[j] == HL_STRING || row->hl[j] == HL_COMMENT ||
+      row->hl[j] == HL_MLCOMMENT)
+    return 0;
+  switch (row->render[j]) {
+    case '(': case '[': case '{': return 1;
+    case ')': case ']': case '}': return -1;
+  }
+  return 0;
+}
+
+struct bracketNode bracketCombine(struct bracketNode a, struct bracketNode b) {
+  struct bracketNode c;
+  c.net = a.net + b.net;
+  c.min = a.min < a.net + b.min ? a.min : a.net + b.min;
+  return c;
+}
+
+void bracketRowUpdate(erow *row) {
+  int32_t d = 0, min = 0;
+  for (size_t j = 0; j < row->rsize; j++) {
+    d += bracketAt(row, j);
+    if (d < min) min = d;
+  }
+  if (d == row->bnet && min == row->bmin) return;
+  int32_t old = rowBrackets(row).net;
+  row->bnet = d;
+  row->bmin = min;
+  // rows outside E.row, like the ones the benchmarks draw, have no chunk
+  if (row->idx < E.numrows && &E.row[row->idx] == row)
+    rowIndexBrackets(row->idx, d - old);
+}
+
+// A row reached by a search: highlighted first if it never was, unless
+// peek is set. Returns 0 if it was not.
+int bracketRowReady(size_t at, int peek, size_t *thawed) {
+  if (E.row[at].bmin <= 0) return 1;
+  if (peek) return 0;
+  editorRow(at);
+  if ((++*thawed & 1023) == 0) editorColdMaybeSweep();
+  return 1;
+}
+
+// First chunk from on, under node i which covers chunks lo..hi-1, that
+// may hold a row whose depth drops to t or below. *d is the depth where
+// the chunks still to search start and *first their first row.
+long bracketFirstChunk(size_t i, size_t lo, size_t hi, size_t from, long *d,
+                       size_t *first, long t) {
+  struct rowSpan *n = &E.rows.tree[i];
+  if (hi <= from) return -1;
+  if (lo >= from && *d + n->brackets.min > t) {
+    *d += n->brackets.net;
+    *first += n->rows;
+    return -1;
+  }
+  if (hi - lo == 1) return lo < E.rows.nchunks ? (long)lo : -1;
+  size_t mid = (lo + hi) / 2;
+  long q = bracketFirstChunk(2 * i, lo, mid, from, d, first, t);
+  if (q >= 0) return q;
+  return bracketFirstChunk(2 * i + 1, mid, hi, from, d, first, t);
+}
+
+// Last chunk before to that may hold a row whose depth drops to t or
+// below. *d is the depth where the chunks already passed start and *end
+// their first row.
+long bracketLastChunk(size_t i, size_t lo, size_t hi, size_t to, long *d,
+                      size_t *end, long t) {
+  struct rowSpan *n = &E.rows.tree[i];
+  if (lo >= to) return -1;
+  if (hi <= to && *d - n->brackets.net + n->brackets.min > t) {
+    *d -= n->brackets.net;
+    *end -= n->rows;
+    return -1;
+  }
+  if (hi - lo == 1) return lo;
+  size_t mid = (lo + hi) / 2;
+  long q = bracketLastChunk(2 * i + 1, mid, hi, to, d, end, t);
+  if (q >= 0) return q;
+  return bracketLastChunk(2 * i, lo, mid, to, d, end, t);
+}
+
+// First row q >= from whose depth drops to t or below, when row from
+// starts at depth d; *start is the depth q starts at. Returns -1 if there
+// is none, or with peek set if an unhighlighted row comes first.
+long bracketFirstRow(size_t from, long d, long t, int peek, long *start) {
+  if (from >= E.numrows) return -1;
+  rowIndexTotal();
+  size_t first, j = from, thawed = 0;
+  size_t c = rowIndexFind(from, &first, NULL);
+  for (;;) {
+    size_t begin = j, end = first + E.rows.chunk[c].rows;
+    for (; j < end; j++) {
+      if (!bracketRowReady(j, peek, &thawed)) return -1;
+      erow *row = &E.row[j];
+      if (row->bmin <= 0 && d + row->bmin <= t) {
+        *start = d;
+        return j;
+      }
+      if (row->bmin <= 0) d += row->bnet;
+    }
+    if (begin == first) rowIndexSum(c, first);
+    if (++c >= E.rows.nchunks) return -1;
+    first = end;
+    long q = bracketFirstChunk(1, 0, E.rows.size, c, &d, &first, t);
+    if (q < 0) return -1;
+    c = q;
+    j = first;
+  }
+}
+
+// Last row q < to whose depth drops to t or below, when row to starts at
+// depth d; *start is the depth q starts at
+long bracketLastRow(size_t to, long d, long t, int peek, long *start) {
+  if (to == 0) return -1;
+  rowIndexTotal();
+  size_t first, j = to, thawed = 0;
+  size_t c = rowIndexFind(to - 1, &first, NULL);
+  for (;;) {
+    size_t end = first + E.rows.chunk[c].rows, begin = j;
+    for (; j > first; j--) {
+      if (!bracketRowReady(j - 1, peek, &thawed)) return -1;
+      erow *row = &E.row[j - 1];
+      if (row->bmin > 0) continue;
+      d -= row->bnet;
+      if (d + row->bmin <= t) {
+        *start = d;
+        return j - 1;
+      }
+    }
+    if (begin == end) rowIndexSum(c, first);
+    if (c == 0) return -1;
+    long q = bracketLastChunk(1, 0, E.rows.size, c, &d, &first, t);
+    if (q < 0) return -1;
+    c = q;
+    j = first;
+    first -= E.rows.chunk[c].rows;
+  }
+}
+
+// The first closing bracket at or after render offset k of row at that
+// takes the depth, counted from the start of the row, down to t. Returns
+// 0 if there is none.
+int bracketForward(size_t at, size_t k, long t, int peek, size_t *row_out,
+                   size_t *off_out) {
+  erow *row = editorRow(at);
+  long d = 0;
+  for (size_t j = 0; j < row->rsize; j++) {
+    int b = bracketAt(row, j);
+    d += b;
+    if (j >= k && b < 0 && d <= t) {
+      *row_out = at;
+      *off_out = j;
+      return 1;
+    }
+  }
+  long q = bracketFirstRow(at + 1, d, t, peek, &d);
+  if (q < 0) return 0;
+  row = editorRow(q);
+  for (size_t j = 0; j < row->rsize; j++) {
+    d += bracketAt(row, j);
+    if (d <= t) {
+      *row_out = q;
+      *off_out = j;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// The last opening bracket before render offset k of row at that starts
+// at depth t or below
+int bracketBackward(size_t at, size_t k, long t, int peek, size_t *row_out,
+                    size_t *off_out) {
+  erow *row = editorRow(at);
+  long d = 0;
+  for (size_t j = 0; j < k && j < row->rsize; j++) d += bracketAt(row, j);
+  for (size_t j = k < row->rsize ? k : row->rsize; j-- > 0;) {
+    d -= bracketAt(row, j);
+    if (d <= t && bracketAt(row, j) > 0) {
+      *row_out = at;
+      *off_out = j;
+      return 1;
+    }
+  }
+  long q = bracketLastRow(at, 0, t, peek, &d);
+  if (q < 0) return 0;
+  row = editorRow(q);
+  d += row->bnet;
+  for (size_t j = row->rsize; j-- > 0;) {
+    d -= bracketAt(row, j);
+    if (d <= t) {
+      *row_out = q;
+      *off_out = j;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Render offset of the cursor, and whether a bracket is there
+int bracketAtCursor(size_t *k) {
+  if (E.cy >= E.numrows) return 0;
+  erow *row = editorRow(E.cy);
+  *k = editorRowCxToRender(row, E.cx);
+  return *k < row->rsize ? bracketAt(row, *k) : 0;
+}
+
+// Depth before render offset k of the cursor row, from its start
+long bracketCursorDepth(size_t k) {
+  erow *row = &E.row[E.cy];
+  long d = 0;
+  for (size_t j = 0; j < k && j < row->rsize; j++) d += bracketAt(row, j);
+  return d;
+}
+
+// The bracket matching the one at render offset k of the cursor row
+int bracketMatch(size_t k, int b, int peek, size_t *row_out,
+                 size_t *off_out) {
+  long d = bracketCursorDepth(k);
+  if (b > 0) return bracketForward(E.cy, k + 1, d, peek, row_out, off_out);
+  return bracketBackward(E.cy, k, d - 1, peek, row_out, off_out);
+}
+
+void editorBracketGoto(size_t at, size_t off) {
+  E.cy = at;
+  E.cx = editorRowRenderToCx(editorRow(at), off);
+}
+
+// Jumps to the bracket matching the one under the cursor, or else to the
+// end of the enclosing block
+void editorJumpMatch() {
+  size_t k, at, off;
+  if (E.cy >= E.numrows) return;
+  int b = bracketAtCursor(&k);
+  int found;
+  if (b)
+    found = bracketMatch(k, b, 0, &at, &off);
+  else
+    found = bracketForward(E.cy, k, bracketCursorDepth(k) - 1, 0, &at, &off);
+  if (found) editorBracketGoto(at, off);
+  else editorSetStatusMessage(b ? "No matching bracket" : "Not in a block");
+}
+
+void editorJumpBlockStart() {
+  size_t k, at, off;
+  if (E.cy >= E.numrows) return;
+  bracketAtCursor(&k);
+  long t = bracketCursorDepth(k) - 1;
+  if (bracketBackward(E.cy, k, t, 0, &at, &off)) editorBracketGoto(at, off);
+  else editorSetStatusMessage("Not in a block");
+}
+
+// The bracket pair drawn inverted, found once per frame. Only a bracket
+// under the cursor sends it to the row index.
+struct bracketPair {
+  int active;
+  size_t row[2];
+  size_t off[2];
+} BP;
+
+void bracketFindPair() {
+  size_t k;
+  BP.active = 0;
+  if (E.headless) return;
+  int b = bracketAtCursor(&k);
+  if (b && bracketMatch(k, b, 1, &BP.row[1], &BP.off[1])) {
+    BP.row[0] = E.cy;
+    BP.off[0] = k;
+    BP.active = 1;
+  }
+}
+
+// Render offsets to draw inverted on row filerow, ending with SIZE_MAX:
+// extra cursors and the bracket pair
+size_t *editorRowMarks(size_t filerow) {
+  size_t *marks = E.ncursors ? editorCursorMarks(filerow) : NULL;
+  if (!BP.active) return marks;
+  size_t n = 0;
+  while (marks && marks[n] != SIZE_MAX) n++;
+  for (int p = 0; p < 2; p++) {
+    if (BP.row[p] != filerow) continue;
+    marks = realloc(marks, sizeof(size_t) * (n + 2));
+    size_t i = n++;
+    while (i > 0 && marks[i - 1] > BP.off[p]) {
+      marks[i] = marks[i - 1];
+      i--;
+    }
+    marks[i] = BP.off[p];
+    marks[n] = SIZE_MAX;
+  }
+  return marks;
+}
+
+/*** Folds ***/
+
+/*
+ * Ctrl-Y folds the block that starts on the cursor row, or the marked
+ * lines, behind their first row, and on such a row unfolds it again.
+ * Ctrl-U folds every outermost block, or unfolds everything. A block runs
+ * until the brackets left open by its first row close, the closing row
+ * staying in view, or for a row without any until the indentation comes
+ * back to its level. Folded rows are flagged hidden and the row index,
+ * which counts the rows that are not, maps rows to screen lines and back
+ * in O(log n), so drawing, scrolling, paging and search step over a fold
+ * of any size at once. Hidden rows are never drawn, so the cold rows
+ * among them stay cold and the hot ones are cooled first.
+ */
+
+// Screen lines above row at when the file is drawn from the top; past the
+// end every row counts
+size_t foldVisibleBefore(size_t at) {
+  if (!E.hidden) return at;
+  size_t sum = at > E.numrows ? at - E.numrows : 0;
+  return sum + rowIndexBefore(at < E.numrows ? at : E.numrows).shown;
+}
+
+// Row on screen line v when the file is drawn from the top
+size_t foldNth(size_t v) {
+  if (!E.hidden) return v;
+  size_t rest;
+  size_t at = rowIndexNth(v, 1, &rest);
+  return at + rest;
+}
+
+// The row drawn after row at
+size_t foldNext(size_t at) {
+  if (!E.hidden || at + 1 >= E.numrows || !E.row[at + 1].hidden)
+    return at + 1;
+  return foldNth(foldVisibleBefore(at + 1));
+}
+
+// The row drawn before row at, or at itself if none is
+size_t foldPrev(size_t at) {
+  if (at == 0) return 0;
+  if (!E.hidden || at > E.numrows || !E.row[at - 1].hidden) return at - 1;
+  size_t v = foldVisibleBefore(at);
+  return v ? foldNth(v - 1) : at;
+}
+
+// Hides or shows rows at..at+n-1
+void foldSetRows(size_t at, size_t n, int hidden) {
+  for (size_t j = at; j < at + n && j < E.numrows; j++) {
+    if (E.row[j].hidden == hidden) continue;
+    E.row[j].hidden = hidden;
+    if (hidden) E.hidden++;
+    else E.hidden--;
+  }
+  rowIndexAdjust(at, n);
+}
+
+// Shows the whole fold that hides row at
+void foldReveal(size_t at) {
+  size_t lo = at, hi = at + 1;
+  while (lo > 0 && E.row[lo - 1].hidden) lo--;
+  while (hi < E.numrows && E.row[hi].hidden) hi++;
+  foldSetRows(lo, hi - lo, 0);
+}
+
+// Deleted hidden rows no longer count
+void foldRowsChanged(int op, size_t at, size_t count) {
+  if (!E.hidden || op != ROW_DELETE) return;
+  for (size_t j = at; j < at + count && j < E.numrows; j++)
+    if (E.row[j].hidden) E.hidden--;
+}
+
+// Rows hidden behind row at, which is the first row of a fold if any are
+size_t foldHiddenAfter(size_t at) {
+  if (!E.hidden || at + 1 >= E.numrows || !E.row[at + 1].hidden) return 0;
+  return foldNext(at) - at - 1;
+}
+
+// Columns of leading blanks, or -1 for a blank row
+size_t foldIndent(size_t at) {
+  const char *s = editorRowPeek(&E.row[at]);
+  size_t col = 0;
+  for (size_t j = 0; j < E.row[at].size; j++) {
+    if (s[j] == '\t') col += CAX_TAB_STOP - col % CAX_TAB_STOP;
+    else if (s[j] == ' ') col++;
+    else return col;
+  }
+  return (size_t)-1;
+}
+
+// Last row to hide for the block starting on row at, or at if there is
+// no block
+size_t foldBlockEnd(size_t at) {
+  erow *row = &E.row[at];
+  if (row->bmin > 0) editorRow(at);
+  if (row->bnet > row->bmin) {
+    // the row ends inside a bracket it opened: up to where that closes
+    long start;
+    long q = bracketFirstRow(at + 1, row->bnet, row->bnet - 1, 0, &start);
+    if (q < 0) return E.numrows - 1;
+    return (size_t)q - 1;
+  }
+  size_t indent = foldIndent(at), end = at;
+  if (indent == (size_t)-1) return at;
+  for (size_t j = at + 1; j < E.numrows; j++) {
+    size_t i = foldIndent(j);
+    if (i == (size_t)-1) continue;
+    if (i <= indent) break;
+    end = j;
+  }
+  return end;
+}
+
+// Puts the cursor on the first row of the fold it was hidden in
+void foldCursorOut() {
+  if (E.cy < E.numrows && E.row[E.cy].hidden) {
+    E.cy = foldPrev(E.cy);
+    E.cx = 0;
+  }
+}
+
+// Ctrl-Y
+void editorToggleFold() {
+  if (E.cy >= E.numrows) return;
+  size_t n = foldHiddenAfter(E.cy);
+  if (n) {
+    foldSetRows(E.cy + 1, n, 0);
+    editorSetStatusMessage("Unfolded %zu lines", n);
+    return;
+  }
+  size_t at, end;
+  if (E.mark != (size_t)-1) {
+    end = editorRangeGet(&at) - 1 + at;
+    E.mark = (size_t)-1;
+  } else {
+    at = E.cy;
+    end = foldBlockEnd(at);
+  }
+  if (end <= at) {
+    editorSetStatusMessage("Nothing to fold");
+    return;
+  }
+  foldSetRows(at + 1, end - at, 1);
+  foldCursorOut();
+  editorSetStatusMessage("Folded %zu lines", foldHiddenAfter(at));
+}
+
+// Ctrl-U
+void editorToggleFoldAll() {
+  if (E.hidden) {
+    foldSetRows(0, E.numrows, 0);
+    editorSetStatusMessage("Unfolded everything");
+    return;
+  }
+  size_t folds = 0;
+  for (size_t j = 0; j < E.numrows; j++) {
+    size_t end = foldBlockEnd(j);
+    if (end <= j) continue;
+    foldSetRows(j + 1, end - j, 1);
+    folds++;
+    j = end;
+  }
+  foldCursorOut();
+  editorSetStatusMessage("Folded %zu blocks, %zu lines", folds, E.hidden);
+}
+
+/*** Diff ***/
+
+/*
+ * Ctrl-T shows how the buffer differs from the file on disk, in a gutter
+ * left of the text: '+' for added rows, '~' for changed ones and '-' on a
+ * row that follows deleted lines. Each row keeps its mark and, unless it
+ * was added, the file line it matches or replaces. The file's line index
+ * is only built the first time the gutter is shown for a buffer. Edits
+ * only make a range of rows dirty; before a frame is drawn that range is
+ * widened to the nearest unchanged rows on either side and diffed again
+ * against the file lines between theirs. Lines are hashed once, rows when
+ * they change and file lines when a diff first reaches them. A gap is
+ * split at the lines found exactly once on each side (patience diff), and
+ * what is left goes to Myers' algorithm, which gives up after
+ * CAX_DIFF_MAX_EDITS edits or CAX_DIFF_MAX_COST steps and leaves the gap
+ * to count as changed.
+ */
+
+struct editorDiff {
+  int on;                     // gutter shown
+  int based;                  // off and hash are built, marks kept up to date
+  struct diffRow *rows;       // one per row of the buffer
+  size_t rowcap;
+  off_t *off;                 // where each file line starts, then the end
+  uint64_t *hash;             // file line hashes, 0 until needed
+  size_t nlines;
+  int dirty;                  // rows lo..hi-1 need to be diffed again
+  size_t lo, hi;
+  uint32_t deleted_end;       // file lines deleted after the last row
+  size_t added, changed, deleted;
+  char *buf;                  // file lines being hashed
+  size_t cap;
+};
+
+struct editorDiff D;
+
+// Adds or, with sign -1, takes away what rows at..at+n-1 count for
+void diffTally(size_t at, size_t n, int sign) {
+  size_t added = 0, changed = 0, deleted = 0;
+  for (size_t j = at; j < at + n && j < E.numrows; j++) {
+    added += D.rows[j].mark == DIFF_ADDED;
+    changed += D.rows[j].mark == DIFF_CHANGED;
+    deleted += D.rows[j].del;
+  }
+  if (at + n > E.numrows) deleted += D.deleted_end;
+  if (sign > 0) {
+    D.added += added;
+    D.changed += changed;
+    D.deleted += deleted;
+  } else {
+    D.added -= added;
+    D.changed -= changed;
+    D.deleted -= deleted;
+  }
+}
+
+void diffMarkDirty(size_t lo, size_t hi) {
+  if (!D.dirty || lo < D.lo) D.lo = lo;
+  if (!D.dirty || hi > D.hi) D.hi = hi;
+  D.dirty = 1;
+}
+
+// Moves the rows' diff state along with them, keeps the dirty range on the
+// same rows, and takes rows that are about to be deleted out of the totals
+void diffRowsChanged(int op, size_t at, size_t count, size_t shift) {
+  if (!D.based) return;
+  if (op == ROW_SET) {
+    D.rows[at].hash = 0;
+  } else if (op == ROW_INSERT) {
+    if (E.numrows > D.rowcap) {
+      D.rowcap = E.numrows * 2;
+      D.rows = realloc(D.rows, sizeof(struct diffRow) * D.rowcap);
+    }
+    memmove(&D.rows[at + count], &D.rows[at],
+            sizeof(struct diffRow) * (E.numrows - count - at));
+    for (size_t j = at; j < at + count; j++) {
+      D.rows[j].hash = 0;
+      D.rows[j].line = 0;
+      D.rows[j].del = 0;
+      D.rows[j].mark = DIFF_SAME;
+    }
+    if (D.dirty && D.lo >= at) D.lo += count;
+    if (D.dirty && D.hi > at) D.hi += count;
+  } else if (op == ROW_DELETE) {
+    diffTally(at, count, -1);
+    memmove(&D.rows[at], &D.rows[at + count],
+            sizeof(struct diffRow) * (E.numrows - at - count));
+    if (D.dirty && D.lo > at) D.lo = D.lo >= at + count ? D.lo - count : at;
+    if (D.dirty && D.hi > at) D.hi = D.hi >= at + count ? D.hi - count : at;
+    // what was deleted above the next row has changed
+    count = 1;
+  } else if (op == ROW_ROTATE) {
+    struct diffRow *tmp = malloc(sizeof(struct diffRow) * shift);
+    memcpy(tmp, &D.rows[at], sizeof(struct diffRow) * shift);
+    memmove(&D.rows[at], &D.rows[at + shift],
+            sizeof(struct diffRow) * (count - shift));
+    memcpy(&D.rows[at + count - shift], tmp, sizeof(struct diffRow) * shift);
+    free(tmp);
+  }
+  diffMarkDirty(at, at + count);
+}
+
+// Forgets the file the buffer was diffed against, after it was loaded or
+// saved; diffBase reads it again when the gutter next needs it
+void diffRebase() {
+  free(D.rows);
+  free(D.off);
+  free(D.hash);
+  D.rows = NULL;
+  D.rowcap = 0;
+  D.off = NULL;
+  D.hash = NULL;
+  D.nlines = 0;
+  D.based = 0;
+  D.dirty = 0;
+}
+
+// Indexes the lines of the file on disk. Rows still at the place they were
+// read from start out unchanged; otherwise every row is diffed once.
+// Without a file every row counts as added.
+void diffBase() {
+  struct stat st;
+  size_t n = 0, cap = 0;
+  off_t *off = NULL;
+  if (E.srcfd != -1 && fstat(E.srcfd, &st) == 0 && st.st_size > 0) {
+    char buf[65536];
+    off_t pos = 0, start = 0;
+    while (pos < st.st_size) {
+      ssize_t r = pread(E.srcfd, buf, sizeof(buf), pos);
+      if (r == -1 && errno == EINTR) continue;
+      if (r <= 0) break;
+      for (char *p = buf, *end = buf + r; p < end;) {
+        char *nl = memchr(p, '\n', end - p);
+        if (!nl) break;
+        if (n == cap) {
+          cap = cap ? cap * 2 : 1024;
+          off = realloc(off, sizeof(off_t) * (cap + 1));
+        }
+        off[n++] = start;
+        start = pos + (nl - buf) + 1;
+        p = nl + 1;
+      }
+      pos += r;
+    }
+    if (start < pos) {
+      if (n == cap) off = realloc(off, sizeof(off_t) * (n + 2));
+      off[n++] = start;
+    }
+  }
+  D.off = realloc(off, sizeof(off_t) * (n + 1));
+  D.off[n] = n ? st.st_size : 0;
+  D.hash = calloc(n + 1, sizeof(uint64_t));
+  D.nlines = n;
+  D.rowcap = E.numrows ? E.numrows : 1;
+  D.rows = malloc(sizeof(struct diffRow) * D.rowcap);
+  int same = n == E.numrows;
+  for (size_t j = 0; j < E.numrows; j++) {
+    if (same && E.row[j].foff != D.off[j]) same = 0;
+    D.rows[j].hash = 0;
+    D.rows[j].line = j;
+    D.rows[j].del = 0;
+    D.rows[j].mark = DIFF_SAME;
+  }
+  D.deleted_end = 0;
+  D.added = D.changed = D.deleted = 0;
+  D.dirty = 0;
+  D.based = 1;
+  if (!same && E.numrows) diffMarkDirty(0, E.numrows);
+}
+
+uint64_t diffRowHash(size_t at) {
+  struct diffRow *d = &D.rows[at];
+  if (!d->hash) {
+    d->hash = fnv1a(FNV1A_INIT, editorRowPeek(&E.row[at]), E.row[at].size);
+    if (!d->hash) d->hash = 1;
+  }
+  return d->hash;
+}
+
+// Hashes the file lines lo..hi-1 that are not hashed yet, reading them a
+// megabyte at a time. A file cut short under us reads as empty lines.
+void diffHashLines(size_t lo, size_t hi) {
+  while (lo < hi) {
+    if (D.hash[lo]) {
+      lo++;
+      continue;
+    }
+    size_t end = lo + 1;
+    while (end < hi && !D.hash[end] && D.off[end + 1] - D.off[lo] <= 1 << 20)
+      end++;
+    size_t len = D.off[end] - D.off[lo], got = 0;
+    if (len > D.cap) {
+      D.cap = len;
+      D.buf = realloc(D.buf, D.cap);
+    }
+    while (got < len) {
+      ssize_t r = pread(E.srcfd, D.buf + got, len - got, D.off[lo] + got);
+      if (r == -1 && errno == EINTR) continue;
+      if (r <= 0) break;
+      got += r;
+    }
+    memset(D.buf + got, '\n', len - got);
+    for (size_t i = lo; i < end; i++) {
+      char *s = D.buf + (D.off[i] - D.off[lo]);
+      size_t n = D.off[i + 1] - D.off[i];
+      while (n > 0 && (s[n - 1] == '\n' || s[n - 1] == '\r')) n--;
+      D.hash[i] = fnv1a(FNV1A_INIT, s, n);
+      if (!D.hash[i]) D.hash[i] = 1;
+    }
+    lo = end;
+  }
+}
+
+// Myers' greedy algorithm on a[a0..a1) against b[b0..b1), keeping every
+// round's furthest reaching points to walk the edit script back. Matched
+// lines go into match; giving up leaves the whole gap unmatched.
+void diffMyers(uint64_t *a, uint64_t *b, size_t *match,
+               size_t a0, size_t a1, size_t b0, size_t b1) {
+  ptrdiff_t n = a1 - a0, m = b1 - b0, maxd = n + m;
+  if (maxd > CAX_DIFF_MAX_EDITS) maxd = CAX_DIFF_MAX_EDITS;
+  if (maxd > (ptrdiff_t)(CAX_DIFF_MAX_COST / (n + m)))
+    maxd = CAX_DIFF_MAX_COST / (n + m);
+  ptrdiff_t *vbuf = malloc(sizeof(ptrdiff_t) * (2 * maxd + 3));
+  ptrdiff_t *v = vbuf + maxd + 1;
+  // round d keeps v[-d..d], starting at trace[d * d]
+  ptrdiff_t *trace = malloc(sizeof(ptrdiff_t) * (maxd + 1) * (maxd + 1));
+  ptrdiff_t d, k, x, y, found = -1;
+  v[1] = 0;
+  for (d = 0; d <= maxd && found < 0; d++) {
+    for (k = -d; k <= d; k += 2) {
+      x = (k == -d || (k != d && v[k - 1] < v[k + 1])) ? v[k + 1]
+                                                       : v[k - 1] + 1;
+      y = x - k;
+      while (x < n && y < m && a[a0 + x] == b[b0 + y]) {
+        x++;
+        y++;
+      }
+      v[k] = x;
+      if (x >= n && y >= m) found = d;
+    }
+    memcpy(&trace[d * d], &v[-d], sizeof(ptrdiff_t) * (2 * d + 1));
+  }
+  if (found >= 0) {
+    x = n;
+    y = m;
+    for (d = found; d > 0; d--) {
+      ptrdiff_t *p = &trace[(d - 1) * (d - 1)] + (d - 1);
+      k = x - y;
+      ptrdiff_t pk = (k == -d || (k != d && p[k - 1] < p[k + 1])) ? k + 1
+                                                                 : k - 1;
+      ptrdiff_t px = p[pk], sx = pk == k + 1 ? px : px + 1;
+      while (x > sx) {
+        x--;
+        y--;
+        match[a0 + x] = b0 + y;
+      }
+      x = px;
+      y = px - pk;
+    }
+    while (x > 0) {
+      x--;
+      y--;
+      match[a0 + x] = b0 + y;
+    }
+  }
+  free(vbuf);
+  free(trace);
+}
+
+struct diffSlot {
+  uint64_t hash;
+  size_t na, nb;              // times seen on each side
+  size_t ia, ib;              // where, the last time
+};
+
+void diffGap(uint64_t *a, uint64_t *b, size_t *match,
+             size_t a0, size_t a1, size_t b0, size_t b1, int depth);
+
+// Matches the lines found once on each side, as many of them as keep
+// their order, and diffs the gaps between them. Returns 0 if there are
+// none, leaving the gap to Myers.
+int diffPatience(uint64_t *a, uint64_t *b, size_t *match,
+                 size_t a0, size_t a1, size_t b0, size_t b1, int depth) {
+  size_t cap = 16;
+  while (cap < 2 * (a1 - a0 + b1 - b0)) cap <<= 1;
+  struct diffSlot *slots = calloc(cap, sizeof(struct diffSlot));
+  for (size_t side = 0; side < 2; side++) {
+    uint64_t *h = side ? b : a;
+    for (size_t i = side ? b0 : a0; i < (side ? b1 : a1); i++) {
+      size_t s = h[i] & (cap - 1);
+      while (slots[s].hash && slots[s].hash != h[i]) s = (s + 1) & (cap - 1);
+      slots[s].hash = h[i];
+      if (side) {
+        slots[s].nb++;
+        slots[s].ib = i;
+      } else {
+        slots[s].na++;
+        slots[s].ia = i;
+      }
+    }
+  }
+  // longest increasing run of b positions, in a order, by patience sorting
+  size_t *pa = malloc(sizeof(size_t) * (a1 - a0));
+  size_t *pb = malloc(sizeof(size_t) * (a1 - a0));
+  size_t *prev = malloc(sizeof(size_t) * (a1 - a0));
+  size_t *tails = malloc(sizeof(size_t) * (a1 - a0));
+  size_t np = 0, ntails = 0;
+  for (size_t i = a0; i < a1; i++) {
+    size_t s = a[i] & (cap - 1);
+    while (slots[s].hash != a[i]) s = (s + 1) & (cap - 1);
+    if (slots[s].na != 1 || slots[s].nb != 1) continue;
+    pa[np] = i;
+    pb[np] = slots[s].ib;
+    size_t lo = 0, hi = ntails;
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      if (pb[tails[mid]] < pb[np]) lo = mid + 1;
+      else hi = mid;
+    }
+    prev[np] = lo ? tails[lo - 1] : SIZE_MAX;
+    tails[lo] = np++;
+    if (lo == ntails) ntails++;
+  }
+  free(slots);
+  // follow the run back, then diff between its lines front to back
+  size_t *run = malloc(sizeof(size_t) * (ntails + 1));
+  size_t p = ntails ? tails[ntails - 1] : SIZE_MAX;
+  for (size_t i = ntails; i > 0; i--) {
+    run[i - 1] = p;
+    p = prev[p];
+  }
+  size_t ia = a0, ib = b0;
+  for (size_t i = 0; i < ntails; i++) {
+    diffGap(a, b, match, ia, pa[run[i]], ib, pb[run[i]], depth + 1);
+    match[pa[run[i]]] = pb[run[i]];
+    ia = pa[run[i]] + 1;
+    ib = pb[run[i]] + 1;
+  }
+  if (ntails) diffGap(a, b, match, ia, a1, ib, b1, depth + 1);
+  free(run);
+  free(pa);
+  free(pb);
+  free(prev);
+  free(tails);
+  return ntails > 0;
+}
+
+// Matches what it can of rows a[a0..a1) to file lines b[b0..b1)
+void diffGap(uint64_t *a, uint64_t *b, size_t *match,
+             size_t a0, size_t a1, size_t b0, size_t b1, int depth) {
+  while (a0 < a1 && b0 < b1 && a[a0] == b[b0]) match[a0++] = b0++;
+  while (a0 < a1 && b0 < b1 && a[a1 - 1] == b[b1 - 1]) match[--a1] = --b1;
+  if (a0 == a1 || b0 == b1) return;
+  if (depth < 16 && diffPatience(a, b, match, a0, a1, b0, b1, depth)) return;
+  diffMyers(a, b, match, a0, a1, b0, b1);
+}
+
+// Diffs the dirty rows again, together with the rows around them up to
+// an unchanged one on either side. Changed rows stop the search too once
+// it has gone CAX_DIFF_MAX_EDITS rows, so that a file where every line
+// changed does not get diffed whole on every key.
+void diffUpdate() {
+  if (!D.on) return;
+  if (!D.based) diffBase();
+  if (!D.dirty) return;
+  D.dirty = 0;
+  size_t lo = D.lo < E.numrows ? D.lo : E.numrows;
+  size_t hi = D.hi < E.numrows ? D.hi : E.numrows;
+  size_t reach = CAX_DIFF_MAX_EDITS;
+  while (lo > 0 && D.rows[lo - 1].mark != DIFF_SAME &&
+         (D.rows[lo - 1].mark == DIFF_ADDED || reach)) {
+    lo--;
+    if (reach) reach--;
+  }
+  reach = CAX_DIFF_MAX_EDITS;
+  while (hi < E.numrows && D.rows[hi].mark != DIFF_SAME &&
+         (D.rows[hi].mark == DIFF_ADDED || reach)) {
+    hi++;
+    if (reach) reach--;
+  }
+  size_t flo = lo > 0 ? D.rows[lo - 1].line + 1 : 0;
+  size_t fhi = hi < E.numrows ? D.rows[hi].line : D.nlines;
+  if (flo > fhi) {
+    lo = flo = 0;
+    hi = E.numrows;
+    fhi = D.nlines;
+  }
+
+  size_t n = hi - lo;
+  uint64_t *a = malloc(sizeof(uint64_t) * (n + 1));
+  size_t *match = malloc(sizeof(size_t) * (n + 1));
+  for (size_t j = 0; j < n; j++) {
+    a[j] = diffRowHash(lo + j);
+    match[j] = SIZE_MAX;
+  }
+  diffHashLines(flo, fhi);
+  diffGap(a, D.hash + flo, match, 0, n, 0, fhi - flo, 0);
+
+  // rows between two matched ones change the file lines between them,
+  // and the rest of those lines were deleted
+  diffTally(lo, hi - lo + 1, -1);
+  size_t start = lo, f = flo;
+  for (size_t j = lo; j <= hi; j++) {
+    if (j < hi && match[j - lo] == SIZE_MAX) continue;
+    size_t line = j < hi ? flo + match[j - lo] : fhi;
+    size_t added = j - start, gone = line - f;
+    for (size_t i = start; i < j; i++) {
+      D.rows[i].mark = i - start < gone ? DIFF_CHANGED : DIFF_ADDED;
+      D.rows[i].line = f + (i - start);
+      D.rows[i].del = 0;
+    }
+    uint32_t del = gone > added ? gone - added : 0;
+    if (j < E.numrows) D.rows[j].del = del;
+    else D.deleted_end = del;
+    if (j < hi) {
+      D.rows[j].mark = DIFF_SAME;
+      D.rows[j].line = line;
+    }
+    start = j + 1;
+    f = line + 1;
+  }
+  diffTally(lo, hi - lo + 1, 1);
+  free(a);
+  free(match);
+}
+
+void editorToggleDiff() {
+  D.on = !D.on;
+  E.gutter = D.on ? 2 : 0;
+  E.screenCols += D.on ? -2 : 2;
+  if (E.wrap) editorWrapInvalidate();
+  editorSetStatusMessage("Diff gutter %s", D.on ? "on" : "off");
+}
+
+/*** File I/O ***/
+
+char *editorRowsToString(size_t *buflen){
+  size_t totlen = 0;
+  size_t j;
+  for (j = 0; j < E.numrows; j++) {
+    if (E.row[j].size >= SIZE_MAX - totlen) die("buffer too large");
+    totlen += E.row[j].size + 1;
+  }
+  
+  *buflen = totlen;
+  char *buf = malloc(totlen);
+  char *p = buf;
+  for (j = 0; j < E.numrows; j++) {
+    editorRowCopyChars(&E.row[j], p);
+    p += E.row[j].size;
+    *p = '\n';
+    p++;
+  }
+
+  return buf;
+}
+
+// A single write() moves at most about 2GB, so keep going until done
+int writeAll(int fd, const char *buf, size_t len) {
+  while (len) {
+    ssize_t n = write(fd, buf, len);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Writes all rows to fd through a fixed size buffer, so saving does not
+// need the whole file in memory. Rows become pristine copies of what was
+// just written. Returns the number of bytes written, or -1.
+off_t editorWriteRows(int fd) {
+  size_t cap = 1 << 20, used = 0;
+  char *buf = malloc(cap);
+  off_t total = 0;
+  for (size_t j = 0; j < E.numrows; j++) {
+    erow *row = &E.row[j];
+    const char *chars = editorRowPeek(row);
+    if (used + row->size + 1 > cap) {
+      if (writeAll(fd, buf, used) == -1) goto fail;
+      used = 0;
+    }
+    // rows larger than the buffer go out directly
+    if (row->size + 1 > cap) {
+      if (writeAll(fd, chars, row->size) == -1) goto fail;
+    } else {
+      memcpy(&buf[used], chars, row->size);
+      used += row->size;
+    }
+    buf[used++] = '\n';
+    row->foff = total;
+    total += (off_t)row->size + 1;
+  }
+  if (writeAll(fd, buf, used) == -1) goto fail;
+  free(buf);
+  return total;
+fail:
+  free(buf);
+  return -1;
+}
+
+void editorOpen(char *filename) {
+  free(E.filename);
+  E.filename = strdup(filename);
+  FILE *fp = fopen(filename, "r");
+
+  editorSelectSyntaxHighlight();
+
+  if (!fp) die("fopen");
+  if (E.srcfd != -1) close(E.srcfd);
+  E.srcfd = open(filename, O_RDONLY);
+  if (E.srcfd != -1 && fstat(E.srcfd, &E.srcst) == -1) {
+    close(E.srcfd);
+    E.srcfd = -1;
+  }
+  editorUndoReset();
+  W.complete = 0;
+  if (openCacheLoad()) {
+    fclose(fp);
+    E.dirty = 0;
+    diffRebase();
+    journalRecover();
+    return;
+  }
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+  off_t offset = 0;
+  E.undo_suspended++;
+  while ((linelen = getline(&line, &linecap, fp)) != -1) {
+    off_t next = offset + linelen;
+    while (linelen > 0 && (line[linelen - 1] == '\n' ||
+                           line[linelen - 1] == '\r'))
+      linelen--;
+    editorInsertRow(E.numrows, line, linelen);
+    E.row[E.numrows - 1].foff = offset;
+    offset = next;
+    editorColdMaybeSweep();
+  }
+  free(line);
+  fclose(fp);
+  E.undo_suspended--;
+  E.dirty = 0;
+  diffRebase();
+  journalRecover();
+}
+
+// Drops the buffer and everything hanging off it, leaving an empty one
+void editorCloseBuffer() {
+  for (size_t j = 0; j < E.numrows; j++) {
+    E.row[j].indexed = 0;
+    editorFreeRow(&E.row[j]);
+  }
+  wordIndexReset();
+  free(E.row);
+  E.row = NULL;
+  E.numrows = 0;
+  E.cx = E.cy = E.rx = 0;
+  E.rowoff = E.coloff = E.wrapoff = 0;
+  rowIndexReset();
+  E.hidden = 0;
+  editorCursorsClear();
+  E.mark = (size_t)-1;
+  journalDiscard();
+  E.cold_hand = 0;
+  free(E.filename);
+  E.filename = NULL;
+  E.syntax = NULL;
+  editorUndoReset();
+  E.dirty = 0;
+  E.grep_results = 0;
+  if (E.srcfd != -1) close(E.srcfd);
+  E.srcfd = -1;
+  if (E.swapfd != -1) close(E.swapfd);
+  E.swapfd = -1;
+  E.swap_end = 0;
+  diffRebase();
+}
+
+// Opens a temporary file next to E.filename, with its mode, to write a
+// save to and rename over it. Returns -1 when the file has to be rewritten
+// in place instead: it does not exist yet, or renaming would lose its
+// owner, its other links or the symlink to it.
+int editorSaveTemp(char *tmp, size_t size) {
+  struct stat st;
+  if (lstat(E.filename, &st) == -1 || !S_ISREG(st.st_mode) ||
+      st.st_nlink != 1 || st.st_uid != geteuid() ||
+      snprintf(tmp, size, "%s.cax-XXXXXX", E.filename) >= (int)size)
+    return -1;
+  int fd = mkstemp(tmp);
+  if (fd == -1) return -1;
+  if (fchmod(fd, st.st_mode & 07777) == -1) {
+    close(fd);
+    unlink(tmp);
+    return -1;
+  }
+  return fd;
+}
+
+void editorSave(){
+  if(E.filename == NULL){
+    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+    if (E.filename == NULL) {
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+    editorSelectSyntaxHighlight();
+  }
+  off_t len = 0;
+  for (size_t j = 0; j < E.numrows; j++)
+    len += (off_t)E.row[j].size + 1;
+
+  // a replayed session must not touch the files it was recorded against
+  if (T.replaying) {
+    E.dirty = 0;
+    editorSetStatusMessage("%lld bytes not written (replay)", (long long)len);
+    return;
+  }
+
+  // a new file is renamed over the old one, which dropped blocks go on
+  // being read back from; failing that the file is rewritten in place,
+  // and then nothing may still be paged from it
+  size_t lost = E.lost_blocks;
+  char tmp[4096];
+  int fd = editorSaveTemp(tmp, sizeof(tmp)), renamed = fd != -1;
+  if (!renamed) {
+    if (pagerDetachFile() == -1) {
+      editorSetStatusMessage("Can't save! %s changed on disk and some lines "
+                             "could not be read back", E.filename);
+      return;
+    }
+    fd = open(E.filename, O_RDWR | O_CREAT, 0644);
+    if (fd != -1 && ftruncate(fd, len) == -1) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  int ok = fd != -1 && editorWriteRows(fd) == len && E.lost_blocks == lost;
+  if (ok && renamed)
+    ok = fsync(fd) != -1 && rename(tmp, E.filename) != -1;
+  if (!ok) {
+    int err = errno;
+    if (fd != -1) close(fd);
+    if (renamed) unlink(tmp);
+    // rows were pointed at where they would have gone in the new file
+    for (size_t j = 0; j < E.numrows; j++) E.row[j].foff = -1;
+    if (E.lost_blocks != lost)
+      editorSetStatusMessage("Can't save! %s changed on disk and some lines "
+                             "could not be read back", E.filename);
+    else
+      editorSetStatusMessage("Can't save! I/O error: %s", strerror(err));
+    return;
+  }
+  if (renamed) {
+    pagerRetireFile();
+    E.srcfd = fd;
+  } else {
+    close(fd);
+    if (E.srcfd == -1) E.srcfd = open(E.filename, O_RDONLY);
+  }
+  if (E.srcfd != -1 && fstat(E.srcfd, &E.srcst) == -1) {
+    close(E.srcfd);
+    E.srcfd = -1;
+  }
+  E.dirty = 0;
+  // the journal starts over from what is on disk now
+  journalDiscard();
+  journalArm();
+  diffRebase();
+  editorSetStatusMessage("%lld bytes written to disk", (long long)len);
+}
+
+/*** Open cache ***/
+
+/*
+ * Reopening a file that has not changed skips reading it. On a clean quit
+ * the line index is written to $XDG_CACHE_HOME/cax (or ~/.cache/cax):
+ * where each line starts, how long its line ending is, whether it ends
+ * inside a multi-line comment, and where the cursor was. The entry is
+ * keyed by path, size, mtime, inode and syntax definition. On a hit the file is
+ * mapped back as cold rows that are only read from disk once they are
+ * looked at, and the cursor goes back where it was.
+ */
+
+struct openCacheHeader {
+  char magic[8];
+  uint64_t size;
+  uint64_t ino;
+  uint64_t dev;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t nrows;
+  uint64_t cx, cy, rowoff, coloff;
+  char filetype[16];
+  uint64_t syntax;            // hash of the syntax definition
+  uint32_t pathlen;           // the path follows, padded to 8 bytes
+  uint32_t pad;
+  // then uint64_t foff[nrows] and uint8_t ends[nrows]
+};
+
+#define OPEN_CACHE_MAGIC "CAXOC02"
+#define OPEN_CACHE_COMMENT 0x80 // in ends[]: the line ends inside a comment
+
+// Path of a file in $XDG_CACHE_HOME/cax; returns -1 if there is no home
+int cacheFilePath(const char *name, char *buf, size_t bufsize, int create) {
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  char dir[4096];
+  if (xdg && *xdg)
+    snprintf(dir, sizeof(dir), "%s", xdg);
+  else if (home && *home)
+    snprintf(dir, sizeof(dir), "%s/.cache", home);
+  else
+    return -1;
+  if (create) mkdir(dir, 0700);
+  size_t len = strlen(dir);
+  snprintf(dir + len, sizeof(dir) - len, "/cax");
+  if (create) mkdir(dir, 0700);
+  if (snprintf(buf, bufsize, "%s/%s", dir, name) >= (int)bufsize) return -1;
+  return 0;
+}
+
+// FNV-1a, carrying on from h
+uint64_t fnv1a(uint64_t h, const void *data, size_t len) {
+  const unsigned char *p = data;
+  for (size_t i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+// Cache file name for an absolute path
+int openCachePath(const char *abs, char *buf, size_t bufsize, int create) {
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx",
+           (unsigned long long)fnv1a(FNV1A_INIT, abs, strlen(abs)));
+  return cacheFilePath(name, buf, bufsize, create);
+}
+
+void openCacheKey(struct openCacheHeader *h, struct stat *st) {
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, OPEN_CACHE_MAGIC, sizeof(h->magic));
+  h->size = st->st_size;
+  h->ino = st->st_ino;
+  h->dev = st->st_dev;
+  h->mtime_sec = st->st_mtim.tv_sec;
+  h->mtime_nsec = st->st_mtim.tv_nsec;
+  snprintf(h->filetype, sizeof(h->filetype), "%s",
+           E.syntax ? E.syntax->filetype : "");
+  h->syntax = E.syntax ? E.syntax->hash : 0;
+}
+
+int openCacheUsable() {
+  return E.filename && E.srcfd != -1 && !E.shared && !E.headless &&
+         !T.replaying;
+}
+
+// Whether the line index of an entry fits a file of size bytes: lines in
+// order from offset 0, each ending inside the file. A damaged entry would
+// otherwise make rows of absurd sizes.
+int openCacheLinesValid(const uint64_t *foff, const uint8_t *ends, size_t n,
+                        uint64_t size) {
+  if (foff[0] != 0) return 0;
+  for (size_t j = 0; j < n; j++) {
+    uint64_t next = j + 1 < n ? foff[j + 1] : size;
+    uint64_t eol = ends[j] & ~OPEN_CACHE_COMMENT;
+    if (foff[j] >= size || next > size || next <= foff[j] ||
+        eol > next - foff[j])
+      return 0;
+  }
+  return 1;
+}
+
+// Builds the rows of the buffer from a matching cache entry instead of
+// reading the file. Returns 1 on a hit.
+int openCacheLoad() {
+  if (!openCacheUsable()) return 0;
+  char *abs = realpath(E.filename, NULL);
+  char path[4096];
+  struct stat st;
+  if (!abs || openCachePath(abs, path, sizeof(path), 0) == -1 ||
+      fstat(E.srcfd, &st) == -1) {
+    free(abs);
+    return 0;
+  }
+  int fd = open(path, O_RDONLY);
+  struct stat cst;
+  if (fd == -1 || fstat(fd, &cst) == -1 ||
+      (size_t)cst.st_size < sizeof(struct openCacheHeader)) {
+    if (fd != -1) close(fd);
+    free(abs);
+    return 0;
+  }
+  size_t clen = cst.st_size;
+  char *map = mmap(NULL, clen, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    free(abs);
+    return 0;
+  }
+
+  struct openCacheHeader key, *h = (struct openCacheHeader *)map;
+  openCacheKey(&key, &st);
+  size_t pathpad = (h->pathlen + 7) & ~(size_t)7;
+  size_t room = clen - sizeof(*h);
+  size_t n = h->nrows;
+  int hit = !memcmp(h->magic, key.magic, sizeof(key.magic)) &&
+            h->size == key.size && h->ino == key.ino && h->dev == key.dev &&
+            h->mtime_sec == key.mtime_sec && h->mtime_nsec == key.mtime_nsec &&
+            !memcmp(h->filetype, key.filetype, sizeof(key.filetype)) &&
+            h->syntax == key.syntax &&
+            h->pathlen == strlen(abs) && pathpad <= room && n > 0 &&
+            n <= (room - pathpad) / 9 && room == pathpad + n * 9 &&
+            !memcmp(map + sizeof(*h), abs, h->pathlen);
+  free(abs);
+  uint64_t *foff = (uint64_t *)(map + sizeof(*h) + pathpad);
+  uint8_t *ends = (uint8_t *)&foff[n];
+  if (!hit || !openCacheLinesValid(foff, ends, n, h->size)) {
+    munmap(map, clen);
+    return 0;
+  }
+
+  E.row = malloc(sizeof(erow) * n);
+  struct coldBlock *b = NULL;
+  for (size_t j = 0; j < n; j++) {
+    erow *row = &E.row[j];
+    uint64_t next = j + 1 < n ? foff[j + 1] : h->size;
+    row->idx = j;
+    row->size = next - foff[j] - (ends[j] & ~OPEN_CACHE_COMMENT);
+    row->rsize = 0;
+    row->chars = row->render = NULL;
+    row->hl = NULL;
+    row->hl_open_comment = (ends[j] & OPEN_CACHE_COMMENT) != 0;
+    row->indexed = 0;
+    row->bmin = 1;
+    row->hidden = 0;
+    row->mem = 0;
+    row->foff = foff[j];
+    row->wrapgen = 0;
+
+    // the same blocks editorCoolRows would have made, left on disk
+    if (!b || b->refs == CAX_COLD_BLOCK_ROWS ||
+        b->ulen >= CAX_COLD_BLOCK_BYTES) {
+      b = malloc(sizeof(struct coldBlock));
+      b->refs = 0;
+      b->ulen = 0;
+      b->clen = 0;
+      b->data = NULL;
+      b->foff = foff[j];
+      b->file = NULL;
+      b->swapoff = -1;
+      pagerLink(b);
+    }
+    row->cold = b;
+    row->coff = foff[j] - b->foff;
+    E.paged_bytes -= b->ulen;
+    b->ulen = row->coff + row->size;
+    E.paged_bytes += b->ulen;
+    b->refs++;
+  }
+  E.numrows = n;
+  rowIndexReset();
+  E.cy = h->cy <= n ? h->cy : 0;
+  E.cx = E.cy < n && h->cx <= E.row[E.cy].size ? h->cx : 0;
+  E.rowoff = h->rowoff <= E.cy ? h->rowoff : E.cy;
+  E.coloff = h->coloff;
+  munmap(map, clen);
+  return 1;
+}
+
+// Writes the cache entry for the open file, if it is saved and every line
+// is still where it was read from
+void openCacheSave() {
+  if (!openCacheUsable() || E.dirty || E.numrows == 0) return;
+  struct stat st;
+  if (fstat(E.srcfd, &st) == -1) return;
+  uint8_t *ends = malloc(E.numrows);
+  uint64_t *foff = malloc(sizeof(uint64_t) * E.numrows);
+  for (size_t j = 0; j < E.numrows; j++) {
+    erow *row = &E.row[j];
+    off_t next = j + 1 < E.numrows ? E.row[j + 1].foff : st.st_size;
+    off_t gap = next - row->foff - (off_t)row->size;
+    if (row->foff < 0 || gap < 0 || gap >= OPEN_CACHE_COMMENT ||
+        (j == 0 && row->foff != 0)) {
+      free(ends);
+      free(foff);
+      return;
+    }
+    foff[j] = row->foff;
+    ends[j] = gap | (row->hl_open_comment ? OPEN_CACHE_COMMENT : 0);
+  }
+
+  char *abs = realpath(E.filename, NULL);
+  char path[4096], tmp[4200];
+  if (abs && openCachePath(abs, path, sizeof(path), 1) == 0) {
+    struct openCacheHeader h;
+    openCacheKey(&h, &st);
+    h.nrows = E.numrows;
+    h.cx = E.cx;
+    h.cy = E.cy;
+    h.rowoff = E.rowoff;
+    h.coloff = E.coloff;
+    h.pathlen = strlen(abs);
+    size_t pathpad = (h.pathlen + 7) & ~(size_t)7;
+    char *p = calloc(1, pathpad ? pathpad : 1);
+    memcpy(p, abs, h.pathlen);
+
+    // written aside and renamed, so a reader never sees half an entry
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd != -1) {
+      int ok = writeAll(fd, (char *)&h, sizeof(h)) == 0 &&
+               writeAll(fd, p, pathpad) == 0 &&
+               writeAll(fd, (char *)foff, sizeof(uint64_t) * E.numrows) == 0 &&
+               writeAll(fd, (char *)ends, E.numrows) == 0;
+      close(fd);
+      if (!ok || rename(tmp, path) == -1) unlink(tmp);
+    }
+    free(p);
+  }
+  free(abs);
+  free(ends);
+  free(foff);
+}
+
+/*** Journal ***/
+
+/*
+ * Every row level change to a saved file is appended to a recovery journal
+ * in the cache directory, so a crash or a dropped connection loses at most
+ * the last second of work. The main thread only encodes records into J.buf;
+ * a background thread writes whatever has piled up in one write and calls
+ * fdatasync at most every CAX_JOURNAL_SYNC_MS. The cost of a record is the
+ * size of the rows it names, never the size of the file. Saving or quitting
+ * removes the journal; opening a file that has one offers to replay it.
+ * The journal stays locked while it is armed, so a second cax on the same
+ * file neither replays nor journals into the one the first is writing.
+ */
+
+#define JOURNAL_MAGIC "CAXJL01"
+
+// Identifies the file on disk the journaled edits apply to
+struct journalHeader {
+  char magic[8];
+  uint64_t size;
+  uint64_t ino;
+  uint64_t dev;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+};
+
+// Followed by size bytes of text
+struct journalRecord {
+  uint32_t op;
+  uint32_t pad;
+  uint64_t at;
+  uint64_t count;
+  uint64_t shift;
+  uint64_t size;
+  uint64_t check;             // FNV-1a of the fields above and the text
+};
+
+struct editorJournal {
+  pthread_mutex_t lock;
+  pthread_cond_t more;
+  int armed;                  // changes to the buffer are being journaled
+  int fd;                     // locked journal while armed, or -1
+  int started;                // the header has been written to fd
+  int writer;                 // the writer thread is running
+  int writing;                // the writer is using fd outside the lock
+  int unsynced;               // written since the last fdatasync
+  char *buf;                  // records the writer has not taken yet
+  size_t len;
+  size_t cap;
+  struct journalHeader key;
+  char path[4096];
+};
+
+struct editorJournal J = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                           0, -1, 0, 0, 0, 0, NULL, 0, 0,
+                           { "", 0, 0, 0, 0, 0 }, "" };
+
+uint64_t journalCheck(struct journalRecord *r, const char *text) {
+  struct journalRecord h = *r;
+  h.check = 0;
+  return fnv1a(fnv1a(FNV1A_INIT, &h, sizeof(h)), text, h.size);
+}
+
+void *journalWriterThread(void *arg) {
+  (void)arg;
+  uint64_t synced = traceNow();
+  pthread_mutex_lock(&J.lock);
+  while (1) {
+    if (J.len == 0 && J.unsynced) {
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec += CAX_JOURNAL_SYNC_MS / 1000;
+      ts.tv_nsec += (CAX_JOURNAL_SYNC_MS % 1000) * 1000000L;
+      if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait(&J.more, &J.lock, &ts);
+    } else if (J.len == 0) {
+      pthread_cond_wait(&J.more, &J.lock);
+    }
+    if (J.fd == -1) {
+      J.unsynced = 0;
+      continue;
+    }
+    char *buf = J.buf;
+    size_t len = J.len;
+    J.buf = NULL;
+    J.len = J.cap = 0;
+    int fd = J.fd;
+    J.writing = 1;
+    pthread_mutex_unlock(&J.lock);
+
+    // a failed write leaves a torn record, where replay stops anyway
+    if (len) writeAll(fd, buf, len);
+    free(buf);
+    uint64_t now = traceNow();
+    int sync = now - synced >= CAX_JOURNAL_SYNC_MS * 1000000ull;
+    if (sync) {
+      fdatasync(fd);
+      synced = now;
+    }
+
+    pthread_mutex_lock(&J.lock);
+    J.writing = 0;
+    J.unsynced = !sync;
+    pthread_cond_broadcast(&J.more);
+  }
+  return NULL;
+}
+
+// Daemon sessions journal too, though they share their holder's blocks;
+// the holder itself does not, and leaves it to each session
+int journalUsable() {
+  return E.filename && E.srcfd != -1 && !E.headless && !T.replaying &&
+         !T.fp && !daemon_holder;
+}
+
+// Starts journaling changes to the open file as it is on disk now
+void journalArm() {
+  struct stat st;
+  char name[64];
+  if (!journalUsable() || fstat(E.srcfd, &st) == -1) return;
+  char *abs = realpath(E.filename, NULL);
+  if (!abs) return;
+  snprintf(name, sizeof(name), "journal-%016llx",
+           (unsigned long long)fnv1a(FNV1A_INIT, abs, strlen(abs)));
+  free(abs);
+  if (cacheFilePath(name, J.path, sizeof(J.path), 1) == -1) return;
+  // a journal unlinked after we opened it is a stale name; open it again
+  int fd = -1;
+  for (int tries = 0; fd == -1 && tries < 3; tries++) {
+    struct stat jst, pst;
+    fd = open(J.path, O_RDWR | O_CREAT, 0600);
+    if (fd == -1) return;
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+      close(fd);
+      if (errno == EWOULDBLOCK)
+        editorSetStatusMessage("%s is open in another cax: not journaling "
+                               "changes", E.filename);
+      return;
+    }
+    if (fstat(fd, &jst) == -1 || stat(J.path, &pst) == -1 ||
+        jst.st_ino != pst.st_ino || jst.st_dev != pst.st_dev) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  if (fd == -1) return;
+  J.fd = fd;
+  J.started = 0;
+  memset(&J.key, 0, sizeof(J.key));
+  memcpy(J.key.magic, JOURNAL_MAGIC, sizeof(J.key.magic));
+  J.key.size = st.st_size;
+  J.key.ino = st.st_ino;
+  J.key.dev = st.st_dev;
+  J.key.mtime_sec = st.st_mtim.tv_sec;
+  J.key.mtime_nsec = st.st_mtim.tv_nsec;
+  J.armed = 1;
+}
+
+// Hands fd, positioned at the end of the journal, to the writer
+void journalAttach(int fd) {
+  pthread_mutex_lock(&J.lock);
+  J.fd = fd;
+  if (!J.writer) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, journalWriterThread, NULL) != 0)
+      die("pthread_create");
+    pthread_detach(tid);
+    J.writer = 1;
+  }
+  pthread_mutex_unlock(&J.lock);
+}
+
+// Stops journaling and removes the journal
+void journalDiscard() {
+  pthread_mutex_lock(&J.lock);
+  while (J.writing) pthread_cond_wait(&J.more, &J.lock);
+  free(J.buf);
+  J.buf = NULL;
+  J.len = J.cap = 0;
+  // unlinked while still locked, so nobody locks the old file after us
+  if (J.fd != -1) {
+    unlink(J.path);
+    close(J.fd);
+  }
+  J.fd = -1;
+  J.started = 0;
+  J.armed = 0;
+  pthread_mutex_unlock(&J.lock);
+}
+
+/* The journal of a buffer that is not current */
+struct journalFile {
+  int armed;
+  int fd;
+  int started;
+  struct journalHeader key;
+  char path[4096];
+};
+
+// Sets the journal aside, with everything recorded so far on disk, so
+// that another buffer can have the writer
+void journalPark(struct journalFile *f) {
+  pthread_mutex_lock(&J.lock);
+  while (J.len || J.writing) pthread_cond_wait(&J.more, &J.lock);
+  if (J.fd != -1 && J.unsynced) fdatasync(J.fd);
+  J.unsynced = 0;
+  f->armed = J.armed;
+  f->fd = J.fd;
+  f->started = J.started;
+  f->key = J.key;
+  memcpy(f->path, J.path, sizeof(f->path));
+  J.armed = 0;
+  J.fd = -1;
+  J.started = 0;
+  pthread_mutex_unlock(&J.lock);
+}
+
+void journalResume(struct journalFile *f) {
+  pthread_mutex_lock(&J.lock);
+  J.armed = f->armed;
+  J.fd = f->fd;
+  J.started = f->started;
+  J.key = f->key;
+  memcpy(J.path, f->path, sizeof(J.path));
+  pthread_mutex_unlock(&J.lock);
+}
+
+// Records a change; its text is rows at..at+nrows-1 joined by '\n'
+void journalPut(int op, size_t at, size_t count, size_t shift, size_t nrows) {
+  if (!J.armed) return;
+  if (!J.started) {
+    if (ftruncate(J.fd, 0) == -1 || lseek(J.fd, 0, SEEK_SET) == -1 ||
+        writeAll(J.fd, (char *)&J.key, sizeof(J.key)) == -1) {
+      J.armed = 0;
+      return;
+    }
+    J.started = 1;
+    journalAttach(J.fd);
+  }
+  struct journalRecord r;
+  memset(&r, 0, sizeof(r));
+  r.op = op;
+  r.at = at;
+  r.count = count;
+  r.shift = shift;
+  for (size_t j = at; j < at + nrows; j++) r.size += E.row[j].size + 1;
+  if (r.size) r.size--;
+
+  pthread_mutex_lock(&J.lock);
+  if (J.len + sizeof(r) + r.size > J.cap) {
+    J.cap = (J.len + sizeof(r) + r.size) * 2;
+    J.buf = realloc(J.buf, J.cap);
+  }
+  char *text = J.buf + J.len + sizeof(r), *p = text;
+  for (size_t j = at; j < at + nrows; j++) {
+    if (j > at) *p++ = '\n';
+    editorRowCopyChars(&E.row[j], p);
+    p += E.row[j].size;
+  }
+  r.check = journalCheck(&r, text);
+  memcpy(J.buf + J.len, &r, sizeof(r));
+  J.len += sizeof(r) + r.size;
+  pthread_cond_signal(&J.more);
+  pthread_mutex_unlock(&J.lock);
+}
+
+// Applies one record to the buffer; returns -1 if it does not fit it
+int journalApply(struct journalRecord *r, char *text) {
+  switch (r->op) {
+    case ROW_SET: {
+      if (r->at >= E.numrows) return -1;
+      erow *row = editorRow(r->at);
+      editorUndoChange(r->at);
+      row->chars = realloc(row->chars, r->size + 1);
+      memcpy(row->chars, text, r->size);
+      row->chars[r->size] = '\0';
+      row->size = r->size;
+      editorUpdateRow(row);
+      E.dirty++;
+      return 0;
+    }
+    case ROW_INSERT: {
+      if (r->at > E.numrows || r->count == 0) return -1;
+      char **lines = malloc(sizeof(char *) * r->count);
+      size_t *lens = malloc(sizeof(size_t) * r->count);
+      char *p = text, *end = text + r->size;
+      for (size_t k = 0; k < r->count; k++) {
+        char *nl = memchr(p, '\n', end - p);
+        lines[k] = p;
+        lens[k] = (nl ? nl : end) - p;
+        p = nl ? nl + 1 : end;
+      }
+      editorInsertRows(r->at, lines, lens, r->count);
+      free(lines);
+      free(lens);
+      return 0;
+    }
+    case ROW_DELETE:
+      if (r->at >= E.numrows || r->count > E.numrows - r->at) return -1;
+      editorDelRows(r->at, r->count);
+      return 0;
+    case ROW_ROTATE:
+      if (r->count > E.numrows || r->at > E.numrows - r->count ||
+          r->shift == 0 || r->shift >= r->count)
+        return -1;
+      editorRotateRows(r->at, r->count, r->shift);
+      return 0;
+  }
+  return -1;
+}
+
+// Called once the file is loaded: offers to replay a journal left behind
+// for it, then keeps journaling
+void journalRecover() {
+  journalArm();
+  if (!J.armed) return;
+  int fd = J.fd;
+  struct stat st;
+  if (fstat(fd, &st) == -1 || (size_t)st.st_size <= sizeof(J.key)) return;
+  size_t len = st.st_size;
+  char *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) return;
+
+  // records up to the first torn or corrupt one
+  size_t n = 0, end = sizeof(J.key);
+  int stale = memcmp(map, &J.key, sizeof(J.key)) != 0;
+  while (!stale && len - end >= sizeof(struct journalRecord)) {
+    struct journalRecord r;
+    memcpy(&r, map + end, sizeof(r));
+    if (r.size > len - end - sizeof(r) ||
+        r.check != journalCheck(&r, map + end + sizeof(r)))
+      break;
+    end += sizeof(r) + r.size;
+    n++;
+  }
+  char *answer = NULL;
+  if (!stale && n) {
+    char prompt[128];
+    snprintf(prompt, sizeof(prompt), "Recover %zu unsaved changes from the "
+             "journal? (y/n) %%s", n);
+    answer = editorPrompt(prompt, NULL);
+  }
+  if (!answer || (answer[0] != 'y' && answer[0] != 'Y')) {
+    free(answer);
+    munmap(map, len);
+    // the first change starts the journal over
+    editorSetStatusMessage("");
+    return;
+  }
+  free(answer);
+
+  // replayed as one undo step, without journaling what is already there
+  editorUndoBreak();
+  J.armed = 0;
+  size_t applied = 0, off = sizeof(J.key), at = 0;
+  while (applied < n) {
+    struct journalRecord r;
+    memcpy(&r, map + off, sizeof(r));
+    if (journalApply(&r, map + off + sizeof(r)) == -1) break;
+    off += sizeof(r) + r.size;
+    at = r.at;
+    applied++;
+  }
+  munmap(map, len);
+  editorUndoBreak();
+  if (ftruncate(fd, off) == -1 || lseek(fd, off, SEEK_SET) == -1) {
+    journalDiscard();
+  } else {
+    J.armed = 1;
+    J.started = 1;
+    journalAttach(fd);
+  }
+  E.cy = at < E.numrows ? at : E.numrows;
+  E.cx = 0;
+  editorSetStatusMessage("Recovered %zu of %zu changes", applied, n);
+}
+
+/*** find ***/
+
+void editorFindCallback(char *query, int key) {
+  static size_t last_match;
+  static int have_match = 0;
+  static int direction = 1;
+
+  // Restoring syntax highlighting after search
+  static size_t saved_hl_line;
+  static char *saved_hl = NULL;
+  if (saved_hl) {
+    // a cooled row gets fresh highlighting when it is thawed again
+    if (saved_hl_line < E.numrows && !E.row[saved_hl_line].cold)
+      memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
+    free(saved_hl);
+    saved_hl = NULL;
+  }
+
+  if (key == '\r' || key == '\x1b') {
+    have_match = 0;
+    direction = 1;
+    return;
+  } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+    direction = 1;
+  } else if (key == ARROW_LEFT || key == ARROW_UP) {
+    direction = -1;
+  } else {
+    have_match = 0;
+    direction = 1;
+  }
+  if (last_match >= E.numrows) have_match = 0;
+  if (!have_match) direction = 1;
+  size_t current = last_match;
+  size_t i;
+  for (i = 0; i < E.numrows; i++) {
+    if (!have_match && i == 0)
+      current = 0;
+    else if (direction == 1)
+      current = current + 1 == E.numrows ? 0 : current + 1;
+    else
+      current = current == 0 ? E.numrows - 1 : current - 1;
+    if (E.row[current].hidden) {
+      // a fold is passed over in one step
+      size_t end = direction == 1 ? foldNext(current) - 1
+                                  : foldPrev(current) + 1;
+      i += end > current ? end - current : current - end;
+      current = end;
+      continue;
+    }
+    editorColdMaybeSweep();
+    erow *row = editorRow(current);
+    char *match = strstr(row->render, query);
+    if (match) {
+      last_match = current;
+      have_match = 1;
+      E.cy = current;
+      E.cx = editorRowRenderToCx(row, match - row->render);
+      E.rowoff = E.numrows;
+
+      saved_hl_line = current;
+      saved_hl = malloc(row->rsize);
+      memcpy(saved_hl, row->hl, row->rsize);
+      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
+
+      break;
+    }
+  }
+}
+
+void editorFind() {
+  size_t saved_cx = E.cx;
+  size_t saved_cy = E.cy;
+  size_t saved_coloff = E.coloff;
+  size_t saved_rowoff = E.rowoff;
+  char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)",
+                             editorFindCallback);
+  if (query) {
+    free(query);
+  } else {
+    E.cx = saved_cx;
+    E.cy = saved_cy;
+    E.coloff = saved_coloff;
+    E.rowoff = saved_rowoff;
+  }
+}
+
+/*** replace ***/
+
+/*
+ * Replace-all finds every match of a row before touching it, then builds
+ * the new contents in a single allocation and updates the row once. Rows
+ * without a match are only peeked at, so cold rows stay cold. The whole
+ * run is one undo group.
+ */
+
+#define CAX_REPLACE_GROUPS 10
+
+struct replaceSpec {
+  int regex;
+  regex_t re;
+  char *pat;
+  size_t patlen;
+  char *rep;
+  size_t replen;
+};
+
+// Matches of the row being rebuilt; with a regex, CAX_REPLACE_GROUPS
+// submatches per match, otherwise just the match itself
+regmatch_t *replace_matches;
+size_t replace_matches_cap;
+
+int replaceCompileAs(struct replaceSpec *rs, const char *pattern,
+                     const char *replacement, int regex) {
+  rs->regex = regex;
+  rs->rep = strdup(replacement);
+  rs->replen = strlen(replacement);
+  if (rs->regex) {
+    int err = regcomp(&rs->re, pattern, REG_EXTENDED);
+    if (err) {
+      char msg[64];
+      regerror(err, &rs->re, msg, sizeof(msg));
+      editorSetStatusMessage("Bad regex: %s", msg);
+      free(rs->rep);
+      return -1;
+    }
+    rs->pat = NULL;
+    rs->patlen = 0;
+  } else {
+    rs->pat = strdup(pattern);
+    rs->patlen = strlen(pattern);
+  }
+  return 0;
+}
+
+// "/re/" is an extended regular expression, anything else a literal string
+int replaceCompile(struct replaceSpec *rs, const char *pattern,
+                   const char *replacement) {
+  size_t len = strlen(pattern);
+  if (len > 2 && pattern[0] == '/' && pattern[len - 1] == '/') {
+    char *re = strndup(pattern + 1, len - 2);
+    int err = replaceCompileAs(rs, re, replacement, 1);
+    free(re);
+    return err;
+  }
+  return replaceCompileAs(rs, pattern, replacement, 0);
+}
+
+void replaceFree(struct replaceSpec *rs) {
+  if (rs->regex) regfree(&rs->re);
+  free(rs->pat);
+  free(rs->rep);
+}
+
+regmatch_t *replaceMatchSlot(size_t n, size_t per) {
+  if ((n + 1) * per > replace_matches_cap) {
+    replace_matches_cap = replace_matches_cap ? replace_matches_cap * 2 : 64;
+    while ((n + 1) * per > replace_matches_cap) replace_matches_cap *= 2;
+    replace_matches = realloc(replace_matches,
+                              sizeof(regmatch_t) * replace_matches_cap);
+  }
+  return &replace_matches[n * per];
+}
+
+// Finds all non-overlapping matches in chars. Returns how many.
+size_t replaceFindAll(struct replaceSpec *rs, const char *chars,
+                      size_t size) {
+  size_t n = 0;
+  size_t pos = 0;
+  if (!rs->regex) {
+    const char *p;
+    while (pos + rs->patlen <= size &&
+           (p = memmem(chars + pos, size - pos, rs->pat, rs->patlen))) {
+      regmatch_t *m = replaceMatchSlot(n++, 1);
+      m->rm_so = p - chars;
+      m->rm_eo = m->rm_so + rs->patlen;
+      pos = m->rm_eo;
+    }
+    return n;
+  }
+  while (pos <= size) {
+    regmatch_t *m = replaceMatchSlot(n, CAX_REPLACE_GROUPS);
+    m[0].rm_so = pos;
+    m[0].rm_eo = size;
+    if (regexec(&rs->re, chars, CAX_REPLACE_GROUPS, m,
+                REG_STARTEND | (pos ? REG_NOTBOL : 0)) != 0)
+      break;
+    n++;
+    // an empty match must not match again at the same place
+    pos = m[0].rm_eo > m[0].rm_so ? (size_t)m[0].rm_eo : (size_t)m[0].rm_eo + 1;
+  }
+  return n;
+}
+
+// Length of the replacement for one match; regex replacements expand
+// \0-\9 to submatches and \\ to a backslash
+size_t replaceExpand(struct replaceSpec *rs, const char *chars,
+                     regmatch_t *m, char *out) {
+  if (!rs->regex) {
+    if (out) memcpy(out, rs->rep, rs->replen);
+    return rs->replen;
+  }
+  size_t len = 0;
+  for (size_t i = 0; i < rs->replen; i++) {
+    char c = rs->rep[i];
+    if (c == '\\' && i + 1 < rs->replen) {
+      c = rs->rep[++i];
+      if (isdigit((unsigned char)c)) {
+        regmatch_t *g = &m[c - '0'];
+        if (g->rm_so == -1) continue;
+        if (out) memcpy(&out[len], &chars[g->rm_so], g->rm_eo - g->rm_so);
+        len += g->rm_eo - g->rm_so;
+        continue;
+      }
+    }
+    if (out) out[len] = c;
+    len++;
+  }
+  return len;
+}
+
+// Rewrites every match in the buffer. Returns the number of replacements
+// and stores the number of rows that changed in *rows_changed.
+size_t editorReplaceAll(struct replaceSpec *rs, size_t *rows_changed) {
+  size_t per = rs->regex ? CAX_REPLACE_GROUPS : 1;
+  size_t total = 0;
+  *rows_changed = 0;
+  for (size_t j = 0; j < E.numrows; j++) {
+    erow *row = &E.row[j];
+    const char *chars = editorRowPeek(row);
+    size_t n = replaceFindAll(rs, chars, row->size);
+    if (n == 0) continue;
+
+    size_t newsize = row->size;
+    for (size_t k = 0; k < n; k++) {
+      regmatch_t *m = &replace_matches[k * per];
+      newsize += replaceExpand(rs, chars, m, NULL);
+      newsize -= m[0].rm_eo - m[0].rm_so;
+    }
+    char *out = malloc(newsize + 1);
+    size_t from = 0, to = 0;
+    for (size_t k = 0; k < n; k++) {
+      regmatch_t *m = &replace_matches[k * per];
+      memcpy(&out[to], &chars[from], m[0].rm_so - from);
+      to += m[0].rm_so - from;
+      to += replaceExpand(rs, chars, m, &out[to]);
+      from = m[0].rm_eo;
+    }
+    memcpy(&out[to], &chars[from], row->size - from);
+    out[newsize] = '\0';
+
+    // the old contents go to the undo log as they are
+    if (row->cold) {
+      char *old = malloc(row->size + 1);
+      memcpy(old, chars, row->size);
+      old[row->size] = '\0';
+      coldBlockRelease(row->cold);
+      row->cold = NULL;
+      editorUndoChangeTake(j, old, row->size);
+    } else {
+      editorUndoChangeTake(j, row->chars, row->size);
+    }
+    row->chars = out;
+    row->size = newsize;
+    editorUpdateRow(row);
+    total += n;
+    (*rows_changed)++;
+    editorColdMaybeSweep();
+  }
+  if (total) E.dirty++;
+  return total;
+}
+
+void editorReplace() {
+  char *pattern = editorPrompt("Replace: %s (ESC to cancel, /regex/)", NULL);
+  if (!pattern) return;
+  char *replacement = editorPromptEx("Replace with: %s (ESC to cancel)",
+                                     NULL, 1);
+  if (!replacement) {
+    free(pattern);
+    return;
+  }
+
+  struct replaceSpec rs;
+  if (replaceCompile(&rs, pattern, replacement) == 0) {
+    size_t rows;
+    uint64_t start = traceNow();
+    editorUndoBreak();
+    size_t n = editorReplaceAll(&rs, &rows);
+    editorUndoBreak();
+    if (E.cy < E.numrows && E.cx > E.row[E.cy].size)
+      E.cx = E.row[E.cy].size;
+    editorSetStatusMessage("Replaced %zu occurrences in %zu lines (%.2fs)",
+                           n, rows, (traceNow() - start) / 1e9);
+    replaceFree(&rs);
+  }
+  free(pattern);
+  free(replacement);
+}
+
+/*** grep ***/
+
+/*
+ * Ctrl-G searches every file below the current directory. A walker thread
+ * lists the tree, skipping .git and whatever the .gitignore files exclude,
+ * and queues paths for one worker thread per core. Workers mmap each file
+ * and search it as a whole rather than line by line, then push
+ * "path:line:text" hits through the row feed, so the results buffer fills
+ * in while the search runs. Enter on a hit opens that file at that line;
+ * Ctrl-G with an empty query goes back to the results.
+ */
+
+#define CAX_GREP_LINE_MAX 512        // hit lines are cut to this length
+#define CAX_GREP_BINARY_PROBE 8192   // a NUL in this prefix means binary
+#define CAX_GREP_MAX_WORKERS 64
+#define CAX_GREP_READ_MAX (1 << 18)  // smaller files are read, not mapped
+
+struct grepRule {
+  char *base;                 // directory of the .gitignore, "" for the top
+  char *pat;
+  int negate;
+  int dironly;
+  int anchored;               // contains a '/', so matched from base
+};
+
+struct grepSearch {
+  pthread_mutex_t lock;
+  pthread_cond_t more;
+  char **files;               // everything queued so far, in walk order
+  size_t nfiles;
+  size_t cap;
+  size_t next;                // first file no worker has taken yet
+  int walked;
+  int regex;
+  char *pat;
+  size_t patlen;
+  size_t matches;
+  size_t hitfiles;
+  uint64_t start;
+  struct grepRule *rules;     // only touched by the walker
+  size_t nrules;
+  size_t rulecap;
+};
+
+struct grepSearch G = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                        NULL, 0, 0, 0, 0, 0, NULL, 0, 0, 0, 0, NULL, 0, 0 };
+
+// The last results, kept while one of the hits is open
+char *grep_saved;
+size_t grep_saved_len;
+size_t grep_saved_cy;
+char *grep_saved_name;
+
+void grepLoadIgnore(const char *dir) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s.gitignore", dir);
+  FILE *fp = fopen(path, "r");
+  if (!fp) return;
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t len;
+  while ((len = getline(&line, &linecap, fp)) != -1) {
+    while (len > 0 && isspace((unsigned char)line[len - 1])) line[--len] = '\0';
+    char *p = line;
+    if (len == 0 || *p == '#') continue;
+    struct grepRule r = { NULL, NULL, 0, 0, 0 };
+    if (*p == '!') {
+      r.negate = 1;
+      p++;
+    }
+    if (*p == '\\') p++;
+    size_t n = strlen(p);
+    if (n && p[n - 1] == '/') {
+      r.dironly = 1;
+      p[--n] = '\0';
+    }
+    r.anchored = strchr(p, '/') != NULL;
+    if (*p == '/') p++;
+    if (!*p) continue;
+    r.base = strdup(dir);
+    r.pat = strdup(p);
+    if (G.nrules == G.rulecap) {
+      G.rulecap = G.rulecap ? G.rulecap * 2 : 32;
+      G.rules = realloc(G.rules, sizeof(struct grepRule) * G.rulecap);
+    }
+    G.rules[G.nrules++] = r;
+  }
+  free(line);
+  fclose(fp);
+}
+
+// The last rule that matches decides, as in git
+int grepIgnored(const char *rel, const char *name, int isdir) {
+  int ignored = 0;
+  for (size_t i = 0; i < G.nrules; i++) {
+    struct grepRule *r = &G.rules[i];
+    if (r->dironly && !isdir) continue;
+    int m;
+    if (r->anchored)
+      m = fnmatch(r->pat, rel + strlen(r->base),
+                  strstr(r->pat, "**") ? 0 : FNM_PATHNAME) == 0;
+    else
+      m = fnmatch(r->pat, name, 0) == 0;
+    if (m) ignored = !r->negate;
+  }
+  return ignored;
+}
+
+void grepQueue(char *path) {
+  pthread_mutex_lock(&G.lock);
+  if (G.nfiles == G.cap) {
+    G.cap = G.cap ? G.cap * 2 : 1024;
+    G.files = realloc(G.files, sizeof(char *) * G.cap);
+  }
+  G.files[G.nfiles++] = path;
+  pthread_cond_signal(&G.more);
+  pthread_mutex_unlock(&G.lock);
+}
+
+// Blocks until a file is queued or the walk is over
+char *grepNext() {
+  pthread_mutex_lock(&G.lock);
+  while (G.next == G.nfiles && !G.walked)
+    pthread_cond_wait(&G.more, &G.lock);
+  char *path = G.next < G.nfiles ? G.files[G.next++] : NULL;
+  pthread_mutex_unlock(&G.lock);
+  return path;
+}
+
+// dir is "" for the top directory, otherwise a relative path ending in '/'.
+// Symlinks are not followed, so the walk cannot loop.
+void grepWalk(const char *dir) {
+  DIR *d = opendir(*dir ? dir : ".");
+  if (!d) return;
+  size_t mark = G.nrules;
+  grepLoadIgnore(dir);
+  struct dirent *de;
+  while ((de = readdir(d)) && !feedCancelled()) {
+    const char *name = de->d_name;
+    if (!strcmp(name, ".") || !strcmp(name, "..") || !strcmp(name, ".git"))
+      continue;
+    size_t relsize = strlen(dir) + strlen(name) + 2;
+    char *rel = malloc(relsize);
+    if (!rel) die("malloc");
+    snprintf(rel, relsize, "%s%s", dir, name);
+    int type = de->d_type;
+    if (type == DT_UNKNOWN) {
+      struct stat st;
+      if (lstat(rel, &st) == 0)
+        type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG
+                                                                   : DT_UNKNOWN;
+    }
+    if (type == DT_DIR && !grepIgnored(rel, name, 1)) {
+      strcat(rel, "/");
+      grepWalk(rel);
+    } else if (type == DT_REG && !grepIgnored(rel, name, 0)) {
+      grepQueue(rel);
+      rel = NULL;
+    }
+    free(rel);
+  }
+  closedir(d);
+  while (G.nrules > mark) {
+    G.nrules--;
+    free(G.rules[G.nrules].base);
+    free(G.rules[G.nrules].pat);
+  }
+}
+
+void *grepWalkerThread(void *arg) {
+  (void)arg;
+  grepWalk("");
+  pthread_mutex_lock(&G.lock);
+  G.walked = 1;
+  pthread_cond_broadcast(&G.more);
+  pthread_mutex_unlock(&G.lock);
+  feedProducerDone();
+  return NULL;
+}
+
+void grepEmit(char **out, size_t *len, size_t *cap, const char *path,
+              size_t lineno, const char *text, size_t textlen) {
+  if (textlen > CAX_GREP_LINE_MAX) textlen = CAX_GREP_LINE_MAX;
+  while (textlen > 0 && text[textlen - 1] == '\r') textlen--;
+  size_t need = strlen(path) + textlen + 32;
+  if (*len + need > *cap) {
+    while (*len + need > *cap) *cap = *cap ? *cap * 2 : 65536;
+    *out = realloc(*out, *cap);
+  }
+  *len += sprintf(&(*out)[*len], "%s:%zu:", path, lineno);
+  memcpy(&(*out)[*len], text, textlen);
+  *len += textlen;
+  (*out)[(*len)++] = '\n';
+}
+
+// Searches one file, appending its hits to out. Returns the number of hits.
+// Small files go through the worker's scratch buffer, since mapping and
+// unmapping them costs more than copying.
+size_t grepFile(const char *path, regex_t *re, char *scratch, char **out,
+                size_t *len, size_t *cap) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) return 0;
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size == 0) {
+    close(fd);
+    return 0;
+  }
+  size_t size = st.st_size;
+  char *data;
+  int mapped = size > CAX_GREP_READ_MAX;
+  if (mapped) {
+    data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return 0;
+    madvise(data, size, MADV_SEQUENTIAL);
+  } else {
+    ssize_t n;
+    size_t got = 0;
+    while (got < size && (n = read(fd, scratch + got, size - got)) > 0)
+      got += n;
+    close(fd);
+    size = got;
+    data = scratch;
+  }
+
+  size_t hits = 0;
+  size_t probe = size < CAX_GREP_BINARY_PROBE ? size : CAX_GREP_BINARY_PROBE;
+  if (!memchr(data, '\0', probe)) {
+    // pos is always the start of a line; lines before counted are numbered
+    size_t pos = 0, counted = 0, lineno = 1;
+    while (pos < size) {
+      size_t at;
+      if (re) {
+        regmatch_t m;
+        m.rm_so = pos;
+        m.rm_eo = size;
+        if (regexec(re, data, 1, &m, REG_STARTEND) != 0) break;
+        at = m.rm_so;
+      } else {
+        char *p = memmem(data + pos, size - pos, G.pat, G.patlen);
+        if (!p) break;
+        at = p - data;
+      }
+      const char *q = data + counted;
+      while ((q = memchr(q, '\n', data + at - q))) {
+        lineno++;
+        q++;
+      }
+      char *bol = memrchr(data + pos, '\n', at - pos);
+      size_t start = bol ? (size_t)(bol - data) + 1 : pos;
+      char *eol = memchr(data + at, '\n', size - at);
+      size_t end = eol ? (size_t)(eol - data) : size;
+      grepEmit(out, len, cap, path, lineno, data + start, end - start);
+      hits++;
+      pos = counted = end + 1;
+      lineno++;
+    }
+  }
+  if (mapped) munmap(data, size);
+  return hits;
+}
+
+void *grepWorkerThread(void *arg) {
+  (void)arg;
+  regex_t re;
+  // the pattern was checked before the search started; every worker has
+  // its own copy, since regexec serializes on a shared regex_t
+  if (G.regex) regcomp(&re, G.pat, REG_EXTENDED | REG_NEWLINE);
+  char *scratch = malloc(CAX_GREP_READ_MAX);
+  char *out = NULL;
+  size_t len = 0, cap = 0;
+  char *path;
+  while ((path = grepNext()) && !feedCancelled()) {
+    size_t hits = grepFile(path, G.regex ? &re : NULL, scratch, &out, &len,
+                           &cap);
+    if (hits) {
+      feedPush(out, len);
+      len = 0;
+      pthread_mutex_lock(&G.lock);
+      G.matches += hits;
+      G.hitfiles++;
+      pthread_mutex_unlock(&G.lock);
+    }
+  }
+  free(out);
+  free(scratch);
+  if (G.regex) regfree(&re);
+  feedProducerDone();
+  return NULL;
+}
+
+// Runs on the main thread once the last worker is gone
+void grepDone() {
+  editorSetStatusMessage("%zu matches in %zu files (%zu searched, %.2fs)",
+                         G.matches, G.hitfiles, G.nfiles,
+                         (traceNow() - G.start) / 1e9);
+}
+
+void grepReset() {
+  for (size_t j = 0; j < G.nfiles; j++) free(G.files[j]);
+  free(G.files);
+  free(G.pat);
+  G.files = NULL;
+  G.nfiles = G.cap = G.next = 0;
+  G.walked = 0;
+  G.pat = NULL;
+  G.matches = G.hitfiles = 0;
+}
+
+void grepStart(const char *query) {
+  size_t len = strlen(query);
+  int regex = len > 2 && query[0] == '/' && query[len - 1] == '/';
+  if (regex) {
+    regex_t re;
+    char *body = strndup(query + 1, len - 2);
+    int err = regcomp(&re, body, REG_EXTENDED | REG_NEWLINE);
+    free(body);
+    if (err) {
+      char msg[64];
+      regerror(err, &re, msg, sizeof(msg));
+      editorSetStatusMessage("Bad regex: %s", msg);
+      return;
+    }
+    regfree(&re);
+  }
+
+  if (F.active) feedCancel();
+  editorCloseBuffer();
+  E.grep_results = 1;
+  char name[64];
+  snprintf(name, sizeof(name), "[grep: %s]", query);
+  feedStart(name, 1, grepDone);
+
+  // the previous search is over now, its producers have all left
+  grepReset();
+  G.regex = regex;
+  G.pat = regex ? strndup(query + 1, len - 2) : strdup(query);
+  G.patlen = strlen(G.pat);
+  G.start = traceNow();
+
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n < 1) n = 1;
+  if (n > CAX_GREP_MAX_WORKERS) n = CAX_GREP_MAX_WORKERS;
+  pthread_t tid;
+  feedAddProducer();
+  if (pthread_create(&tid, NULL, grepWalkerThread, NULL) != 0)
+    die("pthread_create");
+  pthread_detach(tid);
+  for (long i = 0; i < n; i++) {
+    feedAddProducer();
+    if (pthread_create(&tid, NULL, grepWorkerThread, NULL) != 0)
+      die("pthread_create");
+    pthread_detach(tid);
+  }
+}
+
+// Brings the results of the last search back
+void grepRestore() {
+  if (!grep_saved) {
+    editorSetStatusMessage("No earlier grep results");
+    return;
   }
-  editorRowInsertChar(&E.row[E.cy] , E.cx , c);
-  E.cx++;
+  editorCloseBuffer();
+  E.undo_suspended++;
+  size_t start = 0;
+  while (start < grep_saved_len) {
+    char *nl = memchr(&grep_saved[start], '\n', grep_saved_len - start);
+    size_t linelen = (nl ? (size_t)(nl - grep_saved) : grep_saved_len) - start;
+    editorInsertRow(E.numrows, &grep_saved[start], linelen);
+    editorColdMaybeSweep();
+    start += linelen + 1;
+  }
+  E.undo_suspended--;
+  E.dirty = 0;
+  E.grep_results = 1;
+  free(F.name);
+  F.name = strdup(grep_saved_name);
+  E.cy = grep_saved_cy < E.numrows ? grep_saved_cy : 0;
 }
 
+// Opens the hit under the cursor. Returns 0 if the row is not a hit.
+int grepOpenHit() {
+  if (E.cy >= E.numrows) return 0;
+  erow *row = editorRow(E.cy);
+  char *end = row->chars + row->size;
+  char *colon = row->chars;
+  size_t lineno = 0;
+  // paths may contain ':', the first ":<digits>:" ends the path
+  while ((colon = memchr(colon, ':', end - colon))) {
+    char *p = colon + 1;
+    lineno = 0;
+    while (p < end && isdigit((unsigned char)*p)) lineno = lineno * 10 + (*p++ - '0');
+    if (p > colon + 1 && p < end && *p == ':') break;
+    colon++;
+  }
+  if (!colon || lineno == 0) return 0;
+
+  char *path = strndup(row->chars, colon - row->chars);
+  struct stat st;
+  if (stat(path, &st) == -1 || !S_ISREG(st.st_mode)) {
+    editorSetStatusMessage("Can't open %s", path);
+    free(path);
+    return 1;
+  }
+  // whatever was found so far stays in the results
+  if (F.active) feedCancel();
+  free(grep_saved);
+  free(grep_saved_name);
+  grep_saved = editorRowsToString(&grep_saved_len);
+  grep_saved_name = strdup(F.name ? F.name : "[grep]");
+  grep_saved_cy = E.cy;
+
+  editorCloseBuffer();
+  editorOpen(path);
+  E.cy = lineno - 1 < E.numrows ? lineno - 1 : E.numrows;
+  if (E.cy > (size_t)E.screenRows / 2) E.rowoff = E.cy - E.screenRows / 2;
+  editorSetStatusMessage("%s:%zu (Ctrl-G Enter goes back to the results)",
+                         path, lineno);
+  free(path);
+  return 1;
+}
 
-void editorDelChar() {
-  if (E.cy == E.numrows) return;
-  if (E.cx == 0 && E.cy == 0) return;
-  erow *row = &E.row[E.cy];
-  if (E.cx > 0) {
-    editorRowDelChar(row, E.cx - 1);
-    E.cx--;
-  } else {
-    E.cx = E.row[E.cy - 1].size;
-    editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-    editorDelRow(E.cy);
-    E.cy--;
+void editorGrep() {
+  if (F.active && !F.cancellable) {
+    editorSetStatusMessage("Can't grep while input is still being read");
+    return;
   }
+  // the results buffer is thrown away freely, anything else is not
+  if (!E.grep_results && (E.dirty || (!E.filename && E.numrows))) {
+    editorSetStatusMessage("Save the buffer first (Ctrl-S)");
+    return;
+  }
+  char *query = editorPromptEx(
+      "Grep: %s (ESC to cancel, /regex/, Enter for the last results)",
+      NULL, 1);
+  if (!query) return;
+  if (*query)
+    grepStart(query);
+  else
+    grepRestore();
+  free(query);
 }
 
-/*** File I/O ***/
+/*** batch ***/
+
+/*
+ * cax --batch SCRIPT FILE... runs a small script over every file without a
+ * terminal. Each line of the script is one command, applied to the whole
+ * file in order:
+ *
+ *   s/pattern/replacement/[r]   replace every match
+ *   d/pattern/[r]               delete every line with a match
+ *
+ * Any character may stand in for '/', and a backslash escapes it. The r
+ * flag makes the pattern an extended regular expression, with \0-\9 in the
+ * replacement as in Ctrl-R. Since E is global, files are spread over one
+ * worker process per core; each loads its file with rows neither rendered
+ * nor highlighted and cooling under the memory budget as usual.
+ */
+
+struct batchCommand {
+  int op;
+  struct replaceSpec rs;
+};
 
-char *editorRowsToString(int *buflen){
-  int totlen = 0;
-  int j;
-  for (j = 0; j < E.numrows; j++) 
-    totlen += E.row[j].size + 1;
-  
-  *buflen = totlen;
-  char *buf = malloc(totlen);
-  char *p = buf;
-  for (j = 0; j < E.numrows; j++) {
-    memcpy(p, E.row[j].chars, E.row[j].size);
-    p += E.row[j].size;
-    *p = '\n';
-    p++;
-  }
+// Filled in by the worker that handled the file, read by the parent
+struct batchResult {
+  int started;
+  int done;
+  int err;                    // errno of a failure, or 0
+  int changed;
+  off_t bytes;
+  size_t lines;
+  size_t replaced;
+  size_t deleted;
+};
 
-  return buf;
-}
+struct batchShared {
+  size_t next;                // next file to hand out
+  struct batchResult res[];
+};
 
-void editorOpen(char *filename) {
-  free(E.filename);
-  E.filename = strdup(filename);
-  FILE *fp = fopen(filename, "r");
+// Returns the text up to the next unescaped delim and moves *p past it
+char *batchField(char **p, char delim) {
+  char *out = malloc(strlen(*p) + 1);
+  size_t len = 0;
+  char *s = *p;
+  while (*s && *s != delim) {
+    if (s[0] == '\\' && s[1] == delim) s++;
+    out[len++] = *s++;
+  }
+  if (*s != delim) {
+    free(out);
+    return NULL;
+  }
+  out[len] = '\0';
+  *p = s + 1;
+  return out;
+}
 
-  editorSelectSyntaxHighlight();
+int batchParseLine(char *line, struct batchCommand *cmd) {
+  int op = line[0];
+  char delim = line[1];
+  if ((op != 's' && op != 'd') || !delim) return -1;
+  char *p = &line[2];
+  char *pat = batchField(&p, delim);
+  char *rep = op == 's' ? batchField(&p, delim) : strdup("");
+  int regex = (*p == 'r');
+  if (regex) p++;
+  int err = -1;
+  if (pat && rep && !*p && *pat) {
+    cmd->op = op;
+    err = replaceCompileAs(&cmd->rs, pat, rep, regex);
+  }
+  free(pat);
+  free(rep);
+  return err;
+}
 
-  if (!fp) die("fopen");
+// Returns the number of commands, or -1 after reporting an error
+int batchParseScript(const char *path, struct batchCommand **cmds) {
+  FILE *fp = fopen(path, "r");
+  if (!fp) {
+    fprintf(stderr, "cax: %s: %s\n", path, strerror(errno));
+    return -1;
+  }
   char *line = NULL;
   size_t linecap = 0;
-  ssize_t linelen;
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    while (linelen > 0 && (line[linelen - 1] == '\n' ||
-                           line[linelen - 1] == '\r'))
-      linelen--;
-    editorInsertRow(E.numrows, line, linelen);
+  ssize_t len;
+  int n = 0, lineno = 0;
+  *cmds = NULL;
+  while ((len = getline(&line, &linecap, fp)) != -1) {
+    lineno++;
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+      line[--len] = '\0';
+    if (len == 0 || line[0] == '#') continue;
+    *cmds = realloc(*cmds, sizeof(struct batchCommand) * (n + 1));
+    E.statusmsg[0] = '\0';
+    if (batchParseLine(line, &(*cmds)[n]) == -1) {
+      fprintf(stderr, "cax: %s:%d: %s\n", path, lineno,
+              E.statusmsg[0] ? E.statusmsg : "bad command");
+      n = -1;
+      break;
+    }
+    n++;
   }
   free(line);
   fclose(fp);
-  E.dirty = 0;
+  return n;
 }
 
-
-void editorSave(){
-  if(E.filename == NULL){
-    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-    if (E.filename == NULL) {
-      editorSetStatusMessage("Save aborted");
-      return;
-    }
-    editorSelectSyntaxHighlight();
-  }
-  int len;
-  char *buf = editorRowsToString(&len);
-
-int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-  if (fd != -1) {
-    if (ftruncate(fd, len) != -1) {
-      if (write(fd, buf, len) == len) {
-        close(fd);
-        free(buf);
-        E.dirty = 0;
-        editorSetStatusMessage("%d bytes written to disk", len);
-        return;
-      }
+// Deletes every row with a match in one pass. Returns how many went.
+size_t batchDeleteMatching(struct replaceSpec *rs) {
+  size_t kept = 0;
+  for (size_t j = 0; j < E.numrows; j++) {
+    erow *row = &E.row[j];
+    if (replaceFindAll(rs, editorRowPeek(row), row->size)) {
+      editorFreeRow(row);
+      continue;
     }
-    close(fd);
+    row->idx = kept;
+    E.row[kept++] = *row;
   }
-  free(buf);
-  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+  size_t deleted = E.numrows - kept;
+  E.numrows = kept;
+  rowIndexReset();
+  E.cold_hand = 0;
+  if (deleted) E.dirty++;
+  return deleted;
 }
 
-/*** find ***/
-
-void editorFindCallback(char *query, int key) {
-  static int last_match = -1;
-  static int direction = 1;
-
-  // Restoring syntax highlighting after search
-  static int saved_hl_line;
-  static char *saved_hl = NULL;
-  if (saved_hl) {
-    memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-    free(saved_hl);
-    saved_hl = NULL;
+void batchRunFile(char *path, struct batchCommand *cmds, int ncmds,
+                  struct batchResult *r) {
+  struct stat st;
+  if (stat(path, &st) == -1 || access(path, R_OK | W_OK) == -1) {
+    r->err = errno;
+    return;
   }
-
-  if (key == '\r' || key == '\x1b') {
-    last_match = -1;
-    direction = 1;
+  if (!S_ISREG(st.st_mode)) {
+    r->err = EINVAL;
     return;
-  } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-    direction = 1;
-  } else if (key == ARROW_LEFT || key == ARROW_UP) {
-    direction = -1;
-  } else {
-    last_match = -1;
-    direction = 1;
   }
-  if (last_match == -1) direction = 1;
-  int current = last_match;
-  int i;
-  for (i = 0; i < E.numrows; i++) {
-    current += direction;
-    if (current == -1) current = E.numrows - 1;
-    else if (current == E.numrows) current = 0;
-    erow *row = &E.row[current];
-    char *match = strstr(row->render, query);
-    if (match) {
-      last_match = current;
-      E.cy = current;
-      E.cx = editorRowRxToCx(row, match - row->render);
-      E.rowoff = E.numrows;
-
-      saved_hl_line = current;
-      saved_hl = malloc(row->rsize);
-      memcpy(saved_hl, row->hl, row->rsize);
-      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-
-      break;
+  editorOpen(path);
+  r->bytes = st.st_size;
+  r->lines = E.numrows;
+  // Nothing is ever undone headless, so don't keep the old text of every row.
+  E.undo_suspended++;
+  for (int i = 0; i < ncmds; i++) {
+    if (cmds[i].op == 's') {
+      size_t rows;
+      r->replaced += editorReplaceAll(&cmds[i].rs, &rows);
+    } else {
+      r->deleted += batchDeleteMatching(&cmds[i].rs);
     }
   }
+  E.undo_suspended--;
+  if (E.dirty) {
+    editorSave();
+    if (E.dirty) r->err = errno ? errno : EIO;
+    else r->changed = 1;
+  }
+  editorCloseBuffer();
 }
 
-void editorFind() {
-  int saved_cx = E.cx;
-  int saved_cy = E.cy;
-  int saved_coloff = E.coloff;
-  int saved_rowoff = E.rowoff;
-  char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)",
-                             editorFindCallback);
-  if (query) {
-    free(query);
-  } else {
-    E.cx = saved_cx;
-    E.cy = saved_cy;
-    E.coloff = saved_coloff;
-    E.rowoff = saved_rowoff;
+int batchMain(const char *script, char **files, int nfiles) {
+  struct batchCommand *cmds;
+  int ncmds = batchParseScript(script, &cmds);
+  if (ncmds == -1) return 1;
+
+  size_t shsize = sizeof(struct batchShared) +
+                  sizeof(struct batchResult) * nfiles;
+  struct batchShared *sh = mmap(NULL, shsize, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (sh == MAP_FAILED) die("mmap");
+  memset(sh, 0, shsize);
+
+  long nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nworkers < 1) nworkers = 1;
+  if (nworkers > nfiles) nworkers = nfiles;
+  uint64_t start = traceNow();
+  fflush(NULL);
+  for (long w = 0; w < nworkers; w++) {
+    pid_t pid = fork();
+    if (pid == -1) die("fork");
+    if (pid == 0) {
+      size_t k;
+      while ((k = __sync_fetch_and_add(&sh->next, 1)) < (size_t)nfiles) {
+        struct batchResult *r = &sh->res[k];
+        r->started = 1;
+        batchRunFile(files[k], cmds, ncmds, r);
+        r->done = 1;
+      }
+      _exit(0);
+    }
+  }
+  while (wait(NULL) > 0 || errno == EINTR);
+  double secs = (traceNow() - start) / 1e9;
+
+  struct batchResult sum = { 0, 0, 0, 0, 0, 0, 0, 0 };
+  int failed = 0;
+  for (int k = 0; k < nfiles; k++) {
+    struct batchResult *r = &sh->res[k];
+    if (!r->done || r->err) {
+      fprintf(stderr, "cax: %s: %s\n", files[k],
+              r->done ? strerror(r->err) : "worker failed");
+      failed++;
+      continue;
+    }
+    sum.changed += r->changed;
+    sum.bytes += r->bytes;
+    sum.lines += r->lines;
+    sum.replaced += r->replaced;
+    sum.deleted += r->deleted;
   }
+  printf("%d files (%d changed, %d failed), %zu lines, %.1f MB in %.2fs: "
+         "%.1f MB/s, %.0f files/s\n",
+         nfiles, sum.changed, failed, sum.lines, sum.bytes / 1e6, secs,
+         secs > 0 ? sum.bytes / 1e6 / secs : 0.0,
+         secs > 0 ? nfiles / secs : 0.0);
+  printf("%zu replacements, %zu lines deleted, %ld workers\n",
+         sum.replaced, sum.deleted, nworkers);
+  munmap(sh, shsize);
+  for (int i = 0; i < ncmds; i++) replaceFree(&cmds[i].rs);
+  free(cmds);
+  return failed ? 1 : 0;
 }
 
 /*** Append Buffer ***/
@@ -781,7 +7308,7 @@ void editorFind() {
 struct abuf
 {
   char *b;
-  int len;
+  size_t len;
 };
 
 // This is the constructor for our append buffer
@@ -790,7 +7317,7 @@ struct abuf
     NULL, 0       \
   }
 
-void abAppend(struct abuf *ab, const char *s, int len)
+void abAppend(struct abuf *ab, const char *s, size_t len)
 {
 
   // this will reallcoate the buffer space according to the input
@@ -799,16 +7326,566 @@ void abAppend(struct abuf *ab, const char *s, int len)
   if (new == NULL)
     return;
 
-  // we used memcpy to the append the new input in prev input
-  memcpy(&new[ab->len], s, len);
-  ab->b = new;
-  ab->len += len;
+  // we used memcpy to the append the new input in prev input
+  memcpy(&new[ab->len], s, len);
+  ab->b = new;
+  ab->len += len;
+}
+
+// this will free the buffer space
+void abFree(struct abuf *ab)
+{
+  free(ab->b);
+}
+
+/*** Soft wrap ***/
+
+/*
+ * With E.wrap set, a row takes as many screen lines as it needs. Each row
+ * remembers its number of visual lines and the layout generation it was
+ * computed for; the row index sums them so that visual and logical lines
+ * map to each other in O(log n). Rows are only laid out
+ * when they are drawn or edited, and until then count as one line. A
+ * resize bumps the generation, so the whole file goes stale at once and
+ * only what ends up on screen gets laid out again.
+ */
+
+struct wrapPos {
+  size_t j;                   // byte in chars
+  size_t line, col;           // visual line and column it is drawn at
+  size_t rx;                  // column in the unwrapped row, for tabs
+};
+
+size_t editorWrapWidth() {
+  return E.screenCols > 0 ? E.screenCols : 1;
+}
+
+// Moves p to where the character at p->j is drawn: one that does not fit
+// on the current visual line starts the next one
+void wrapPlace(erow *row, struct wrapPos *p, size_t width) {
+  size_t w = 1;
+  if (p->j < row->size && row->chars[p->j] != '\t') {
+    size_t n;
+    w = utf8Cols(&row->chars[p->j], row->size - p->j, &n);
+  }
+  if (p->col > 0 && p->col + w > width) {
+    p->line++;
+    p->col = 0;
+  }
+}
+
+// Steps p over the character it was placed on. Tabs are drawn as blanks,
+// which break across lines one by one like any other character.
+void wrapAdvance(erow *row, struct wrapPos *p, size_t width) {
+  if (row->chars[p->j] == '\t') {
+    size_t k = CAX_TAB_STOP - p->rx % CAX_TAB_STOP;
+    p->rx += k;
+    p->col++;
+    while (--k) {
+      if (p->col + 1 > width) {
+        p->line++;
+        p->col = 0;
+      }
+      p->col++;
+    }
+    p->j++;
+  } else {
+    size_t n;
+    size_t w = utf8Cols(&row->chars[p->j], row->size - p->j, &n);
+    p->col += w;
+    p->rx += w;
+    p->j += n;
+  }
+}
+
+// Rows of plain ASCII without tabs wrap every width bytes
+int wrapSimple(erow *row, size_t len) {
+  return utf8AsciiPrefix(row->chars, len) == len &&
+         memchr(row->chars, '\t', len) == NULL;
+}
+
+// Visual line of byte cx of the row, and the column it is drawn at
+size_t editorWrapLocate(erow *row, size_t cx, size_t *col) {
+  size_t width = editorWrapWidth();
+  if (wrapSimple(row, cx)) {
+    *col = cx % width;
+    return cx / width;
+  }
+  struct wrapPos p = { 0, 0, 0, 0 };
+  while (p.j < cx) {
+    wrapPlace(row, &p, width);
+    wrapAdvance(row, &p, width);
+  }
+  wrapPlace(row, &p, width);
+  *col = p.col;
+  return p.line;
+}
+
+// Byte of the row drawn at or just before col on visual line line
+size_t editorWrapCxAt(erow *row, size_t line, size_t col) {
+  size_t width = editorWrapWidth();
+  if (wrapSimple(row, row->size)) {
+    size_t cx = line * width + (col < width ? col : width - 1);
+    return cx < row->size ? cx : row->size;
+  }
+  struct wrapPos p = { 0, 0, 0, 0 };
+  size_t best = 0;
+  while (1) {
+    wrapPlace(row, &p, width);
+    if (p.line > line || (p.line == line && p.col > col)) break;
+    best = p.j;
+    if (p.j >= row->size) break;
+    wrapAdvance(row, &p, width);
+  }
+  return best;
+}
+
+size_t wrapCount(erow *row) {
+  if (row->hidden) return 0;
+  return row->wrapgen == E.wrap_gen ? row->wraplines : 1;
+}
+
+// Visual lines above row at
+size_t editorWrapPrefix(size_t at) {
+  return rowIndexBefore(at).lines;
+}
+
+// Row holding visual line v, and the line within that row
+size_t editorWrapFind(size_t v, size_t *line) {
+  return rowIndexNth(v, 0, line);
+}
+
+void editorWrapRelayout(erow *row) {
+  size_t col;
+  size_t old = wrapCount(row);
+  row->wraplines = editorWrapLocate(row, row->size, &col) + 1;
+  row->wrapgen = E.wrap_gen;
+  rowIndexSetLines(row->idx, old, wrapCount(row));
+}
+
+// Visual lines of row at, laying it out if it is not yet
+size_t editorWrapLines(size_t at) {
+  if (E.row[at].hidden) return 0;
+  if (E.row[at].wrapgen != E.wrap_gen) editorWrapRelayout(editorRow(at));
+  return E.row[at].wraplines;
+}
+
+// Makes every layout stale, after a resize or when wrap is switched on
+void editorWrapInvalidate() {
+  E.wrap_gen++;
+  rowIndexStaleLines();
+}
+
+// Keeps the cursor's visual line on screen; E.rx becomes its column
+void editorWrapScroll() {
+  E.coloff = 0;
+  size_t line = 0;
+  if (E.cy < E.numrows) line = editorWrapLocate(editorRow(E.cy), E.cx, &E.rx);
+  if (E.rowoff < E.numrows && E.wrapoff >= editorWrapLines(E.rowoff))
+    E.wrapoff = 0;
+  if (E.cy < E.rowoff || (E.cy == E.rowoff && line < E.wrapoff)) {
+    E.rowoff = E.cy;
+    E.wrapoff = E.cy < E.numrows ? line : 0;
+    return;
+  }
+  // lay out what could end up on screen above the cursor, so that the
+  // prefix sums are exact where they are used
+  size_t above = line;
+  for (size_t at = E.cy; at > E.rowoff && above < (size_t)E.screenRows;) {
+    at = foldPrev(at);
+    above += editorWrapLines(at);
+  }
+  size_t v = editorWrapPrefix(E.cy) + line;
+  size_t top = editorWrapPrefix(E.rowoff) + E.wrapoff;
+  if (v >= top + E.screenRows) {
+    E.rowoff = editorWrapFind(v - E.screenRows + 1, &E.wrapoff);
+  }
+}
+
+// Screen line the cursor is on, after editorWrapScroll
+size_t editorWrapScreenY() {
+  size_t line = 0, col;
+  if (E.cy < E.numrows) line = editorWrapLocate(editorRow(E.cy), E.cx, &col);
+  return editorWrapPrefix(E.cy) + line - editorWrapPrefix(E.rowoff) - E.wrapoff;
+}
+
+// Moves the cursor one visual line up or down, keeping its column
+void editorWrapMoveCursor(int key) {
+  size_t col;
+  if (E.cy >= E.numrows) {
+    if (key == ARROW_UP && E.cy > 0) {
+      E.cy = foldPrev(E.cy);
+      E.cx = editorWrapCxAt(editorRow(E.cy), editorWrapLines(E.cy) - 1, 0);
+    }
+    return;
+  }
+  size_t line = editorWrapLocate(editorRow(E.cy), E.cx, &col);
+  if (key == ARROW_UP) {
+    if (line > 0) {
+      E.cx = editorWrapCxAt(editorRow(E.cy), line - 1, col);
+    } else if (E.cy > 0) {
+      E.cy = foldPrev(E.cy);
+      E.cx = editorWrapCxAt(editorRow(E.cy), editorWrapLines(E.cy) - 1, col);
+    }
+  } else {
+    if (line + 1 < editorWrapLines(E.cy)) {
+      E.cx = editorWrapCxAt(editorRow(E.cy), line + 1, col);
+    } else {
+      E.cy = foldNext(E.cy);
+      E.cx = E.cy < E.numrows ? editorWrapCxAt(editorRow(E.cy), 0, col) : 0;
+    }
+  }
+}
+
+void editorToggleWrap() {
+  E.wrap = !E.wrap;
+  E.coloff = E.wrapoff = 0;
+  if (E.wrap) editorWrapInvalidate();
+  editorSetStatusMessage("Soft wrap %s", E.wrap ? "on" : "off");
+}
+
+/*** Completion ***/
+
+/*
+ * Ctrl-P completes the identifier before the cursor from the word index.
+ * The best CAX_COMPLETIONS candidates show in a popup above the message
+ * bar; the arrow keys pick one and Enter or Tab inserts it. Typing and
+ * backspacing narrow the list as they go, anything else closes it.
+ */
+
+#define CAX_COMPLETIONS 8
+
+struct completion {
+  int active;
+  size_t at;                  // where the prefix starts in the cursor row
+  size_t n;
+  size_t sel;
+  uint32_t items[CAX_COMPLETIONS];
+};
+
+struct completion C;
+
+// Looks the prefix before the cursor up again; closes the popup when
+// nothing matches it
+void completionUpdate() {
+  C.active = 0;
+  if (E.cy >= E.numrows || E.ncursors) return;
+  erow *row = editorRow(E.cy);
+  size_t at = E.cx;
+  while (at > 0 && wordChar(row->chars[at - 1])) at--;
+  if (at == E.cx || isdigit((unsigned char)row->chars[at])) return;
+  C.at = at;
+  C.n = wordIndexQuery(&row->chars[at], E.cx - at, C.items, CAX_COMPLETIONS);
+  if (C.sel >= C.n) C.sel = 0;
+  C.active = C.n > 0;
+}
+
+void editorComplete() {
+  C.sel = 0;
+  completionUpdate();
+  if (!C.active) editorSetStatusMessage("No completions");
+}
+
+// Handles a key while the popup is open. Returns 0 when the key closed it
+// and still has to be processed.
+int editorCompletionKey(int c) {
+  switch (c) {
+    case ARROW_UP:
+      C.sel = (C.sel + C.n - 1) % C.n;
+      return 1;
+    case ARROW_DOWN:
+    case CTRL_KEY('p'):
+      C.sel = (C.sel + 1) % C.n;
+      return 1;
+    case '\r':
+    case '\t': {
+      struct wordEntry *e = &W.words[C.items[C.sel]];
+      size_t plen = E.cx - C.at;
+      C.active = 0;
+      // the index may move under us as the row changes
+      char *rest = malloc(e->len - plen);
+      size_t n = e->len - plen;
+      memcpy(rest, e->word + plen, n);
+      for (size_t i = 0; i < n; i++) editorInsertChar((unsigned char)rest[i]);
+      free(rest);
+      return 1;
+    }
+    case '\x1b':
+      C.active = 0;
+      return 1;
+    case BACKSPACE:
+    case CTRL_KEY('h'):
+      editorDelChar();
+      completionUpdate();
+      return 1;
+  }
+  if (c < 256 && wordChar(c)) {
+    editorInsertChar(c);
+    completionUpdate();
+    return 1;
+  }
+  C.active = 0;
+  return 0;
+}
+
+void editorDrawCompletion(struct abuf *ab) {
+  if (!C.active) return;
+  int width = 0;
+  for (size_t i = 0; i < C.n; i++) {
+    struct wordEntry *e = &W.words[C.items[i]];
+    int w = 0;
+    for (size_t j = 0, n; j < e->len; j += n)
+      w += utf8Cols(&e->word[j], e->len - j, &n);
+    if (w > width) width = w;
+  }
+  if (width > E.screenCols - 2) width = E.screenCols - 2;
+
+  // the prefix lines up with the word it completes
+  int y = E.wrap ? (int)editorWrapScreenY()
+                 : (int)(foldVisibleBefore(E.cy) - foldVisibleBefore(E.rowoff));
+  int x = (int)editorRowCxToRx(editorRow(E.cy), C.at) - (int)E.coloff;
+  if (x + width + 2 > E.screenCols) x = E.screenCols - width - 2;
+  if (x < 0) x = 0;
+  int top = E.screenRows - (int)C.n;
+  if (top <= y) top = y >= (int)C.n ? y - (int)C.n : y + 1;
+
+  for (size_t i = 0; i < C.n && top + (int)i < E.screenRows; i++) {
+    struct wordEntry *e = &W.words[C.items[i]];
+    char buf[48];
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH%s ", top + (int)i + 1,
+             x + E.gutter + 1,
+             i == C.sel ? "\x1b[30;46m" : "\x1b[7m");
+    abAppend(ab, buf, strlen(buf));
+    // cut to the popup width at a character boundary
+    size_t len = 0;
+    int cols = 0;
+    while (len < e->len) {
+      size_t n;
+      int w = utf8Cols(&e->word[len], e->len - len, &n);
+      if (cols + w > width) break;
+      cols += w;
+      len += n;
+    }
+    abAppend(ab, e->word, len);
+    for (; cols <= width; cols++) abAppend(ab, " ", 1);
+    abAppend(ab, "\x1b[m", 3);
+  }
+}
+
+/*** Buffers ***/
+
+/*
+ * Every open file is a buffer. The current one lives in E and in W, D and
+ * J; the others keep their copies of those in B, so switching is a few
+ * struct copies. Syntax definitions, the screen, the journal writer and
+ * the memory budget are shared. When idle buffers together hold more than
+ * the budget, the least recently used saved ones are evicted down to
+ * their file name and cursor, and open again, usually from the open
+ * cache, when switched to.
+ */
+
+struct editorBuffer {
+  struct editorConfig e;      // E while the buffer is not current
+  struct wordIndex w;
+  struct editorDiff d;
+  struct journalFile j;
+  int loaded;                 // 0 once evicted: e has only filename and cursor
+  uint64_t used;              // when it was last current
+  size_t resident;            // bytes its rows held when it went idle
+};
+
+struct bufferList {
+  struct editorBuffer *list;
+  size_t n;                   // 0 until a second file is opened
+  size_t cur;
+  uint64_t clock;
+};
+
+struct bufferList B;
+
+// Makes a copy of the current buffer in b
+void bufferStore(struct editorBuffer *b) {
+  b->e = E;
+  b->w = W;
+  b->d = D;
+  journalPark(&b->j);
+  b->loaded = 1;
+  b->used = ++B.clock;
+  b->resident = editorResidentBytes();
+}
+
+// Makes b current; the screen and the settings stay as they are
+void bufferFetch(struct editorBuffer *b) {
+  struct editorConfig keep = E;
+  int on = D.on;
+  E = b->e;
+  E.screenRows = keep.screenRows;
+  E.screenCols = keep.screenCols;
+  E.gutter = keep.gutter;
+  E.wrap = keep.wrap;
+  E.hot_budget = keep.hot_budget;
+  E.max_resident = keep.max_resident;
+  E.headless = keep.headless;
+  memcpy(E.statusmsg, keep.statusmsg, sizeof(E.statusmsg));
+  E.statusmsg_time = keep.statusmsg_time;
+  E.originalTemios = keep.originalTemios;
+  if (!b->loaded) {
+    // evicted: open the file again where the cursor was
+    char *filename = E.filename;
+    size_t cx = E.cx, cy = E.cy, rowoff = E.rowoff, coloff = E.coloff;
+    editorInitBuffer();
+    wordIndexReset();
+    memset(&D, 0, sizeof(D));
+    D.on = on;
+    if (access(filename, F_OK) == 0) {
+      editorOpen(filename);
+      free(filename);
+    } else {
+      // not saved yet, or gone since
+      E.filename = filename;
+      editorSelectSyntaxHighlight();
+      diffRebase();
+    }
+    if (cy <= E.numrows && rowoff <= cy) {
+      E.cy = cy;
+      E.cx = cy < E.numrows && cx <= E.row[cy].size ? cx : 0;
+      E.rowoff = rowoff;
+      E.coloff = coloff;
+    }
+    b->loaded = 1;
+  } else {
+    W = b->w;
+    D = b->d;
+    D.on = on;
+    journalResume(&b->j);
+  }
+  if (!E.wrap) E.wrapoff = 0;
+  editorWrapInvalidate();
+  C.active = 0;
+}
+
+// Frees the current buffer entirely
+void bufferFree() {
+  editorCloseBuffer();
+  free(D.rows);
+  free(D.off);
+  free(D.hash);
+  free(D.buf);
+}
+
+// Evicts idle buffer i down to its file name and cursor
+void bufferEvict(size_t i) {
+  struct editorBuffer *b = &B.list[i];
+  bufferStore(&B.list[B.cur]);
+  bufferFetch(b);
+  openCacheSave();
+  char *filename = strdup(E.filename);
+  size_t cx = E.cx, cy = E.cy, rowoff = E.rowoff, coloff = E.coloff;
+  bufferFree();
+  editorInitBuffer();
+  E.filename = filename;
+  E.cx = cx;
+  E.cy = cy;
+  E.rowoff = rowoff;
+  E.coloff = coloff;
+  b->e = E;
+  b->loaded = 0;
+  b->resident = 0;
+  bufferFetch(&B.list[B.cur]);
+}
+
+// Evicts saved idle buffers, least recently used first, until the idle
+// ones fit in the memory budget
+void bufferEvictIdle() {
+  while (1) {
+    size_t total = 0, victim = (size_t)-1;
+    for (size_t i = 0; i < B.n; i++) {
+      struct editorBuffer *b = &B.list[i];
+      if (i == B.cur || !b->loaded) continue;
+      total += b->resident;
+      if (!b->e.filename || b->e.dirty || b->e.grep_results || b->e.shared)
+        continue;
+      if (victim == (size_t)-1 || b->used < B.list[victim].used) victim = i;
+    }
+    if (total <= E.hot_budget || victim == (size_t)-1) return;
+    bufferEvict(victim);
+  }
+}
+
+int bufferBusy() {
+  if (!F.active) return 0;
+  editorSetStatusMessage("Still reading %s", E.filename);
+  return 1;
+}
+
+void bufferSwitch(size_t i) {
+  if (i == B.cur || bufferBusy()) return;
+  bufferStore(&B.list[B.cur]);
+  B.cur = i;
+  bufferFetch(&B.list[i]);
+  bufferEvictIdle();
+}
+
+// Adds buffers for files, not loaded until they are switched to
+void bufferAdd(char **files, size_t n) {
+  if (B.n == 0) {
+    B.list = calloc(1, sizeof(struct editorBuffer));
+    B.n = 1;
+    B.cur = 0;
+  }
+  B.list = realloc(B.list, sizeof(struct editorBuffer) * (B.n + n));
+  for (size_t i = 0; i < n; i++) {
+    struct editorBuffer *b = &B.list[B.n + i];
+    memset(b, 0, sizeof(*b));
+    b->e.filename = strdup(files[i]);
+  }
+  B.n += n;
+}
+
+// Switches to the buffer for filename, opening it in a new one if needed
+void bufferOpen(char *filename) {
+  for (size_t i = 0; i < B.n; i++) {
+    char *name = i == B.cur ? E.filename : B.list[i].e.filename;
+    if (name && !strcmp(name, filename)) {
+      bufferSwitch(i);
+      return;
+    }
+  }
+  if (B.n == 0 && E.filename && !strcmp(E.filename, filename)) return;
+  if (bufferBusy()) return;
+  bufferAdd(&filename, 1);
+  bufferSwitch(B.n - 1);
+}
+
+// Ctrl-O
+void editorOpenPrompt() {
+  char *filename = editorPrompt("Open: %s (ESC to cancel)", NULL);
+  if (!filename) return;
+  bufferOpen(filename);
+  free(filename);
+}
+
+// Alt-Left and Alt-Right
+void editorCycleBuffer(int dir) {
+  if (B.n < 2) return;
+  bufferSwitch((B.cur + B.n + dir) % B.n);
 }
 
-// this will free the buffer space
-void abFree(struct abuf *ab)
-{
-  free(ab->b);
+// Closes the current buffer for the one used before it; returns 0 when it
+// was the last one
+int bufferClose() {
+  if (B.n < 2 || bufferBusy()) return 0;
+  editorSetStatusMessage("Closed %s", E.filename ? E.filename : "[No Name]");
+  bufferFree();
+  memmove(&B.list[B.cur], &B.list[B.cur + 1],
+          sizeof(struct editorBuffer) * (B.n - B.cur - 1));
+  B.n--;
+  size_t next = 0;
+  for (size_t i = 1; i < B.n; i++)
+    if (B.list[i].used > B.list[next].used) next = i;
+  B.cur = next;
+  bufferFetch(&B.list[next]);
+  return 1;
 }
 
 /*** Output ***/
@@ -817,35 +7894,172 @@ void abFree(struct abuf *ab)
 // Vertical and horizontal scroll impelemented here 
 void editorScroll() {
   E.rx = 0;
+  // a jump into a fold opens it
+  if (E.cy < E.numrows && E.row[E.cy].hidden) foldReveal(E.cy);
+  if (E.rowoff < E.numrows && E.row[E.rowoff].hidden) {
+    E.rowoff = foldPrev(E.rowoff);
+    if (E.row[E.rowoff].hidden) foldReveal(E.rowoff);
+  }
+
+  if (E.wrap) {
+    editorWrapScroll();
+    return;
+  }
 
   if (E.cy < E.numrows) {
-    E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+    E.rx = editorRowCxToRx(editorRow(E.cy), E.cx);
   }
 
   if (E.cy < E.rowoff) {
     E.rowoff = E.cy;
   }
-  if (E.cy >= E.rowoff + E.screenRows) {
-    E.rowoff = E.cy - E.screenRows + 1;
+  size_t y = foldVisibleBefore(E.cy);
+  if (y >= foldVisibleBefore(E.rowoff) + E.screenRows) {
+    E.rowoff = foldNth(y - E.screenRows + 1);
   }
   
   if (E.rx < E.coloff) {
-    E.coloff = E.cx;
+    E.coloff = E.rx;
   }
   if (E.rx >= E.coloff + E.screenCols) {
     E.coloff = E.rx - E.screenCols + 1;
   }
 }
 
+// Draws render from byte j on, at most cols columns of it, and returns
+// the byte it stopped at. With ab NULL it only finds that byte. marks are
+// the render offsets of extra cursors, drawn inverted.
+size_t editorDrawRender(struct abuf *ab, erow *row, size_t j, size_t cols,
+                        const size_t *marks) {
+  char *c = row->render;
+  unsigned char *hl = row->hl;
+  size_t n = row->rsize;
+  size_t col = 0, plain = j;
+  int current_color = -1;
+  while (marks && *marks < j) marks++;
+  while (j < n) {
+    // printable ASCII in one color, up to the next mark, goes in one piece
+    if (j >= plain) plain = j + K.plain(&c[j], n - j);
+    if (j < plain && !(marks && *marks == j)) {
+      if (col > 0 && col >= cols) break;
+      size_t end = plain;
+      if (end - j > (cols > col ? cols - col : 1))
+        end = j + (cols > col ? cols - col : 1);
+      if (marks && *marks < end) end = *marks;
+      if (ab) {
+        end = j + K.span((const char *)&hl[j], end - j, hl[j]);
+        int color = hl[j] == HL_NORMAL ? -1 : editorSyntaxToColor(hl[j]);
+        if (color != current_color) {
+          char buf[16];
+          int clen = color == -1
+            ? snprintf(buf, sizeof(buf), "\x1b[39m")
+            : snprintf(buf, sizeof(buf), "\x1b[%dm", color);
+          abAppend(ab, buf, clen);
+          current_color = color;
+        }
+        abAppend(ab, &c[j], end - j);
+      }
+      col += end - j;
+      j = end;
+      continue;
+    }
+    uint32_t cp = (unsigned char)c[j];
+    size_t len = 1;
+    int w = 1;
+    if (cp >= 0x80) {
+      len = utf8Decode(&c[j], n - j, &cp);
+      if (cp != UTF8_INVALID) w = utf8Width(cp);
+    }
+    if (col > 0 && col + w > cols) break;
+    col += w;
+    int mark = marks && *marks == j;
+    if (mark) {
+      marks++;
+      if (ab) abAppend(ab, "\x1b[7m", 4);
+    }
+    if (!ab) {
+    } else if (cp < 0x20 || (cp >= 0x7f && cp < 0xa0) || cp == UTF8_INVALID) {
+      char sym = (cp <= 26) ? '@' + cp : '?';
+      abAppend(ab, "\x1b[7m", 4);
+      abAppend(ab, &sym, 1);
+      abAppend(ab, "\x1b[m", 3);
+      if (current_color != -1) {
+        char buf[16];
+        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
+        abAppend(ab, buf, clen);
+      }
+
+    } else if (hl[j] == HL_NORMAL){ 
+      if (current_color != -1) {
+        abAppend(ab, "\x1b[39m", 5);
+        current_color = -1;
+      }
+      abAppend(ab, &c[j], len);
+    } else {
+      int color = editorSyntaxToColor(hl[j]);
+      if (color != current_color) {
+        current_color = color;
+        char buf[16];
+        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
+        abAppend(ab, buf, clen);
+      }
+      abAppend(ab, &c[j], len);
+    }
+    if (mark && ab) abAppend(ab, "\x1b[27m", 5);
+    j += len;
+  }
+  // a cursor past the end of the row
+  if (ab && j == n && marks && *marks == n && col < cols)
+    abAppend(ab, "\x1b[7m \x1b[27m", 10);
+  return j;
+}
+
+// Draws the gutter for a screen line of row filerow; only the first line
+// of a row gets its mark
+void diffDrawGutter(struct abuf *ab, size_t filerow, int first) {
+  if (!E.gutter) return;
+  const char *mark = "  ";
+  if (!first || !D.based) {
+  } else if (filerow < E.numrows && D.rows[filerow].mark == DIFF_ADDED) {
+    mark = "\x1b[32m+\x1b[39m ";
+  } else if (filerow < E.numrows && D.rows[filerow].mark == DIFF_CHANGED) {
+    mark = "\x1b[33m~\x1b[39m ";
+  } else if (filerow < E.numrows ? D.rows[filerow].del > 0
+                                 : filerow == E.numrows && D.deleted_end) {
+    mark = "\x1b[31m-\x1b[39m ";
+  }
+  abAppend(ab, mark, strlen(mark));
+}
+
+// Drawn after the first row of a fold, when it fits in the columns left
+void foldDrawMarker(struct abuf *ab, size_t hidden, size_t used,
+                    size_t cols) {
+  char buf[32];
+  size_t len = snprintf(buf, sizeof(buf), " +%zu lines", hidden);
+  if (used + len > cols) return;
+  abAppend(ab, "\x1b[36m", 5);
+  abAppend(ab, buf, len);
+  abAppend(ab, "\x1b[39m", 5);
+}
+
 // Drawing ~
 void editorDrawRows(struct abuf *ab)
 {
   int y;
+  // soft wrap: the row, visual line and byte the next screen line shows
+  size_t wraprow = E.rowoff, line = 0, j = 0;
+  size_t filerow = E.rowoff;
+  if (E.wrap && wraprow < E.numrows) {
+    erow *row = editorRow(wraprow);
+    for (; line < E.wrapoff; line++)
+      j = editorDrawRender(NULL, row, j, editorWrapWidth(), NULL);
+  }
   for (y = 0; y < E.screenRows; y++)
   {
 
     // Name printing
-    int filerow = y + E.rowoff;
+    if (E.wrap) filerow = wraprow;
+    diffDrawGutter(ab, filerow, !E.wrap || line == 0);
     if(filerow>= E.numrows){
       if(E.numrows == 0 && y == E.screenRows / 3){
         char welcome[80];
@@ -868,44 +8082,46 @@ void editorDrawRows(struct abuf *ab)
         abAppend(ab, "~", 1);
       }
 
-    } else {
-      int len = E.row[filerow].rsize - E.coloff;
-      if (len < 0) len = 0;
-      if (len > E.screenCols) len = E.screenCols;
-      char *c = &E.row[filerow].render[E.coloff];
-      unsigned char *hl = &E.row[filerow].hl[E.coloff];
-      int current_color = -1;
-      int j;
-      for (j = 0; j < len; j++) {
-          if (iscntrl(c[j])) {
-          char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-          abAppend(ab, "\x1b[7m", 4);
-          abAppend(ab, &sym, 1);
-          abAppend(ab, "\x1b[m", 3);
-          if (current_color != -1) {
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-            abAppend(ab, buf, clen);
-          }
-
-        } else if (hl[j] == HL_NORMAL){ 
-          if (current_color != -1) {
-            abAppend(ab, "\x1b[39m", 5);
-            current_color = -1;
-          }
-          abAppend(ab, &c[j], 1);
-        } else {
-          int color = editorSyntaxToColor(hl[j]);
-          if (color != current_color) {
-            current_color = color;
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-            abAppend(ab, buf, clen);
-          }
-          abAppend(ab, &c[j], 1);
+    } else if (E.wrap) {
+      erow *row = editorRow(filerow);
+      size_t *marks = editorRowMarks(filerow);
+      j = editorDrawRender(ab, row, j, editorWrapWidth(), marks);
+      free(marks);
+      abAppend(ab, "\x1b[39m", 5);
+      if (++line >= editorWrapLines(filerow)) {
+        size_t hidden = foldHiddenAfter(filerow), col;
+        if (hidden) {
+          editorWrapLocate(row, row->size, &col);
+          foldDrawMarker(ab, hidden, col, editorWrapWidth());
         }
+        wraprow = foldNext(wraprow);
+        line = j = 0;
+      }
+    } else {
+      erow *row = editorRow(filerow);
+      char *c = row->render;
+      size_t n = row->rsize;
+      // skip to coloff; the ASCII part goes in one step
+      size_t j = utf8AsciiPrefix(c, n < E.coloff ? n : E.coloff);
+      size_t col = j;
+      while (j < n && col < E.coloff) {
+        size_t len;
+        col += utf8Cols(&c[j], n - j, &len);
+        j += len;
       }
+      // a wide character cut by the left edge leaves blanks
+      for (size_t k = E.coloff; k < col; k++) abAppend(ab, " ", 1);
+      size_t *marks = editorRowMarks(filerow);
+      editorDrawRender(ab, row, j, E.coloff + E.screenCols - col, marks);
+      free(marks);
       abAppend(ab, "\x1b[39m", 5);
+      size_t hidden = foldHiddenAfter(filerow);
+      if (hidden) {
+        size_t end = editorRowCxToRx(row, row->size);
+        size_t used = end > E.coloff ? end - E.coloff : 0;
+        foldDrawMarker(ab, hidden, used, E.screenCols);
+      }
+      filerow = foldNext(filerow);
     }
 
 
@@ -916,18 +8132,47 @@ void editorDrawRows(struct abuf *ab)
   }
 }
 
+// Formats a byte count the way --memory-budget accepts it
+void formatSize(char *buf, size_t bufsize, size_t n) {
+  const char *units = "BKMGT";
+  double v = n;
+  while (v >= 1024 && units[1]) {
+    v /= 1024;
+    units++;
+  }
+  snprintf(buf, bufsize, units[0] == 'B' ? "%.0f%c" : "%.1f%c", v, units[0]);
+}
+
 void editorDrawStatusBar(struct abuf *ab) {
   abAppend(ab, "\x1b[7m", 4);
-  char status[80], rstatus[80];
-  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-    E.filename ? E.filename : "[No Name]", E.numrows,
-    E.dirty ? "(modified)" : "");
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
-    E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
-  if (len > E.screenCols) len = E.screenCols;
+  char status[80], rstatus[128];
+  char mem[48] = "";
+  if (E.max_resident) {
+    char res[16], paged[16];
+    formatSize(res, sizeof(res), editorResidentBytes());
+    formatSize(paged, sizeof(paged), E.paged_bytes);
+    snprintf(mem, sizeof(mem), "res %s paged %s | ", res, paged);
+  }
+  const char *name = E.filename ? E.filename : F.name ? F.name : "[No Name]";
+  char which[32] = "";
+  if (B.n > 1) snprintf(which, sizeof(which), "[%zu/%zu] ", B.cur + 1, B.n);
+  int len = snprintf(status, sizeof(status), "%s%.20s - %zu lines %s%s",
+    which, name, E.numrows, E.dirty ? "(modified)" : "",
+    F.active ? " (reading)" : "");
+  char marked[32] = "";
+  size_t lo, n = E.mark != (size_t)-1 ? editorRangeGet(&lo) : 0;
+  if (n) snprintf(marked, sizeof(marked), "%zu marked | ", n);
+  char diff[64] = "";
+  if (D.on)
+    snprintf(diff, sizeof(diff), "+%zu ~%zu -%zu | ", D.added, D.changed,
+             D.deleted);
+  int rlen = snprintf(rstatus, sizeof(rstatus), "%s%s%s%s | %zu/%zu", marked,
+    diff, mem, E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
+  int cols = E.screenCols + E.gutter;
+  if (len > cols) len = cols;
   abAppend(ab, status, len);
-  while (len < E.screenCols) {
-    if (E.screenCols - len == rlen) {
+  while (len < cols) {
+    if (cols - len == rlen) {
       abAppend(ab, rstatus, rlen);
       break;
     } else {
@@ -942,7 +8187,7 @@ void editorDrawStatusBar(struct abuf *ab) {
 void editorDrawMessageBar(struct abuf *ab) {
   abAppend(ab, "\x1b[K", 3);
   int msglen = strlen(E.statusmsg);
-  if (msglen > E.screenCols) msglen = E.screenCols;
+  if (msglen > E.screenCols + E.gutter) msglen = E.screenCols + E.gutter;
   if (msglen && time(NULL) - E.statusmsg_time < 5)
     abAppend(ab, E.statusmsg, msglen);
 }
@@ -950,7 +8195,10 @@ void editorDrawMessageBar(struct abuf *ab) {
 
 // This function clears the whole screen
 void editorRefreshScreen() {
+  uint64_t frame_start = traceNow();
   editorScroll();
+  bracketFindPair();
+  diffUpdate();
 
   struct abuf ab = ABUF_INIT;
 
@@ -960,16 +8208,20 @@ void editorRefreshScreen() {
   editorDrawRows(&ab);
   editorDrawStatusBar(&ab);
   editorDrawMessageBar(&ab);
+  editorDrawCompletion(&ab);
 
   char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
-                                            (E.rx - E.coloff) + 1);
+  size_t y = E.wrap ? editorWrapScreenY()
+                    : foldVisibleBefore(E.cy) - foldVisibleBefore(E.rowoff);
+  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (int)y + 1,
+           (int)(E.rx - E.coloff) + E.gutter + 1);
   abAppend(&ab, buf, strlen(buf));
 
   abAppend(&ab, "\x1b[?25h", 6);
 
-  write(STDOUT_FILENO, ab.b, ab.len);
+  editorWrite(ab.b, ab.len);
   abFree(&ab);
+  traceFrameDone(frame_start);
 }
 
 
@@ -985,7 +8237,8 @@ void editorSetStatusMessage(const char *fmt, ...) {
 /*** Input ***/
 
 
-char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
+char *editorPromptEx(char *prompt, void (*callback)(char *, int),
+                     int allow_empty) {
   size_t bufsize = 128;
   char *buf = malloc(bufsize);
   size_t buflen = 0;
@@ -1005,12 +8258,12 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
       return NULL;
     } 
     else if (c == '\r') {
-      if (buflen != 0) {
+      if (buflen != 0 || allow_empty) {
         editorSetStatusMessage("");
         if (callback) callback(buf, c);
         return buf;
       }
-    } else if (!iscntrl(c) && c < 128) {
+    } else if (!iscntrl(c) && c < 256) {
       if (buflen == bufsize - 1) {
         bufsize *= 2;
         buf = realloc(buf, bufsize);
@@ -1023,17 +8276,35 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
   }
 }
 
+char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
+  return editorPromptEx(prompt, callback, 0);
+}
+
 void editorMoveCursor(int key){
+  if (E.wrap && (key == ARROW_UP || key == ARROW_DOWN)) {
+    editorWrapMoveCursor(key);
+    return;
+  }
 
   erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  // up and down keep the screen column, not the byte offset; paging
+  // moves E.cy before calling here, so E.cx may be past this row's end
+  size_t rx = (row && (key == ARROW_UP || key == ARROW_DOWN))
+                  ? editorRowCxToRx(editorRow(E.cy),
+                                    E.cx < row->size ? E.cx : row->size)
+                  : (size_t)-1;
   switch (key) {
 
     // left
     case ARROW_LEFT:
       if(E.cx != 0){
-        E.cx--;
+        // combining marks go with the character before them
+        row = editorRow(E.cy);
+        do {
+          E.cx = utf8Prev(row->chars, E.cx);
+        } while (E.cx > 0 && editorCharCols(row, E.cx) == 0);
       } else if (E.cy > 0) {
-        E.cy--;
+        E.cy = foldPrev(E.cy);
         E.cx = E.row[E.cy].size;
       }
       break;
@@ -1041,9 +8312,14 @@ void editorMoveCursor(int key){
     // right
     case ARROW_RIGHT:
       if (row && E.cx < row->size) {
-        E.cx++;
+        row = editorRow(E.cy);
+        do {
+          size_t n;
+          utf8Cols(&row->chars[E.cx], row->size - E.cx, &n);
+          E.cx += n;
+        } while (E.cx < row->size && editorCharCols(row, E.cx) == 0);
       } else if (row && E.cx == row->size) {
-        E.cy++;
+        E.cy = foldNext(E.cy);
         E.cx = 0;
       }
       break;
@@ -1051,34 +8327,56 @@ void editorMoveCursor(int key){
     // up
     case ARROW_UP:
       if(E.cy != 0){
-        E.cy--;
+        E.cy = foldPrev(E.cy);
       }
       break;
 
     // down
     case ARROW_DOWN:
       if(E.cy < E.numrows){
-        E.cy++;
+        E.cy = foldNext(E.cy);
       }
       break;
   }
   
   row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
-  int rowlen = row ? row->size : 0;
+  if (row && rx != (size_t)-1) E.cx = editorRowRxToCx(editorRow(E.cy), rx);
+  size_t rowlen = row ? row->size : 0;
   if (E.cx > rowlen) {
     E.cx = rowlen;
   }
+  // never stop inside a multi-byte character
+  if (row && E.cx > 0 && E.cx < rowlen) {
+    row = editorRow(E.cy);
+    while (E.cx > 0 && (row->chars[E.cx] & 0xc0) == 0x80) E.cx--;
+  }
 }
 
 // This function processess the key input
 void editorProcessKeypress()
 {
   static int quit_times = CAX_QUIT_TIMES;
+  static size_t typing_row = (size_t)-1;
   int c = editorReadKey();
 
+  // a run of characters typed into one row is undone as a single step
+  int typing = c == '\t' || (!iscntrl(c) && c < 256);
+  if (!typing || E.cy != typing_row || E.ncursors) editorUndoBreak();
+  typing_row = typing ? E.cy : (size_t)-1;
+
+  if (E.ncursors && editorMultiKey(c)) {
+    quit_times = CAX_QUIT_TIMES;
+    return;
+  }
+  if (C.active && editorCompletionKey(c)) {
+    quit_times = CAX_QUIT_TIMES;
+    return;
+  }
+
   switch (c)
   {
     case '\r':
+      if (E.grep_results && grepOpenHit()) break;
       editorInsertNewline();
       break;
 
@@ -1090,11 +8388,15 @@ void editorProcessKeypress()
         quit_times--;
         return;
       }
+      openCacheSave();
+      journalDiscard();
+      // the last buffer quits
+      if (bufferClose()) break;
       // clears screen before exit
-      write(STDOUT_FILENO, "\x1b[2J", 4);
+      editorWrite("\x1b[2J", 4);
 
       // repositions cursor before exit
-      write(STDOUT_FILENO, "\x1b[H", 3);
+      editorWrite("\x1b[H", 3);
       exit(0);
       break;
 
@@ -1115,6 +8417,18 @@ void editorProcessKeypress()
   editorFind();
   break;
 
+  case CTRL_KEY('r'):
+    editorReplace();
+    break;
+
+  case CTRL_KEY('z'):
+    editorUndo();
+    break;
+
+  case CTRL_KEY('g'):
+    editorGrep();
+    break;
+
 
   case BACKSPACE:
   case CTRL_KEY('h'):
@@ -1126,9 +8440,15 @@ void editorProcessKeypress()
   case PAGE_UP:
   case PAGE_DOWN:
     {
-      if (c == PAGE_UP) {
+      if (E.wrap) {
+        // from the first or last visual line on screen
+        size_t v = editorWrapPrefix(E.rowoff) + E.wrapoff, line;
+        if (c == PAGE_DOWN) v += E.screenRows - 1;
+        E.cy = editorWrapFind(v, &line);
+        E.cx = E.cy < E.numrows ? editorWrapCxAt(editorRow(E.cy), line, 0) : 0;
+      } else if (c == PAGE_UP) {
         E.cy = E.rowoff; } else if (c == PAGE_DOWN) {
-        E.cy = E.rowoff + E.screenRows - 1;
+        E.cy = foldNth(foldVisibleBefore(E.rowoff) + E.screenRows - 1);
         if (E.cy > E.numrows) E.cy = E.numrows;
       }
 
@@ -1144,8 +8464,82 @@ void editorProcessKeypress()
     editorMoveCursor(c);
     break;
 
-  case CTRL_KEY('l'):
+  case CTRL_KEY('w'):
+    editorToggleWrap();
+    break;
+
+  case CTRL_KEY('n'):
+    editorCursorBelow();
+    break;
+
+  case CTRL_KEY('e'):
+    editorCursorsAtMatches();
+    break;
+
+  case CTRL_KEY('b'):
+    editorToggleMark();
+    break;
+
+  case CTRL_KEY('p'):
+    editorComplete();
+    break;
+
+  case CTRL_KEY(']'):
+    editorJumpMatch();
+    break;
+
+  case CTRL_KEY('\\'):
+    editorJumpBlockStart();
+    break;
+
+  case CTRL_KEY('k'):
+    editorRangeDelete();
+    break;
+
+  case CTRL_KEY('d'):
+    editorRangeDuplicate();
+    break;
+
+  case ALT_ARROW_UP:
+  case ALT_ARROW_DOWN:
+    editorRangeMove(c);
+    break;
+
+  case SHIFT_TAB:
+    editorRangeIndent(1);
+    break;
+
+  case '\t':
+    if (E.mark != (size_t)-1) editorRangeIndent(0);
+    else editorInsertChar(c);
+    break;
+
   case '\x1b':
+    E.mark = (size_t)-1;
+    break;
+
+  case CTRL_KEY('t'):
+    editorToggleDiff();
+    break;
+
+  case CTRL_KEY('o'):
+    editorOpenPrompt();
+    break;
+
+  case CTRL_KEY('y'):
+    editorToggleFold();
+    break;
+
+  case CTRL_KEY('u'):
+    editorToggleFoldAll();
+    break;
+
+  case ALT_ARROW_LEFT:
+  case ALT_ARROW_RIGHT:
+    editorCycleBuffer(c == ALT_ARROW_LEFT ? -1 : 1);
+    break;
+
+  case CTRL_KEY('l'):
     break;
 
   default:
@@ -1157,45 +8551,784 @@ void editorProcessKeypress()
 }
 
 
+/*** Daemon ***/
+
+/*
+ * cax --daemon keeps files loaded, rendered and highlighted so that opening
+ * one again costs a fork instead of a full load. The daemon starts one
+ * holder process per file. A plain "cax FILE" first tries the daemon's
+ * socket, and if it answers only passes over its terminal: the holder forks
+ * a session that runs the editor on that terminal with a copy-on-write
+ * image of the loaded buffer, so any number of sessions share its memory
+ * until they change it. The client just waits for its session to end. A
+ * holder loads its file again when it changed on disk.
+ */
+
+struct daemonRequest {
+  char path[4096];            // absolute, or empty for a new buffer
+  char cwd[4096];             // sessions run in the client's directory
+};
+
+struct daemonHolder {
+  char *path;
+  int ctl;                    // requests are passed down this socket
+};
+
+struct daemonHolder *holders;
+size_t nholders;
+
+// The socket lives in $XDG_RUNTIME_DIR, or else in a /tmp/cax-UID directory
+// that must be ours and private, since anyone can create names in /tmp.
+// Returns -1 when there is no such directory.
+int daemonSocketPath(struct sockaddr_un *addr, int create) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  const char *dir = getenv("XDG_RUNTIME_DIR");
+  if (dir && *dir && strlen(dir) < sizeof(addr->sun_path) - 10) {
+    sprintf(addr->sun_path, "%s/cax.sock", dir);
+    return 0;
+  }
+  char priv[64];
+  snprintf(priv, sizeof(priv), "/tmp/cax-%u", (unsigned)getuid());
+  if (create) mkdir(priv, 0700);
+  struct stat st;
+  if (lstat(priv, &st) == -1 || !S_ISDIR(st.st_mode) ||
+      st.st_uid != getuid() || (st.st_mode & 077))
+    return -1;
+  snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/cax.sock", priv);
+  return 0;
+}
+
+// Whether the process at the other end of sock runs as this user
+int daemonPeerIsOurs(int sock) {
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) return 0;
+  return cred.uid == getuid();
+}
+
+int daemonSend(int sock, struct daemonRequest *req, int *fds, int nfds) {
+  union {
+    struct cmsghdr h;
+    char buf[CMSG_SPACE(2 * sizeof(int))];
+  } u;
+  struct iovec iov = { req, sizeof(*req) };
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = u.buf;
+  msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+  struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+  memcpy(CMSG_DATA(c), fds, nfds * sizeof(int));
+  return sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(*req) ? 0 : -1;
+}
+
+// Returns the number of fds received, 0 at end of file or -1
+int daemonRecv(int sock, struct daemonRequest *req, int *fds, int nfds) {
+  union {
+    struct cmsghdr h;
+    char buf[CMSG_SPACE(2 * sizeof(int))];
+  } u;
+  struct iovec iov = { req, sizeof(*req) };
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = u.buf;
+  msg.msg_controllen = sizeof(u.buf);
+  ssize_t n;
+  while ((n = recvmsg(sock, &msg, 0)) == -1 && errno == EINTR);
+  if (n <= 0) return n;
+  int got = 0;
+  struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+  if (c && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+    got = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(c), got * sizeof(int));
+  }
+  if (n != sizeof(*req) || got != nfds) {
+    for (int i = 0; i < got; i++) close(fds[i]);
+    return -1;
+  }
+  req->path[sizeof(req->path) - 1] = '\0';
+  req->cwd[sizeof(req->cwd) - 1] = '\0';
+  return got;
+}
+
+// Hands the terminal to a running daemon and waits for the session to end.
+// Returns only when no daemon is listening.
+void daemonAttach(const char *filename) {
+  struct sockaddr_un addr;
+  if (daemonSocketPath(&addr, 0) == -1) return;
+  int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (sock == -1) return;
+  // never hand our terminal to a listener that is not our own daemon
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      !daemonPeerIsOurs(sock)) {
+    close(sock);
+    return;
+  }
+  struct daemonRequest req;
+  memset(&req, 0, sizeof(req));
+  if (!getcwd(req.cwd, sizeof(req.cwd))) req.cwd[0] = '\0';
+  if (filename) {
+    char *abs = realpath(filename, NULL);
+    int len;
+    if (abs)
+      len = snprintf(req.path, sizeof(req.path), "%s", abs);
+    else if (filename[0] == '/')
+      len = snprintf(req.path, sizeof(req.path), "%s", filename);
+    else
+      len = snprintf(req.path, sizeof(req.path), "%.2047s/%.2047s",
+                     req.cwd, filename);
+    free(abs);
+    if (len >= (int)sizeof(req.path)) {
+      close(sock);
+      return;
+    }
+  }
+  int tty = STDIN_FILENO;
+  if (daemonSend(sock, &req, &tty, 1) == -1) {
+    close(sock);
+    return;
+  }
+  // the session holds the other end until it exits. SIGWINCH goes to the
+  // terminal's foreground group, which is us, so it is passed on.
+  sigset_t block, wait;
+  sigemptyset(&block);
+  sigaddset(&block, SIGWINCH);
+  sigprocmask(SIG_BLOCK, &block, &wait);
+  sigdelset(&wait, SIGWINCH);
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handleSigWinch;
+  sigaction(SIGWINCH, &sa, NULL);
+  while (1) {
+    fd_set in;
+    FD_ZERO(&in);
+    FD_SET(sock, &in);
+    if (pselect(sock + 1, &in, NULL, NULL, NULL, &wait) == -1) {
+      if (errno != EINTR) break;
+      if (winch) send(sock, "w", 1, MSG_NOSIGNAL);
+      winch = 0;
+      continue;
+    }
+    char c;
+    if (read(sock, &c, 1) <= 0) break;
+  }
+  exit(0);
+}
+
+// Picks up the resizes the client passed on, without waiting
+void daemonPollWinch() {
+  char c;
+  ssize_t n;
+  while ((n = recv(winch_sock, &c, 1, MSG_DONTWAIT)) > 0) winch = 1;
+  if (n == 0) {
+    close(winch_sock);
+    winch_sock = -1;
+  }
+}
+
+// Loads path unless it is already loaded and unchanged on disk. A file
+// that cannot be read is left for the session to fail on, as cax would.
+void daemonHolderLoad(const char *path, struct stat *loaded) {
+  struct stat st;
+  if (!*path || stat(path, &st) == -1 || access(path, R_OK) == -1) return;
+  if (E.filename && st.st_ino == loaded->st_ino &&
+      st.st_size == loaded->st_size &&
+      st.st_mtim.tv_sec == loaded->st_mtim.tv_sec &&
+      st.st_mtim.tv_nsec == loaded->st_mtim.tv_nsec)
+    return;
+  editorCloseBuffer();
+  editorOpen((char *)path);
+  *loaded = st;
+}
+
+// client is the client's socket, held until the session exits
+void daemonSession(struct daemonRequest *req, int client, int tty) {
+  winch_sock = client;
+  dup2(tty, STDIN_FILENO);
+  dup2(tty, STDOUT_FILENO);
+  dup2(tty, STDERR_FILENO);
+  close(tty);
+  if (*req->cwd && chdir(req->cwd) == -1) die("chdir");
+  pagerPrivateSwap();
+  daemon_holder = 0;
+  enableRawMode();
+  editorInitWindow();
+  // the holder loaded the file without a journal, so it is armed here
+  if (!E.filename && *req->path) editorOpen(req->path);
+  else journalRecover();
+  editorRun();
+}
+
+void daemonHolderMain(const char *path, int ctl) {
+  struct stat loaded;
+  memset(&loaded, 0, sizeof(loaded));
+  E.shared = 1;
+  daemon_holder = 1;
+  daemonHolderLoad(path, &loaded);
+  while (1) {
+    struct daemonRequest req;
+    int fds[2];
+    int n = daemonRecv(ctl, &req, fds, 2);
+    if (n == 0) _exit(0);
+    if (n == -1) continue;
+    daemonHolderLoad(path, &loaded);
+    pid_t pid = fork();
+    if (pid == 0) {
+      // fds[0] is the client's socket, kept open until the session exits
+      close(ctl);
+      daemonSession(&req, fds[0], fds[1]);
+    }
+    close(fds[0]);
+    close(fds[1]);
+  }
+}
+
+// fds are the daemon's own descriptors, which the holder must not keep
+struct daemonHolder *daemonSpawnHolder(const char *path, int *fds, int nfds) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1) return NULL;
+  pid_t pid = fork();
+  if (pid == -1) {
+    close(sv[0]);
+    close(sv[1]);
+    return NULL;
+  }
+  if (pid == 0) {
+    for (int i = 0; i < nfds; i++) close(fds[i]);
+    close(sv[0]);
+    for (size_t j = 0; j < nholders; j++) close(holders[j].ctl);
+    daemonHolderMain(path, sv[1]);
+  }
+  close(sv[1]);
+  holders = realloc(holders, sizeof(struct daemonHolder) * (nholders + 1));
+  holders[nholders].path = strdup(path);
+  holders[nholders].ctl = sv[0];
+  return &holders[nholders++];
+}
+
+void daemonDropHolder(struct daemonHolder *h) {
+  close(h->ctl);
+  free(h->path);
+  *h = holders[--nholders];
+}
+
+int daemonMain() {
+  struct sockaddr_un addr;
+  if (daemonSocketPath(&addr, 1) == -1) {
+    fprintf(stderr, "cax: /tmp/cax-%u is not a private directory of ours\n",
+            (unsigned)getuid());
+    return 1;
+  }
+  int lsock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (lsock == -1) die("socket");
+  // a socket nobody answers on is left over from an earlier daemon
+  if (connect(lsock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+    fprintf(stderr, "cax: a daemon is already listening on %s\n",
+            addr.sun_path);
+    return 1;
+  }
+  close(lsock);
+  lsock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  unlink(addr.sun_path);
+  mode_t mask = umask(077);
+  if (bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) == -1) die("bind");
+  umask(mask);
+  if (listen(lsock, 16) == -1) die("listen");
+  // holders and sessions are never waited for
+  signal(SIGCHLD, SIG_IGN);
+  signal(SIGPIPE, SIG_IGN);
+  fprintf(stderr, "cax: listening on %s\n", addr.sun_path);
+
+  while (1) {
+    int client = accept(lsock, NULL, NULL);
+    if (client == -1) {
+      if (errno == EINTR) continue;
+      die("accept");
+    }
+    if (!daemonPeerIsOurs(client)) {
+      close(client);
+      continue;
+    }
+    struct daemonRequest req;
+    int tty;
+    if (daemonRecv(client, &req, &tty, 1) != 1) {
+      close(client);
+      continue;
+    }
+    struct daemonHolder *h = NULL;
+    for (size_t j = 0; j < nholders; j++)
+      if (!strcmp(holders[j].path, req.path)) h = &holders[j];
+    int fds[2] = { client, tty };
+    int own[3] = { lsock, client, tty };
+    if (h && daemonSend(h->ctl, &req, fds, 2) == -1) {
+      // the holder is gone; start a new one
+      daemonDropHolder(h);
+      h = NULL;
+    }
+    if (!h) {
+      h = daemonSpawnHolder(req.path, own, 3);
+      if (h && daemonSend(h->ctl, &req, fds, 2) == -1) daemonDropHolder(h);
+    }
+    close(client);
+    close(tty);
+  }
+}
+
 /*** Init ***/
 
-void initEditor()
-{
+// Resets what belongs to one buffer, for an empty one
+void editorInitBuffer() {
   E.cx = 0;
   E.cy = 0;
   E.rx = 0;
   E.rowoff = 0;
+  E.coloff = 0;
+  E.wrapoff = 0;
+  E.wrap_gen = 1;
+  memset(&E.rows, 0, sizeof(E.rows));
+  E.hidden = 0;
+  E.cursors = NULL;
+  E.ncursors = 0;
+  E.mark = (size_t)-1;
   E.numrows = 0;
   E.row = NULL;
   E.dirty = 0;
   E.filename = NULL;
+  E.syntax = NULL;
+  E.undo = NULL;
+  E.nundo = 0;
+  E.undo_break = 1;
+  E.undo_suspended = 0;
+  E.grep_results = 0;
+  E.hot_bytes = 0;
+  E.cold_bytes = 0;
+  E.cold_hand = 0;
+  E.paged_bytes = 0;
+  E.lru_head = E.lru_tail = NULL;
+  E.srcfd = -1;
+  E.swapfd = -1;
+  E.swap_end = 0;
+}
+
+void initEditor()
+{
+  kernelsInit();
+  utf8WidthInit();
+  editorInitBuffer();
+  E.wrap = 0;
   E.statusmsg[0] = '\0';
   E.statusmsg_time = 0;
-  E.syntax = NULL;
+  if (!E.hot_budget) E.hot_budget = CAX_HOT_BUDGET;
+  // keep room under the ceiling for the compressed blocks themselves
+  if (E.max_resident && E.hot_budget > E.max_resident / 2)
+    E.hot_budget = E.max_resident / 2;
+
+}
+
+void handleSigWinch(int sig) {
+  (void)sig;
+  winch = 1;
+}
 
-  if (getWindowSize(&E.screenRows, &E.screenCols) == -1)
+void editorInitWindow() {
+  if (T.replaying) {
+    E.screenRows = T.rows;
+    E.screenCols = T.cols;
+  } else if (getWindowSize(&E.screenRows, &E.screenCols) == -1)
     die("getWindowSize");
   E.screenRows -= 2;
+  if (!T.replaying) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handleSigWinch;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGWINCH, &sa, NULL);
+  }
 }
 
-int main(int argc , char * argv[])
-{
-  enableRawMode();
+// Picks up a new terminal size. Wrapped layouts go stale, and only the
+// rows drawn from now on are laid out again.
+void editorHandleResize() {
+  winch = 0;
+  int rows, cols;
+  if (getWindowSize(&rows, &cols) == -1) return;
+  E.screenRows = rows - 2;
+  cols -= E.gutter;
+  if (cols != E.screenCols) {
+    E.screenCols = cols;
+    if (E.wrap) editorWrapInvalidate();
+  }
+  editorRefreshScreen();
+}
+
+/*** Microbenchmarks ***/
+
+/*
+ * make microbench builds this file a second time, with CAX_MICROBENCH, into
+ * a binary that runs the core routines on generated buffers instead of a
+ * terminal. Each routine is timed over a whole buffer, again and again for
+ * CAX_BENCH_MS, and reported in ns per call, ns per byte it went over and
+ * allocations per call. The results are also written as JSON, one result
+ * per line, and --compare reads such a file back to show the change.
+ */
+
+#ifdef CAX_MICROBENCH
+
+#define CAX_BENCH_MS 200
+#define CAX_BENCH_BYTES (4u << 20)
+
+enum benchInput {
+  BENCH_LONG,                 // 4 KB lines of mixed code
+  BENCH_TABS,                 // deeply indented, tabs inside lines too
+  BENCH_COMMENTS,             // long block comments, a few levels deep
+  BENCH_KEYWORDS,             // little but keywords
+  BENCH_INPUTS
+};
+
+enum benchRoutine {
+  BENCH_UPDATE_ROW,
+  BENCH_UPDATE_SYNTAX,
+  BENCH_CX_TO_RX,
+  BENCH_DRAW_ROWS,
+  BENCH_ROWS_TO_STRING,
+  BENCH_FIND,
+  BENCH_ROUTINES
+};
+
+const char *bench_inputs[] = {
+  "long lines", "tab-heavy", "deep comments", "keywords"
+};
+
+const char *bench_routines[] = {
+  "editorUpdateRow", "editorUpdateSyntax", "editorRowCxToRx",
+  "editorDrawRows", "editorRowsToString", "editorFindCallback"
+};
+
+// Writes line n of an input into buf, which has room for 4200 bytes
+size_t benchLine(int input, size_t n, char *buf, unsigned *seed) {
+  static const char *words[] = {
+    "count", "next", "len", "buf", "row", "i", "0", "1", "=", "+", "(", ")",
+    "->", ";", "\"str\"", "'c'", "0x7f", "{", "}"
+  };
+  static const char *keywords[] = {
+    "if", "while", "for", "return", "int", "char", "struct", "static",
+    "unsigned", "switch", "case", "break", "else", "typedef", "long", "void"
+  };
+  size_t len = 0;
+  switch (input) {
+    case BENCH_LONG:
+      return kernelsLine(buf, 4000, seed);
+    case BENCH_TABS: {
+      size_t depth = 1 + rand_r(seed) % 6, n = 3 + rand_r(seed) % 6;
+      while (depth--) buf[len++] = '\t';
+      for (size_t i = 0; i < n; i++) {
+        const char *w = words[rand_r(seed) % (sizeof(words) / sizeof(*words))];
+        memcpy(buf + len, w, strlen(w));
+        len += strlen(w);
+        buf[len++] = rand_r(seed) % 3 ? ' ' : '\t';
+      }
+      memcpy(buf + len, "\t// x", 5);
+      return len + 5;
+    }
+    case BENCH_COMMENTS: {
+      // a block comment every 100 lines, 80 long and indented by depth
+      size_t depth = n / 100 % 8, at = n % 100;
+      while (depth--) buf[len++] = '\t';
+      const char *text = at == 0 ? "/* begins a long note about {row} (" :
+                         at == 79 ? " * ends it ) */ int x = 1;" :
+                         at < 79 ? " * keeps going: \"quoted\" /* if while */" :
+                         "x = count(row); // and a short one";
+      memcpy(buf + len, text, strlen(text));
+      return len + strlen(text);
+    }
+    default: {
+      size_t n = 6 + rand_r(seed) % 8;
+      for (size_t i = 0; i < n; i++) {
+        const char *w =
+          keywords[rand_r(seed) % (sizeof(keywords) / sizeof(*keywords))];
+        memcpy(buf + len, w, strlen(w));
+        len += strlen(w);
+        buf[len++] = ' ';
+      }
+      return len;
+    }
+  }
+}
+
+// Fills the buffer, as the C file "bench.c", with about CAX_BENCH_BYTES
+// of an input
+void benchLoad(int input) {
+  char buf[4200];
+  unsigned seed = 1;
+  editorCloseBuffer();
+  E.filename = strdup("bench.c");
+  editorSelectSyntaxHighlight();
+  E.undo_suspended++;
+  for (size_t bytes = 0; bytes < CAX_BENCH_BYTES;) {
+    size_t len = benchLine(input, E.numrows, buf, &seed);
+    editorInsertRow(E.numrows, buf, len);
+    bytes += len + 1;
+  }
+  E.undo_suspended--;
+}
+
+// Runs a routine once over the whole buffer; returns how many calls that
+// took and adds the bytes they went over to *bytes
+uint64_t benchPass(int routine, uint64_t *bytes) {
+  uint64_t calls = 0;
+  switch (routine) {
+    case BENCH_UPDATE_ROW:
+      for (size_t j = 0; j < E.numrows; j++, calls++) {
+        editorUpdateRow(&E.row[j]);
+        *bytes += E.row[j].size;
+      }
+      break;
+    case BENCH_UPDATE_SYNTAX:
+      for (size_t j = 0; j < E.numrows; j++, calls++) {
+        editorUpdateSyntax(&E.row[j]);
+        *bytes += E.row[j].rsize;
+      }
+      break;
+    case BENCH_CX_TO_RX:
+      for (size_t j = 0; j < E.numrows; j++, calls++) {
+        *bytes += E.row[j].size;
+        if (editorRowCxToRx(&E.row[j], E.row[j].size) < E.row[j].size)
+          die("editorRowCxToRx");
+      }
+      break;
+    case BENCH_DRAW_ROWS:
+      for (E.rowoff = 0; E.rowoff < E.numrows; E.rowoff += E.screenRows) {
+        struct abuf ab = ABUF_INIT;
+        editorDrawRows(&ab);
+        *bytes += ab.len;
+        abFree(&ab);
+        calls++;
+      }
+      E.rowoff = 0;
+      break;
+    case BENCH_ROWS_TO_STRING: {
+      size_t len;
+      free(editorRowsToString(&len));
+      *bytes += len;
+      calls++;
+      break;
+    }
+    case BENCH_FIND:
+      // nothing matches, so every row is searched
+      editorFindCallback("no such text", 0);
+      editorFindCallback("no such text", '\r');
+      for (size_t j = 0; j < E.numrows; j++) *bytes += E.row[j].rsize;
+      calls++;
+      break;
+  }
+  return calls;
+}
+
+// Returns the ns per byte that a --compare file has for routine on input,
+// or 0
+double benchBaseline(FILE *fp, const char *routine, const char *input) {
+  char line[512], r[64], in[64];
+  double ns_byte;
+  if (!fp) return 0;
+  rewind(fp);
+  while (fgets(line, sizeof(line), fp))
+    if (sscanf(line, " {\"routine\": \"%63[^\"]\", \"input\": \"%63[^\"]\", "
+               "\"calls\": %*u, \"ns_per_call\": %*f, \"ns_per_byte\": %lf",
+               r, in, &ns_byte) == 3 &&
+        !strcmp(r, routine) && !strcmp(in, input))
+      return ns_byte;
+  return 0;
+}
+
+int microbenchMain(int argc, char *argv[]) {
+  const char *out = "microbench.json";
+  FILE *base = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+      out = argv[++i];
+    } else if (!strcmp(argv[i], "--compare") && i + 1 < argc) {
+      if (!(base = fopen(argv[++i], "r"))) die(argv[i]);
+    } else {
+      fprintf(stderr, "Usage: microbench [-o OUT.json] [--compare OLD.json]\n");
+      return 1;
+    }
+  }
+  FILE *json = fopen(out, "w");
+  if (!json) die(out);
   initEditor();
-  if(argc >= 2){
-    editorOpen(argv[1]);
+  E.screenRows = 48;
+  E.screenCols = 160;
+  fprintf(json, "{\n  \"kernels\": \"%s\",\n  \"results\": [\n", K.name);
+  printf("%-20s %-14s %12s %9s %12s%s\n", "routine", "input", "ns/call",
+         "ns/byte", "allocs/call", base ? "   vs old" : "");
+  int first = 1;
+  for (int input = 0; input < BENCH_INPUTS; input++) {
+    benchLoad(input);
+    for (int routine = 0; routine < BENCH_ROUTINES; routine++) {
+      uint64_t bytes = 0, calls = 0;
+      benchPass(routine, &bytes);       // warm up
+      bytes = 0;
+      uint64_t allocs = bench_allocs, start = traceNow(), ns;
+      do {
+        calls += benchPass(routine, &bytes);
+        ns = traceNow() - start;
+      } while (ns < CAX_BENCH_MS * 1000000ull);
+      double ns_call = (double)ns / calls, ns_byte = (double)ns / bytes;
+      double allocs_call = (double)(bench_allocs - allocs) / calls;
+      printf("%-20s %-14s %12.1f %9.3f %12.3f", bench_routines[routine],
+             bench_inputs[input], ns_call, ns_byte, allocs_call);
+      double old = benchBaseline(base, bench_routines[routine],
+                                 bench_inputs[input]);
+      if (old > 0) printf("   %6.2fx", old / ns_byte);
+      printf("\n");
+      fprintf(json, "%s    {\"routine\": \"%s\", \"input\": \"%s\", "
+              "\"calls\": %llu, \"ns_per_call\": %.3f, \"ns_per_byte\": %.4f, "
+              "\"allocs_per_call\": %.4f}", first ? "" : ",\n",
+              bench_routines[routine], bench_inputs[input],
+              (unsigned long long)calls, ns_call, ns_byte, allocs_call);
+      first = 0;
+    }
   }
+  fprintf(json, "\n  ]\n}\n");
+  fclose(json);
+  if (base) fclose(base);
+  printf("Results written to %s\n", out);
+  return 0;
+}
+
+#endif
 
+void usage() {
+  fprintf(stderr, "Usage: cax [--trace TRACEFILE] [--memory-budget SIZE] "
+                  "[--max-resident SIZE] [FILE... | -]\n"
+                  "       cax --replay TRACEFILE [FILE]\n"
+                  "       cax [--memory-budget SIZE] --batch SCRIPT FILE...\n"
+                  "       cax [--memory-budget SIZE] [--max-resident SIZE] "
+                  "--daemon\n"
+                  "       cax --bench-kernels\n");
+  exit(1);
+}
+
+// Parses sizes like 4096, 512K, 64M or 2G
+size_t parseSize(const char *s) {
+  char *end;
+  unsigned long long n = strtoull(s, &end, 10);
+  switch (toupper((unsigned char)*end)) {
+    case 'G': n <<= 10; /* fall through */
+    case 'M': n <<= 10; /* fall through */
+    case 'K': n <<= 10; end++; break;
+  }
+  if (end == s || *end) return 0;
+  return n;
+}
 
-  editorSetStatusMessage(
-    "HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+void editorRun() {
+  // anything opening the file had to say wins over the help line
+  if (E.statusmsg[0] == '\0')
+    editorSetStatusMessage(
+    "HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | "
+    "Ctrl-R = replace | Ctrl-G = grep | Ctrl-Z = undo");
 
   while (1)
   {
 
     editorRefreshScreen();
     editorProcessKeypress();
+    editorColdMaybeSweep();
+  }
+}
+
+int main(int argc , char * argv[])
+{
+#ifdef CAX_MICROBENCH
+  return microbenchMain(argc, argv);
+#endif
+  char *filename = NULL;
+  char **more = malloc(sizeof(char *) * argc);
+  size_t nmore = 0;
+  char *trace = NULL;
+  char *replay = NULL;
+  int serve = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--trace")) {
+      if (++i == argc) usage();
+      trace = argv[i];
+    } else if (!strcmp(argv[i], "--replay")) {
+      if (++i == argc) usage();
+      replay = argv[i];
+    } else if (!strcmp(argv[i], "--memory-budget")) {
+      if (++i == argc || !(E.hot_budget = parseSize(argv[i]))) usage();
+    } else if (!strcmp(argv[i], "--max-resident")) {
+      if (++i == argc || !(E.max_resident = parseSize(argv[i]))) usage();
+    } else if (!strcmp(argv[i], "--batch")) {
+      // everything after the script is a file to run it on
+      if (i + 2 >= argc) usage();
+      E.headless = 1;
+      initEditor();
+      return batchMain(argv[i + 1], &argv[i + 2], argc - i - 2);
+    } else if (!strcmp(argv[i], "--bench-kernels")) {
+      initEditor();
+      return kernelsBench();
+    } else if (!strcmp(argv[i], "--daemon")) {
+      serve = 1;
+    } else if (argv[i][0] == '-' && argv[i][1] == '-') {
+      usage();
+    } else if (!filename) {
+      filename = argv[i];
+    } else {
+      // opened in buffers of their own when first switched to
+      more[nmore++] = argv[i];
+    }
+  }
+
+  if (serve) {
+    initEditor();
+    return daemonMain();
+  }
+  // a plain interactive start goes to the daemon when one is running
+  if (!trace && !replay && !E.hot_budget && !E.max_resident &&
+      !nmore && isatty(STDIN_FILENO) && isatty(STDOUT_FILENO) &&
+      !(filename && !strcmp(filename, "-")))
+    daemonAttach(filename);
+
+  // "cax -" or a pipe on stdin: stream it and take keys from the terminal
+  int stream_fd = -1;
+  if (!replay && ((filename && !strcmp(filename, "-")) ||
+                  (!filename && !isatty(STDIN_FILENO)))) {
+    stream_fd = dup(STDIN_FILENO);
+    int tty = open("/dev/tty", O_RDWR);
+    if (stream_fd == -1 || tty == -1) die("/dev/tty");
+    dup2(tty, STDIN_FILENO);
+    close(tty);
+    filename = NULL;
+  }
+
+  if (replay) {
+    traceReplayStart(replay);
+    if (!filename) filename = T.filename;
+  } else {
+    enableRawMode();
+  }
+  initEditor();
+  editorInitWindow();
+  if (trace)
+    traceStart(trace, E.screenRows + 2, E.screenCols, filename);
+  if(filename){
+    editorOpen(filename);
+  } else if (stream_fd != -1) {
+    editorStreamFd(stream_fd, "[stdin]");
   }
+  if (nmore) bufferAdd(more, nmore);
+  free(more);
 
+  editorRun();
   return 0;
 }
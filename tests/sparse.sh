@@ -0,0 +1,33 @@
+#!/bin/sh
+# Opens, edits and saves a sparse file over 2GB with --batch, then checks
+# that only the first and last lines changed. Needs about 2.3GB of free
+# disk in $TMPDIR, since the saved file is no longer sparse.
+set -e
+
+CAX=${CAX:-./cax}
+SIZE=$((2300 * 1024 * 1024))
+LINE=$((16 * 1024 * 1024))
+
+dir=$(mktemp -d "${TMPDIR:-/tmp}/cax-test-XXXXXX")
+trap 'rm -rf "$dir"' EXIT
+
+# lines of NUL bytes, 16MB each, between a first and a last marker line
+truncate -s $SIZE "$dir/big"
+printf 'first\n' | dd of="$dir/big" conv=notrunc status=none
+off=$LINE
+while [ $off -lt $((SIZE - LINE)) ]; do
+  printf '\n' | dd of="$dir/big" bs=1 seek=$off conv=notrunc status=none
+  off=$((off + LINE))
+done
+printf 'last\n' | dd of="$dir/big" bs=1 seek=$((SIZE - 5)) conv=notrunc \
+  status=none
+cp --sparse=always "$dir/big" "$dir/orig"
+
+printf 's/first/FIRST/\ns/last/LAST/\n' > "$dir/script"
+"$CAX" --memory-budget 256M --batch "$dir/script" "$dir/big" > /dev/null
+
+[ "$(stat -c %s "$dir/big")" -eq $SIZE ]
+[ "$(head -c 6 "$dir/big")" = "FIRST" ]
+[ "$(tail -c 5 "$dir/big")" = "LAST" ]
+cmp -i 6 -n $((SIZE - 11)) "$dir/orig" "$dir/big"
+echo "sparse: ok"